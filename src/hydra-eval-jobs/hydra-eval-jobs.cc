@@ -1,4 +1,6 @@
+#include <algorithm>
 #include <iostream>
+#include <mutex>
 #include <thread>
 #include <optional>
 #include <unordered_map>
@@ -16,12 +18,15 @@
 #include "attr-path.hh"
 #include "derivations.hh"
 #include "local-fs-store.hh"
+#include "remote-store.hh"
 
 #include "hydra-config.hh"
+#include "job-queue.hh"
 
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/resource.h>
+#include <sys/socket.h>
 
 #include <nlohmann/json.hpp>
 
@@ -58,6 +63,7 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
     Path releaseExpr;
     bool flake = false;
     bool dryRun = false;
+    bool stream = false;
 
     MyArgs() : MixCommonArgs("hydra-eval-jobs")
     {
@@ -74,6 +80,12 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
             .handler = {&dryRun, true}
         });
 
+        addFlag({
+            .longName = "stream",
+            .description = "print each job as a line of JSON as soon as it's evaluated",
+            .handler = {&stream, true}
+        });
+
         addFlag({
             .longName = "flake",
             .description = "build a flake",
@@ -86,6 +98,13 @@ struct MyArgs : MixEvalArgs, MixCommonArgs
 
 static MyArgs myArgs;
 
+/* Print a job as a single line of JSON, for ‘--stream’. */
+static void printJobLine(const std::string & jobName, nlohmann::json job)
+{
+    job["jobName"] = jobName;
+    std::cout << job.dump() << std::endl;
+}
+
 static std::string queryMetaStrings(EvalState & state, DrvInfo & drv, const std::string & name, const std::string & subAttribute)
 {
     Strings res;
@@ -111,11 +130,9 @@ static std::string queryMetaStrings(EvalState & state, DrvInfo & drv, const std:
     return concatStringsSep(", ", res);
 }
 
-static void worker(
-    EvalState & state,
-    Bindings & autoArgs,
-    AutoCloseFD & to,
-    AutoCloseFD & from)
+/* Evaluate the release expression and return the attribute set of
+   jobs. */
+static Value * evalRoot(EvalState & state, Bindings & autoArgs)
 {
     Value vTop;
 
@@ -152,138 +169,332 @@ static void worker(
 
     auto vRoot = state.allocValue();
     state.autoCallFunction(autoArgs, vTop, *vRoot);
+    return vRoot;
+}
+
+/* The memory used by this process in KiB, not counting pages that
+   are shared with other processes. The workers forked by the zygote
+   share its evaluated top level copy-on-write, so their RSS starts
+   out as large as the zygote's. */
+static size_t privateMemorySize()
+{
+    try {
+        size_t total = 0;
+        for (auto & line : tokenizeString<std::vector<std::string>>(readFile("/proc/self/smaps_rollup"), "\n")) {
+            auto tokens = tokenizeString<std::vector<std::string>>(line);
+            if (tokens.size() >= 2 && (tokens[0] == "Private_Clean:" || tokens[0] == "Private_Dirty:"))
+                total += string2Int<size_t>(tokens[1]).value_or(0);
+        }
+        return total;
+    } catch (SysError &) {
+        /* Kernels before 4.14 don't have smaps_rollup. */
+        struct rusage r;
+        getrusage(RUSAGE_SELF, &r);
+        return r.ru_maxrss;
+    }
+}
+
+/* Whether this process uses more memory than evaluator_max_memory_size.
+   Reading smaps_rollup walks all mappings of the process, which is
+   slow for an evaluator. The peak RSS is an upper bound of the
+   private memory, so smaps_rollup is only read once that is over the
+   limit, and then only every 16 jobs. */
+static bool overMemoryLimit(size_t & nrJobs)
+{
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    if ((size_t) r.ru_maxrss <= maxMemorySize * 1024) return false;
+    if (nrJobs++ % 16) return false;
+    return privateMemorySize() > maxMemorySize * 1024;
+}
+
+/* Tell the master how much memory (in KiB) and CPU time (in seconds)
+   this worker used. This is the last thing a worker does before it
+   exits. */
+static void writeUsage(AutoCloseFD & to)
+{
+    struct rusage r;
+    getrusage(RUSAGE_SELF, &r);
+    nlohmann::json usage;
+    usage["memory"] = privateMemorySize();
+    usage["cpuTime"] = r.ru_utime.tv_sec + r.ru_stime.tv_sec
+        + (r.ru_utime.tv_usec + r.ru_stime.tv_usec) / 1e6;
+    writeLine(to.get(), "usage " + usage.dump());
+}
+
+static void worker(
+    EvalState & state,
+    Bindings & autoArgs,
+    Value & vRoot,
+    AutoCloseFD & to,
+    AutoCloseFD & from)
+{
+    size_t nrJobs = 0;
 
     while (true) {
-        /* Wait for the master to send us a job name. */
+        /* Wait for the master to send us a batch of job names. */
         writeLine(to.get(), "next");
 
         auto s = readLine(from.get());
-        if (s == "exit") break;
+        if (s == "exit") {
+            writeUsage(to);
+            break;
+        }
         if (!hasPrefix(s, "do ")) abort();
-        std::string attrPath(s, 3);
-
-        debug("worker process %d at '%s'", getpid(), attrPath);
-
-        /* Evaluate it and send info back to the master. */
-        nlohmann::json reply;
-
-        try {
-            auto vTmp = findAlongAttrPath(state, attrPath, autoArgs, *vRoot).first;
-
-            auto v = state.allocValue();
-            state.autoCallFunction(autoArgs, *vTmp, *v);
-
-            if (auto drv = getDerivation(state, *v, false)) {
-
-                DrvInfo::Outputs outputs = drv->queryOutputs();
-
-                if (drv->querySystem() == "unknown")
-                    throw EvalError("derivation must have a 'system' attribute");
-
-                auto drvPath = state.store->printStorePath(drv->requireDrvPath());
-
-                nlohmann::json job;
-
-                job["nixName"] = drv->queryName();
-                job["system"] =drv->querySystem();
-                job["drvPath"] = drvPath;
-                job["description"] = drv->queryMetaString("description");
-                job["license"] = queryMetaStrings(state, *drv, "license", "shortName");
-                job["homepage"] = drv->queryMetaString("homepage");
-                job["maintainers"] = queryMetaStrings(state, *drv, "maintainers", "email");
-                job["schedulingPriority"] = drv->queryMetaInt("schedulingPriority", 100);
-                job["timeout"] = drv->queryMetaInt("timeout", 36000);
-                job["maxSilent"] = drv->queryMetaInt("maxSilent", 7200);
-                job["isChannel"] = drv->queryMetaBool("isHydraChannel", false);
-
-                /* If this is an aggregate, then get its constituents. */
-                auto a = v->attrs->get(state.symbols.create("_hydraAggregate"));
-                if (a && state.forceBool(*a->value, a->pos, "while evaluating the `_hydraAggregate` attribute")) {
-                    auto a = v->attrs->get(state.symbols.create("constituents"));
-                    if (!a)
-                        throw EvalError("derivation must have a ‘constituents’ attribute");
-
-                    NixStringContext context;
-                    state.coerceToString(a->pos, *a->value, context, "while evaluating the `constituents` attribute", true, false);
-                    for (auto & c : context)
-                        std::visit(overloaded {
-                            [&](const NixStringContextElem::Built & b) {
-                                job["constituents"].push_back(state.store->printStorePath(b.drvPath));
-                            },
-                            [&](const NixStringContextElem::Opaque & o) {
-                            },
-                            [&](const NixStringContextElem::DrvDeep & d) {
-                            },
-                        }, c.raw());
-
-                    state.forceList(*a->value, a->pos, "while evaluating the `constituents` attribute");
-                    for (unsigned int n = 0; n < a->value->listSize(); ++n) {
-                        auto v = a->value->listElems()[n];
-                        state.forceValue(*v, noPos);
-                        if (v->type() == nString)
-                            job["namedConstituents"].push_back(v->str());
+        std::vector<std::string> attrPaths = nlohmann::json::parse(std::string(s, 3));
+
+        /* Evaluate each attribute of the batch and send info back to
+           the master, one line per attribute. */
+        for (auto & attrPath : attrPaths) {
+            debug("worker process %d at '%s'", getpid(), attrPath);
+
+            nlohmann::json reply;
+
+            try {
+                auto vTmp = findAlongAttrPath(state, attrPath, autoArgs, vRoot).first;
+
+                auto v = state.allocValue();
+                state.autoCallFunction(autoArgs, *vTmp, *v);
+
+                if (auto drv = getDerivation(state, *v, false)) {
+
+                    DrvInfo::Outputs outputs = drv->queryOutputs();
+
+                    if (drv->querySystem() == "unknown")
+                        throw EvalError("derivation must have a 'system' attribute");
+
+                    auto drvPath = state.store->printStorePath(drv->requireDrvPath());
+
+                    nlohmann::json job;
+
+                    job["nixName"] = drv->queryName();
+                    job["system"] =drv->querySystem();
+                    job["drvPath"] = drvPath;
+                    job["description"] = drv->queryMetaString("description");
+                    job["license"] = queryMetaStrings(state, *drv, "license", "shortName");
+                    job["homepage"] = drv->queryMetaString("homepage");
+                    job["maintainers"] = queryMetaStrings(state, *drv, "maintainers", "email");
+                    job["schedulingPriority"] = drv->queryMetaInt("schedulingPriority", 100);
+                    job["timeout"] = drv->queryMetaInt("timeout", 36000);
+                    job["maxSilent"] = drv->queryMetaInt("maxSilent", 7200);
+                    job["isChannel"] = drv->queryMetaBool("isHydraChannel", false);
+
+                    /* If this is an aggregate, then get its constituents. */
+                    auto a = v->attrs->get(state.symbols.create("_hydraAggregate"));
+                    if (a && state.forceBool(*a->value, a->pos, "while evaluating the `_hydraAggregate` attribute")) {
+                        auto a = v->attrs->get(state.symbols.create("constituents"));
+                        if (!a)
+                            throw EvalError("derivation must have a ‘constituents’ attribute");
+
+                        NixStringContext context;
+                        state.coerceToString(a->pos, *a->value, context, "while evaluating the `constituents` attribute", true, false);
+                        for (auto & c : context)
+                            std::visit(overloaded {
+                                [&](const NixStringContextElem::Built & b) {
+                                    job["constituents"].push_back(state.store->printStorePath(b.drvPath));
+                                },
+                                [&](const NixStringContextElem::Opaque & o) {
+                                },
+                                [&](const NixStringContextElem::DrvDeep & d) {
+                                },
+                            }, c.raw());
+
+                        state.forceList(*a->value, a->pos, "while evaluating the `constituents` attribute");
+                        for (unsigned int n = 0; n < a->value->listSize(); ++n) {
+                            auto v = a->value->listElems()[n];
+                            state.forceValue(*v, noPos);
+                            if (v->type() == nString)
+                                job["namedConstituents"].push_back(v->str());
+                        }
                     }
+
+                    /* Register the derivation as a GC root.  !!! This
+                       registers roots for jobs that we may have already
+                       done. */
+                    auto localStore = state.store.dynamic_pointer_cast<LocalFSStore>();
+                    if (gcRootsDir != "" && localStore) {
+                        Path root = gcRootsDir + "/" + std::string(baseNameOf(drvPath));
+                        if (!pathExists(root))
+                            localStore->addPermRoot(localStore->parseStorePath(drvPath), root);
+                    }
+
+                    nlohmann::json out;
+                    for (auto & j : outputs)
+                        // FIXME: handle CA/impure builds.
+                        if (j.second)
+                            out[j.first] = state.store->printStorePath(*j.second);
+                    job["outputs"] = std::move(out);
+
+                    reply["job"] = std::move(job);
                 }
 
-                /* Register the derivation as a GC root.  !!! This
-                   registers roots for jobs that we may have already
-                   done. */
-                auto localStore = state.store.dynamic_pointer_cast<LocalFSStore>();
-                if (gcRootsDir != "" && localStore) {
-                    Path root = gcRootsDir + "/" + std::string(baseNameOf(drvPath));
-                    if (!pathExists(root))
-                        localStore->addPermRoot(localStore->parseStorePath(drvPath), root);
+                else if (v->type() == nAttrs) {
+                    auto attrs = nlohmann::json::array();
+                    StringSet ss;
+                    for (auto & i : v->attrs->lexicographicOrder(state.symbols)) {
+                        std::string name(state.symbols[i->name]);
+                        if (name.find(' ') != std::string::npos) {
+                            printError("skipping job with illegal name '%s'", name);
+                            continue;
+                        }
+                        attrs.push_back(name);
+                    }
+                    reply["attrs"] = std::move(attrs);
                 }
 
-                nlohmann::json out;
-                for (auto & j : outputs)
-                    // FIXME: handle CA/impure builds.
-                    if (j.second)
-                        out[j.first] = state.store->printStorePath(*j.second);
-                job["outputs"] = std::move(out);
+                else if (v->type() == nNull)
+                    ;
 
-                reply["job"] = std::move(job);
+                else throw TypeError("attribute '%s' is %s, which is not supported", attrPath, showType(*v));
+
+            } catch (EvalError & e) {
+                auto msg = e.msg();
+                // Transmits the error we got from the previous evaluation
+                // in the JSON output.
+                reply["error"] = filterANSIEscapes(msg, true);
+                // Don't forget to print it into the STDERR log, this is
+                // what's shown in the Hydra UI.
+                printError(msg);
             }
 
-            else if (v->type() == nAttrs) {
-                auto attrs = nlohmann::json::array();
-                StringSet ss;
-                for (auto & i : v->attrs->lexicographicOrder(state.symbols)) {
-                    std::string name(state.symbols[i->name]);
-                    if (name.find(' ') != std::string::npos) {
-                        printError("skipping job with illegal name '%s'", name);
-                        continue;
-                    }
-                    attrs.push_back(name);
-                }
-                reply["attrs"] = std::move(attrs);
+            writeLine(to.get(), reply.dump());
+
+            /* If our memory use exceeds the maximum, exit, even in
+               the middle of a batch. The master will start a new
+               process and give it the rest of the batch. */
+            if (overMemoryLimit(nrJobs)) {
+                writeUsage(to);
+                writeLine(to.get(), "restart");
+                return;
             }
+        }
+    }
+}
 
-            else if (v->type() == nNull)
-                ;
+/* Send an error to the master. */
+static void writeError(AutoCloseFD & to, Error & e)
+{
+    nlohmann::json err;
+    auto msg = e.msg();
+    err["error"] = filterANSIEscapes(msg, true);
+    // Don't forget to print it into the STDERR log, this is
+    // what's shown in the Hydra UI.
+    printError(msg);
+    writeLine(to.get(), err.dump());
+}
 
-            else throw TypeError("attribute '%s' is %s, which is not supported", attrPath, showType(*v));
+/* Send the file descriptors ‘fds’ over the Unix domain socket
+   ‘sock’. */
+static void sendFds(int sock, const std::vector<int> & fds)
+{
+    char data = 'f';
+    struct iovec iov { .iov_base = &data, .iov_len = 1 };
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * fds.size()));
+
+    struct msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    auto cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * fds.size());
+    memcpy(CMSG_DATA(cmsg), fds.data(), sizeof(int) * fds.size());
+
+    if (sendmsg(sock, &msg, 0) != 1)
+        throw SysError("sending file descriptors");
+}
 
-        } catch (EvalError & e) {
-            auto msg = e.msg();
-            // Transmits the error we got from the previous evaluation
-            // in the JSON output.
-            reply["error"] = filterANSIEscapes(msg, true);
-            // Don't forget to print it into the STDERR log, this is
-            // what's shown in the Hydra UI.
-            printError(msg);
+/* Receive ‘n’ file descriptors sent by sendFds(). Return nothing if
+   the other side closed the socket. */
+static std::vector<AutoCloseFD> receiveFds(int sock, size_t n)
+{
+    char data;
+    struct iovec iov { .iov_base = &data, .iov_len = 1 };
+    std::vector<char> control(CMSG_SPACE(sizeof(int) * n));
+
+    struct msghdr msg {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+
+    auto res = recvmsg(sock, &msg, 0);
+    if (res == -1) throw SysError("receiving file descriptors");
+
+    std::vector<AutoCloseFD> fds;
+    if (res == 0) return fds;
+
+    for (auto cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        for (size_t i = 0; i < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); ++i) {
+            int fd;
+            memcpy(&fd, CMSG_DATA(cmsg) + i * sizeof(int), sizeof(int));
+            fds.emplace_back(fd);
         }
+    }
 
-        writeLine(to.get(), reply.dump());
+    if (fds.size() != n)
+        throw Error("received %d file descriptors, expected %d", fds.size(), n);
 
-        /* If our RSS exceeds the maximum, exit. The master will
-           start a new process. */
-        struct rusage r;
-        getrusage(RUSAGE_SELF, &r);
-        if ((size_t) r.ru_maxrss > maxMemorySize * 1024) break;
-    }
+    return fds;
+}
+
+/* The zygote evaluates the root of the release expression once, and
+   then forks a worker from that state whenever the master sends it
+   the worker's pipes over ‘control’. This way, the workers share the
+   evaluated top level copy-on-write, and replacing a worker that
+   exceeded the memory limit doesn't require evaluating it again. It
+   replies with the PID of the worker, or an error if the top level
+   failed to evaluate. */
+static void zygote(AutoCloseFD & control)
+{
+    try {
+        EvalState state(myArgs.searchPath, openStore());
+        Bindings & autoArgs = *myArgs.getAutoArgs(state);
+
+        /* The workers can't share a database connection with each
+           other, so they must talk to the daemon. */
+        auto remoteStore = state.store.dynamic_pointer_cast<RemoteStore>();
+        if (!remoteStore)
+            throw Error("‘evaluator_zygote’ requires the store to be accessed through the Nix daemon");
+
+        auto vRoot = evalRoot(state, autoArgs);
+
+        /* Close our daemon connections, so that every worker opens
+           its own rather than sharing ours. */
+        auto maxAge = remoteStore->maxConnectionAge.to_string();
+        remoteStore->set("max-connection-age", "0");
+        remoteStore->flushBadConnections();
+        remoteStore->set("max-connection-age", maxAge);
+
+        /* Let the kernel reap the workers. */
+        signal(SIGCHLD, SIG_IGN);
+
+        while (true) {
+            auto fds = receiveFds(control.get(), 2);
+            if (fds.empty()) break;
+
+            auto pid = startProcess([&]() {
+                signal(SIGCHLD, SIG_DFL);
+                control.close();
+                auto & to(fds[0]);
+                auto & from(fds[1]);
+                try {
+                    worker(state, autoArgs, *vRoot, to, from);
+                } catch (Error & e) {
+                    writeError(to, e);
+                    writeLine(to.get(), "restart");
+                }
+            }, ProcessOptions { .allowVfork = false });
 
-    writeLine(to.get(), "restart");
+            writeLine(control.get(), std::to_string(pid));
+        }
+    } catch (Error & e) {
+        writeError(control, e);
+    }
 }
 
 int main(int argc, char * * argv)
@@ -298,6 +509,8 @@ int main(int argc, char * * argv)
 
         auto nrWorkers = config->getIntOption("evaluator_workers", 1);
         maxMemorySize = config->getIntOption("evaluator_max_memory_size", 4096);
+        auto useZygote = config->getBoolOption("evaluator_zygote", false);
+        size_t batchSize = std::max(config->getIntOption("evaluator_batch_size", 8), (uint64_t) 1);
 
         initNix();
         initGC();
@@ -325,23 +538,131 @@ int main(int argc, char * * argv)
 
         struct State
         {
-            std::set<std::string> todo{""};
-            std::set<std::string> active;
+            JobQueue queue;
             nlohmann::json jobs;
             std::exception_ptr exc;
+
+            /* The largest memory use (in KiB) of the workers of each
+               handler, and the CPU time (in seconds) of all
+               workers. */
+            std::vector<size_t> workerMemory;
+            double workerCpuTime = 0;
         };
 
         std::condition_variable wakeup;
 
         Sync<State> state_;
 
+        {
+            auto state(state_.lock());
+            state->queue = JobQueue(std::max(nrWorkers, (uint64_t) 1));
+            state->workerMemory.resize(std::max(nrWorkers, (uint64_t) 1));
+            state->queue.add(0, {""});
+        }
+
+        struct Zygote
+        {
+            Pid pid;
+            AutoCloseFD control;
+            std::mutex mutex;
+        };
+
+        std::unique_ptr<Zygote> zygote_;
+
+        if (useZygote) {
+            int fds[2];
+            if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) == -1)
+                throw SysError("creating a socket pair");
+            AutoCloseFD parentFD(fds[0]), childFD(fds[1]);
+            zygote_ = std::make_unique<Zygote>();
+            zygote_->pid = startProcess([&]() {
+                parentFD.close();
+                zygote(childFD);
+            }, ProcessOptions { .allowVfork = false });
+            zygote_->control = std::move(parentFD);
+        }
+
         /* Start a handler thread per worker process. */
-        auto handler = [&]()
+        auto handler = [&](size_t n)
         {
+            /* Record the response of a worker for ‘attrPath’. */
+            auto handleResponse = [&](const std::string & attrPath, nlohmann::json & response)
+            {
+                std::vector<std::string> newAttrs;
+
+                if (response.find("job") != response.end()) {
+                    auto state(state_.lock());
+                    state->jobs[attrPath] = response["job"];
+                }
+
+                if (response.find("attrs") != response.end()) {
+                    for (auto & i : response["attrs"]) {
+                        std::string path = i;
+                        if (path.find(".") != std::string::npos){
+                            path = "\"" + path  + "\"";
+                        }
+                        auto s = (attrPath.empty() ? "" : attrPath + ".") + (std::string) path;
+                        newAttrs.push_back(s);
+                    }
+                }
+
+                if (response.find("error") != response.end()) {
+                    auto state(state_.lock());
+                    state->jobs[attrPath]["error"] = response["error"];
+                }
+
+                /* When streaming, print the job right away, except
+                   for aggregates with named constituents, which
+                   need the other jobs. Only keep what resolving
+                   those needs. */
+                if (myArgs.stream) {
+                    auto state(state_.lock());
+                    auto job = state->jobs.find(attrPath);
+                    if (job != state->jobs.end() && job->find("namedConstituents") == job->end()) {
+                        printJobLine(attrPath, *job);
+                        nlohmann::json summary;
+                        if (job->find("drvPath") != job->end())
+                            summary["drvPath"] = (*job)["drvPath"];
+                        if (job->find("error") != job->end())
+                            summary["error"] = (*job)["error"];
+                        *job = std::move(summary);
+                    }
+                }
+
+                /* Add newly discovered job names to our queue.
+                   Only wake up idle workers if there is
+                   something for them to do or steal, or if
+                   we're done. */
+                {
+                    auto state(state_.lock());
+                    state->queue.finish(attrPath);
+                    state->queue.add(n, newAttrs);
+                    if (!newAttrs.empty() || state->queue.done())
+                        wakeup.notify_all();
+                }
+            };
+
             pid_t pid = -1;
             try {
                 AutoCloseFD from, to;
 
+                /* Record the resource usage that a worker reports
+                   before it exits. */
+                auto recordUsage = [&](const std::string & s) {
+                    if (!hasPrefix(s, "usage ")) return false;
+                    auto usage = nlohmann::json::parse(std::string(s, 6));
+                    auto state(state_.lock());
+                    state->workerMemory[n] = std::max(state->workerMemory[n], usage["memory"].get<size_t>());
+                    state->workerCpuTime += usage["cpuTime"].get<double>();
+                    return true;
+                };
+
+                auto readReply = [&]() {
+                    auto s = readLine(from.get());
+                    if (recordUsage(s)) s = readLine(from.get());
+                    return s;
+                };
+
                 while (true) {
 
                     /* Start a new worker process if necessary. */
@@ -349,35 +670,40 @@ int main(int argc, char * * argv)
                         Pipe toPipe, fromPipe;
                         toPipe.create();
                         fromPipe.create();
-                        pid = startProcess(
-                            [&,
-                             to{std::make_shared<AutoCloseFD>(std::move(fromPipe.writeSide))},
-                             from{std::make_shared<AutoCloseFD>(std::move(toPipe.readSide))}
-                            ]()
-                            {
-                                try {
-                                    EvalState state(myArgs.searchPath, openStore());
-                                    Bindings & autoArgs = *myArgs.getAutoArgs(state);
-                                    worker(state, autoArgs, *to, *from);
-                                } catch (Error & e) {
-                                    nlohmann::json err;
-                                    auto msg = e.msg();
-                                    err["error"] = filterANSIEscapes(msg, true);
-                                    printError(msg);
-                                    writeLine(to->get(), err.dump());
-                                    // Don't forget to print it into the STDERR log, this is
-                                    // what's shown in the Hydra UI.
-                                    writeLine(to->get(), "restart");
-                                }
-                            },
-                            ProcessOptions { .allowVfork = false });
+                        if (zygote_) {
+                            std::lock_guard<std::mutex> lock(zygote_->mutex);
+                            sendFds(zygote_->control.get(), {fromPipe.writeSide.get(), toPipe.readSide.get()});
+                            auto reply = readLine(zygote_->control.get());
+                            if (reply.empty() || !std::all_of(reply.begin(), reply.end(), ::isdigit)) {
+                                auto json = nlohmann::json::parse(reply);
+                                throw Error("worker error: %s", (std::string) json["error"]);
+                            }
+                            pid = std::stoi(reply);
+                        } else {
+                            pid = startProcess(
+                                [&,
+                                 to{std::make_shared<AutoCloseFD>(std::move(fromPipe.writeSide))},
+                                 from{std::make_shared<AutoCloseFD>(std::move(toPipe.readSide))}
+                                ]()
+                                {
+                                    try {
+                                        EvalState state(myArgs.searchPath, openStore());
+                                        Bindings & autoArgs = *myArgs.getAutoArgs(state);
+                                        worker(state, autoArgs, *evalRoot(state, autoArgs), *to, *from);
+                                    } catch (Error & e) {
+                                        writeError(*to, e);
+                                        writeLine(to->get(), "restart");
+                                    }
+                                },
+                                ProcessOptions { .allowVfork = false });
+                        }
                         from = std::move(fromPipe.readSide);
                         to = std::move(toPipe.writeSide);
                         debug("created worker process %d", pid);
                     }
 
                     /* Check whether the existing worker process is still there. */
-                    auto s = readLine(from.get());
+                    auto s = readReply();
                     if (s == "restart") {
                         pid = -1;
                         continue;
@@ -386,62 +712,47 @@ int main(int argc, char * * argv)
                         throw Error("worker error: %s", (std::string) json["error"]);
                     }
 
-                    /* Wait for a job name to become available. */
-                    std::string attrPath;
+                    /* Claim a batch of job names. */
+                    std::vector<std::string> batch;
+                    bool done = false;
 
                     while (true) {
                         checkInterrupt();
                         auto state(state_.lock());
-                        if ((state->todo.empty() && state->active.empty()) || state->exc) {
-                            writeLine(to.get(), "exit");
-                            return;
-                        }
-                        if (!state->todo.empty()) {
-                            attrPath = *state->todo.begin();
-                            state->todo.erase(state->todo.begin());
-                            state->active.insert(attrPath);
+                        if (state->queue.done() || state->exc) {
+                            done = true;
                             break;
-                        } else
-                            state.wait(wakeup);
+                        }
+                        batch = state->queue.claim(n, batchSize);
+                        if (!batch.empty()) break;
+                        state.wait(wakeup);
                     }
 
-                    /* Tell the worker to evaluate it. */
-                    writeLine(to.get(), "do " + attrPath);
-
-                    /* Wait for the response. */
-                    auto response = nlohmann::json::parse(readLine(from.get()));
+                    if (done) {
+                        writeLine(to.get(), "exit");
+                        recordUsage(readLine(from.get()));
+                        return;
+                    }
 
-                    /* Handle the response. */
-                    StringSet newAttrs;
+                    /* Tell the worker to evaluate the batch. */
+                    writeLine(to.get(), "do " + nlohmann::json(batch).dump());
 
-                    if (response.find("job") != response.end()) {
-                        auto state(state_.lock());
-                        state->jobs[attrPath] = response["job"];
-                    }
+                    for (size_t i = 0; i < batch.size(); ++i) {
+                        auto & attrPath(batch[i]);
+                        auto s = readReply();
 
-                    if (response.find("attrs") != response.end()) {
-                        for (auto & i : response["attrs"]) {
-                            std::string path = i;
-                            if (path.find(".") != std::string::npos){
-                                path = "\"" + path  + "\"";
-                            }
-                            auto s = (attrPath.empty() ? "" : attrPath + ".") + (std::string) path;
-                            newAttrs.insert(s);
+                        /* The worker ran out of memory before
+                           finishing the batch. Put the remaining job
+                           names back in our queue, in their original
+                           order, for the next worker. */
+                        if (s == "restart") {
+                            state_.lock()->queue.unclaim(n, batch, i);
+                            pid = -1;
+                            break;
                         }
-                    }
 
-                    if (response.find("error") != response.end()) {
-                        auto state(state_.lock());
-                        state->jobs[attrPath]["error"] = response["error"];
-                    }
-
-                    /* Add newly discovered job names to the queue. */
-                    {
-                        auto state(state_.lock());
-                        state->active.erase(attrPath);
-                        for (auto & s : newAttrs)
-                            state->todo.insert(s);
-                        wakeup.notify_all();
+                        auto response = nlohmann::json::parse(s);
+                        handleResponse(attrPath, response);
                     }
                 }
             } catch (...) {
@@ -454,7 +765,7 @@ int main(int argc, char * * argv)
 
         std::vector<std::thread> threads;
         for (size_t i = 0; i < nrWorkers; i++)
-            threads.emplace_back(std::thread(handler));
+            threads.emplace_back(std::thread(handler, i));
 
         for (auto & thread : threads)
             thread.join();
@@ -464,6 +775,21 @@ int main(int argc, char * * argv)
         if (state->exc)
             std::rethrow_exception(state->exc);
 
+        /* Tell hydra-evaluator what the workers used. Its wait4()
+           only accounts for processes that were waited for, and the
+           workers are either reaped by the kernel (when forked by the
+           zygote) or never waited for. Each handler runs one worker
+           at a time, so the peak is at most the sum of the largest
+           worker of each handler. */
+        if (auto usageFile = getEnv("HYDRA_EVAL_USAGE_FILE")) {
+            size_t memory = 0;
+            for (auto m : state->workerMemory) memory += m;
+            nlohmann::json usage;
+            usage["workerMemory"] = memory;
+            usage["workerCpuTime"] = state->workerCpuTime;
+            writeFile(*usageFile, usage.dump());
+        }
+
         /* For aggregate jobs that have named consistuents
            (i.e. constituents that are a job name rather than a
            derivation), look up the referenced job and add it to the
@@ -562,6 +888,13 @@ int main(int argc, char * * argv)
             }
         }
 
-        std::cout << state->jobs.dump(2) << "\n";
+        /* When streaming, the only complete jobs left are the
+           aggregates that were held back. */
+        if (myArgs.stream) {
+            for (auto i = state->jobs.begin(); i != state->jobs.end(); ++i)
+                if (i->find("nixName") != i->end())
+                    printJobLine(i.key(), i.value());
+        } else
+            std::cout << state->jobs.dump(2) << "\n";
     });
 }
@@ -0,0 +1,53 @@
+#include <algorithm>
+
+#include "job-queue.hh"
+
+
+void JobQueue::add(size_t n, const std::vector<std::string> & names)
+{
+    auto & own(todo.at(n));
+    own.insert(own.end(), names.begin(), names.end());
+    nrTodo += names.size();
+}
+
+
+std::vector<std::string> JobQueue::claim(size_t n, size_t batchSize)
+{
+    std::vector<std::string> batch;
+
+    auto & own(todo.at(n));
+    if (own.empty() && nrTodo) {
+        auto victim = std::max_element(todo.begin(), todo.end(),
+            [](auto & a, auto & b) { return a.size() < b.size(); });
+        auto count = std::max(victim->size() / 2, (size_t) 1);
+        own.insert(own.end(), victim->begin(), victim->begin() + count);
+        victim->erase(victim->begin(), victim->begin() + count);
+    }
+
+    while (!own.empty() && batch.size() < batchSize) {
+        batch.push_back(std::move(own.back()));
+        own.pop_back();
+        nrTodo--;
+        active.insert(batch.back());
+    }
+
+    return batch;
+}
+
+
+void JobQueue::finish(const std::string & name)
+{
+    active.erase(name);
+}
+
+
+void JobQueue::unclaim(size_t n, const std::vector<std::string> & batch, size_t from)
+{
+    /* Claims pop from the back, so push in reverse. */
+    auto & own(todo.at(n));
+    for (size_t j = batch.size(); j-- > from; ) {
+        active.erase(batch[j]);
+        own.push_back(batch[j]);
+    }
+    nrTodo += batch.size() - from;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <deque>
+#include <set>
+#include <string>
+#include <vector>
+
+
+/* The job names waiting to be evaluated, with a queue per worker.
+   Names discovered by a worker go to its own queue, so that it
+   evaluates the subtrees it has already forced. Idle workers steal
+   the oldest half of the longest queue, which tends to hold the
+   largest subtrees. Not thread-safe. */
+class JobQueue
+{
+public:
+
+    JobQueue(size_t nrWorkers = 1) : todo(nrWorkers) { }
+
+    /* Add names that worker ‘n’ discovered to its queue. */
+    void add(size_t n, const std::vector<std::string> & names);
+
+    /* Claim up to ‘batchSize’ names for worker ‘n’, stealing from
+       another worker if its own queue is empty. Return an empty
+       batch if there is nothing to claim. */
+    std::vector<std::string> claim(size_t n, size_t batchSize);
+
+    /* Mark a claimed name as evaluated. */
+    void finish(const std::string & name);
+
+    /* Put the names ‘batch[from..]’ that worker ‘n’ claimed but
+       didn't evaluate back in its queue, in their original order. */
+    void unclaim(size_t n, const std::vector<std::string> & batch, size_t from);
+
+    /* Whether all names have been evaluated. */
+    bool done() const { return nrTodo == 0 && active.empty(); }
+
+    size_t size(size_t n) const { return todo.at(n).size(); }
+
+private:
+
+    std::vector<std::deque<std::string>> todo;
+    size_t nrTodo = 0;
+    std::set<std::string> active;
+};
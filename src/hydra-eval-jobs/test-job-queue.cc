@@ -0,0 +1,87 @@
+/* Tests for JobQueue: batching, work stealing and putting back the
+   rest of a batch after a worker restart. */
+
+#include <cassert>
+#include <iostream>
+
+#include "job-queue.hh"
+
+typedef std::vector<std::string> Names;
+
+
+static void testBatches()
+{
+    JobQueue queue;
+    queue.add(0, {""});
+    assert(!queue.done());
+
+    assert(queue.claim(0, 8) == Names{""});
+    assert(queue.claim(0, 8).empty());
+    assert(!queue.done());
+
+    /* Names are claimed newest first, up to the batch size. */
+    queue.finish("");
+    queue.add(0, {"a", "b", "c"});
+    assert((queue.claim(0, 2) == Names{"c", "b"}));
+    queue.finish("c");
+    queue.finish("b");
+    assert(queue.claim(0, 2) == Names{"a"});
+    queue.finish("a");
+    assert(queue.done());
+}
+
+
+static void testUnclaim()
+{
+    JobQueue queue;
+    queue.add(0, {"a", "b", "c", "d"});
+
+    auto batch = queue.claim(0, 3);
+    assert((batch == Names{"d", "c", "b"}));
+    queue.finish("d");
+
+    /* The worker restarted after evaluating ‘d’. The next one gets
+       the rest of the batch in the same order. */
+    queue.unclaim(0, batch, 1);
+    assert(queue.size(0) == 3);
+    assert((queue.claim(0, 8) == Names{"c", "b", "a"}));
+    for (auto & name : {"c", "b", "a"})
+        queue.finish(name);
+    assert(queue.done());
+}
+
+
+static void testStealing()
+{
+    JobQueue queue(3);
+    queue.add(0, {"1", "2", "3", "4", "5", "6"});
+    queue.add(2, {"7", "8"});
+
+    /* An idle worker takes the oldest half of the longest queue. */
+    assert((queue.claim(1, 2) == Names{"3", "2"}));
+    assert(queue.size(0) == 3);
+    assert(queue.size(1) == 1);
+    assert(queue.size(2) == 2);
+
+    /* Its own queue comes first. */
+    assert(queue.claim(1, 2) == Names{"1"});
+
+    /* At least one name is stolen. */
+    JobQueue queue2(2);
+    queue2.add(0, {"x"});
+    assert(queue2.claim(1, 8) == Names{"x"});
+    assert(queue2.size(0) == 0);
+    assert(queue2.claim(0, 8).empty());
+    assert(!queue2.done());
+    queue2.finish("x");
+    assert(queue2.done());
+}
+
+
+int main()
+{
+    testBatches();
+    testUnclaim();
+    testStealing();
+    std::cout << "ok\n";
+}
@@ -10,6 +10,9 @@
 
 #include <sys/types.h>
 #include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <nlohmann/json.hpp>
 
 using namespace nix;
 
@@ -85,6 +88,16 @@ struct Evaluator
         time_t lastCheckedTime, triggerTime;
         int checkInterval;
         Pid pid;
+
+        /* The memory (in MiB) and the number of cores used by the
+           evaluations of this jobset, and how long they took. These
+           are decaying maxima (see learnCost()): a peak counts in
+           full, and fades by 10% with each evaluation that stays
+           below it. Unset until the jobset has been evaluated since
+           we started. */
+        std::optional<uint64_t> memory;
+        double cores = 0;
+        time_t duration = 0;
     };
 
     typedef std::map<JobsetId, Jobset> Jobsets;
@@ -93,9 +106,37 @@ struct Evaluator
 
     const size_t maxEvals;
 
+    /* The total memory (in MiB) and cores that running evaluations
+       may use, or 0 for no limit. */
+    const uint64_t memoryBudget;
+    const double coresBudget;
+
+    /* The number of workers of each evaluation, and what is assumed
+       for jobsets that haven't been evaluated yet. */
+    const uint64_t nrWorkers;
+    const uint64_t defaultMemory;
+
+    /* Where hydra-eval-jobs reports what its workers used. */
+    const Path usageDir;
+    AutoDelete deleteUsageDir;
+
+    struct RunningEval
+    {
+        JobsetId name;
+        uint64_t memory;
+        double cores;
+        time_t startTime;
+
+        /* When we expect the evaluation to finish, or 0 if the
+           jobset hasn't been evaluated since we started. */
+        time_t expectedStop;
+    };
+
     struct State
     {
-        size_t runningEvals = 0;
+        std::map<pid_t, RunningEval> running;
+        uint64_t memoryInUse = 0;
+        double coresInUse = 0;
         Jobsets jobsets;
     };
 
@@ -109,8 +150,19 @@ struct Evaluator
     Evaluator()
         : config(std::make_unique<HydraConfig>())
         , maxEvals(std::max((size_t) 1, (size_t) config->getIntOption("max_concurrent_evals", 4)))
+        , memoryBudget(config->getIntOption("evaluator_memory_budget", 0))
+        , coresBudget(config->getIntOption("evaluator_cores_budget", 0))
+        , nrWorkers(std::max((uint64_t) 1, config->getIntOption("evaluator_workers", 1)))
+        , defaultMemory(nrWorkers * config->getIntOption("evaluator_max_memory_size", 4096))
+        , usageDir(createTempDir("", "hydra-evaluator"))
+        , deleteUsageDir(usageDir, true)
     { }
 
+    Path usageFile(pid_t pid)
+    {
+        return fmt("%s/%d.json", usageDir, pid);
+    }
+
     void readJobsets()
     {
         auto conn(dbPool.get());
@@ -189,12 +241,22 @@ struct Evaluator
         assert(jobset.pid == -1);
 
         jobset.pid = startProcess([&]() {
+            setenv("HYDRA_EVAL_USAGE_FILE", usageFile(getpid()).c_str(), 1);
             Strings args = { "hydra-eval-jobset", jobset.name.project, jobset.name.jobset };
             execvp(args.front().c_str(), stringsToCharPtrs(args).data());
             throw SysError("executing ‘%1%’", args.front());
         });
 
-        state.runningEvals++;
+        auto [memory, cores] = estimate(jobset);
+        state.running.emplace(jobset.pid, RunningEval {
+            .name = jobset.name,
+            .memory = memory,
+            .cores = cores,
+            .startTime = now,
+            .expectedStop = jobset.memory ? now + jobset.duration : 0,
+        });
+        state.memoryInUse += memory;
+        state.coresInUse += cores;
 
         childStarted.notify_one();
     }
@@ -283,6 +345,81 @@ struct Evaluator
         return false;
     }
 
+    /* Return the memory and cores that an evaluation of ‘jobset’ is
+       expected to use. */
+    std::pair<uint64_t, double> estimate(const Jobset & jobset)
+    {
+        if (jobset.memory)
+            return {*jobset.memory, jobset.cores};
+        return {defaultMemory, (double) nrWorkers};
+    }
+
+    /* Fold the cost of an evaluation of ‘jobset’ into its estimate.
+       Evaluations of the same jobset vary (e.g. with what changed in
+       its inputs). The estimate follows the peaks rather than the
+       last evaluation, so that a cheap evaluation doesn't get an
+       expensive one admitted. */
+    void learnCost(Jobset & jobset, uint64_t memory, double cores, time_t duration)
+    {
+        const double decay = 0.9;
+        if (!jobset.memory) {
+            jobset.memory = memory;
+            jobset.cores = cores;
+            jobset.duration = duration;
+            return;
+        }
+        jobset.memory = std::max(memory, (uint64_t) (*jobset.memory * decay));
+        jobset.cores = std::max(cores, jobset.cores * decay);
+        jobset.duration = std::max(duration, (time_t) (jobset.duration * decay));
+    }
+
+    /* Whether an evaluation using ‘memory’ and ‘cores’ fits in the
+       budgets. If nothing is running, it always fits, so that a
+       jobset larger than the budget can still be evaluated. */
+    bool fits(const State & state, uint64_t memory, double cores)
+    {
+        if (state.running.empty()) return true;
+        return (!memoryBudget || state.memoryInUse + memory <= memoryBudget)
+            && (!coresBudget || state.coresInUse + cores <= coresBudget);
+    }
+
+    /* Return when we expect enough of the running evaluations to
+       have finished for an evaluation using ‘memory’ and ‘cores’ to
+       fit. */
+    time_t expectedStart(const State & state, uint64_t memory, double cores)
+    {
+        time_t now = time(0);
+
+        /* Assume that evaluations of jobsets that we haven't seen
+           finish yet take as long as the average jobset from now. */
+        time_t totalDuration = 0;
+        size_t nrKnown = 0;
+        for (auto & i : state.jobsets)
+            if (i.second.memory) {
+                totalDuration += i.second.duration;
+                nrKnown++;
+            }
+        time_t unknownStop = now + (nrKnown ? totalDuration / nrKnown : 0);
+
+        std::vector<std::pair<time_t, const RunningEval *>> running;
+        for (auto & i : state.running)
+            running.emplace_back(i.second.expectedStop ? i.second.expectedStop : unknownStop, &i.second);
+        std::sort(running.begin(), running.end(),
+            [](auto & a, auto & b) { return a.first < b.first; });
+
+        uint64_t memoryInUse = state.memoryInUse;
+        double coresInUse = state.coresInUse;
+        for (auto & [stop, eval] : running) {
+            memoryInUse -= eval->memory;
+            coresInUse -= eval->cores;
+            if ((!memoryBudget || memoryInUse + memory <= memoryBudget)
+                && (!coresBudget || coresInUse + cores <= coresBudget))
+                return std::max(now, stop);
+        }
+
+        return now;
+    }
+
     void startEvals(State & state)
     {
         std::vector<Jobsets::iterator> sorted;
@@ -306,10 +443,29 @@ struct Evaluator
                       : a->first < b->first;
             });
 
-        /* Start jobset evaluations up to the concurrency limit.*/
+        /* Start jobset evaluations up to the concurrency limit and
+           within the memory and core budgets. If the first jobset in
+           line doesn't fit, only start jobsets that we expect to
+           finish before it can start, so that cheap jobsets fill the
+           gaps around large ones without starving them. */
+        std::optional<time_t> headStart;
+        time_t now = time(0);
+
         for (auto & i : sorted) {
-            if (state.runningEvals >= maxEvals) break;
-            startEval(state, i->second);
+            if (state.running.size() >= maxEvals) break;
+            auto & jobset(i->second);
+            auto [memory, cores] = estimate(jobset);
+            if (!fits(state, memory, cores)) {
+                if (!headStart) {
+                    headStart = expectedStart(state, memory, cores);
+                    debug("jobset %s doesn't fit, expected to start in %d s",
+                        jobset.name.display(), *headStart - now);
+                }
+                continue;
+            }
+            if (headStart && (!jobset.memory || now + jobset.duration > *headStart))
+                continue;
+            startEval(state, jobset);
         }
     }
 
@@ -323,7 +479,7 @@ struct Evaluator
 
             std::chrono::seconds sleepTime = std::chrono::seconds::max();
 
-            if (state->runningEvals < maxEvals) {
+            if (state->running.size() < maxEvals) {
                 for (auto & i : state->jobsets)
                     if (i.second.pid == -1 &&
                         i.second.checkInterval > 0)
@@ -382,12 +538,13 @@ struct Evaluator
         while (true) {
             {
                 auto state(state_.lock());
-                while (!state->runningEvals)
+                while (state->running.empty())
                     state.wait(childStarted);
             }
 
             int status;
-            pid_t pid = waitpid(-1, &status, 0);
+            struct rusage usage;
+            pid_t pid = wait4(-1, &status, 0, &usage);
             if (pid == -1) {
                 if (errno == EINTR) continue;
                 throw SysError("waiting for children");
@@ -395,61 +552,95 @@ struct Evaluator
 
             {
                 auto state(state_.lock());
-                assert(state->runningEvals);
-                state->runningEvals--;
-
-                // FIXME: should use a map.
-                for (auto & i : state->jobsets) {
-                    auto & jobset(i.second);
 
-                    if (jobset.pid == pid) {
-                        printInfo("evaluation of jobset ‘%s’ %s",
-                            jobset.name.display(), statusToString(status));
+                auto running = state->running.find(pid);
+                assert(running != state->running.end());
+                auto eval = running->second;
+                state->running.erase(running);
+                state->memoryInUse -= eval.memory;
+                state->coresInUse -= eval.cores;
+                maybeDoWork.notify_one();
+
+                /* hydra-eval-jobs only writes this file if it
+                   evaluated the jobset, rather than finding its inputs
+                   unchanged or failing to fetch them. */
+                std::optional<nlohmann::json> evalUsage;
+                try {
+                    evalUsage = nlohmann::json::parse(readFile(usageFile(pid)));
+                    deletePath(usageFile(pid));
+                } catch (SysError & e) {
+                    if (e.errNo != ENOENT)
+                        printError("reading usage of evaluation: %s", e.what());
+                }
 
-                        auto now = time(0);
+                auto i = state->jobsets.find(eval.name);
+                if (i == state->jobsets.end()) continue;
+                auto & jobset(i->second);
 
-                        jobset.triggerTime = notTriggered;
-                        jobset.lastCheckedTime = now;
+                printInfo("evaluation of jobset ‘%s’ %s",
+                    jobset.name.display(), statusToString(status));
 
-                        try {
+                auto now = time(0);
 
-                            auto conn(dbPool.get());
-                            pqxx::work txn(*conn);
+                jobset.triggerTime = notTriggered;
+                jobset.lastCheckedTime = now;
 
-                            /* Clear the trigger time to prevent this
-                               jobset from getting stuck in an endless
-                               failing eval loop. */
-                            txn.exec_params0
-                                ("update Jobsets set triggerTime = null where id = $1 and startTime is not null and triggerTime <= startTime",
-                                 jobset.name.id);
+                try {
 
-                            /* Clear the start time. */
-                            txn.exec_params0
-                                ("update Jobsets set startTime = null where id = $1",
-                                 jobset.name.id);
+                    auto conn(dbPool.get());
+                    pqxx::work txn(*conn);
 
-                            if (!WIFEXITED(status) || WEXITSTATUS(status) > 1) {
-                                txn.exec_params0
-                                    ("update Jobsets set errorMsg = $1, lastCheckedTime = $2, errorTime = $2, fetchErrorMsg = null where id = $3",
-                                     fmt("evaluation %s", statusToString(status)),
-                                     now,
-                                     jobset.name.id);
-                            }
+                    /* Clear the trigger time to prevent this
+                       jobset from getting stuck in an endless
+                       failing eval loop. */
+                    txn.exec_params0
+                        ("update Jobsets set triggerTime = null where id = $1 and startTime is not null and triggerTime <= startTime",
+                         jobset.name.id);
 
-                            txn.commit();
+                    /* Clear the start time. */
+                    txn.exec_params0
+                        ("update Jobsets set startTime = null where id = $1",
+                         jobset.name.id);
 
-                        } catch (std::exception & e) {
-                            printError("exception setting jobset error: %s", e.what());
-                        }
+                    if (!WIFEXITED(status) || WEXITSTATUS(status) > 1) {
+                        txn.exec_params0
+                            ("update Jobsets set errorMsg = $1, lastCheckedTime = $2, errorTime = $2, fetchErrorMsg = null where id = $3",
+                             fmt("evaluation %s", statusToString(status)),
+                             now,
+                             jobset.name.id);
+                    }
 
-                        jobset.pid.release();
-                        maybeDoWork.notify_one();
+                    txn.commit();
 
-                        if (evalOne) std::_Exit(0);
+                } catch (std::exception & e) {
+                    printError("exception setting jobset error: %s", e.what());
+                }
 
-                        break;
+                /* Learn what the evaluation cost. wait4() covers
+                   hydra-eval-jobset, hydra-eval-jobs and the other
+                   processes that were waited for, but its peak RSS
+                   is that of the largest one. The workers are
+                   reported separately. */
+                if (evalUsage) {
+                    try {
+                        auto cpuTime = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec
+                            + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6
+                            + (*evalUsage)["workerCpuTime"].get<double>();
+                        auto memory = (uint64_t) usage.ru_maxrss
+                            + (*evalUsage)["workerMemory"].get<uint64_t>();
+                        auto duration = std::max((time_t) 1, now - eval.startTime);
+                        auto cores = std::max(1.0, cpuTime / duration);
+                        debug("evaluation of jobset ‘%s’ used %d MiB and %.1f cores for %d s",
+                            jobset.name.display(), memory / 1024, cores, duration);
+                        learnCost(jobset, memory / 1024, cores, duration);
+                    } catch (std::exception & e) {
+                        printError("invalid usage reported by hydra-eval-jobs: %s", e.what());
                     }
                 }
+
+                jobset.pid.release();
+
+                if (evalOne) std::_Exit(0);
             }
         }
     }
@@ -0,0 +1,59 @@
+#! /bin/sh
+#
+# Compare the scheduler benchmark of the working tree with that of an
+# earlier git revision, both built and run on this machine, since
+# absolute numbers aren't comparable across machines. Fails if
+# throughput or memory use regressed by more than the tolerance.
+#
+# Usage: bench-compare.sh REV [BENCH-FLAGS...]
+#
+# e.g. ‘bench-compare.sh origin/master --builds 10000 --tolerance 5’.
+# The flags are passed to both runs. REV must contain the benchmark.
+# Run it from a configured source tree (e.g. inside ‘nix develop’).
+
+set -e
+
+if [ $# -lt 1 ]; then
+    echo "usage: $0 REV [BENCH-FLAGS...]" >&2
+    exit 1
+fi
+
+rev="$1"
+shift
+
+here="$(cd "$(dirname "$0")" && pwd)"
+top="$(git -C "$here" rev-parse --show-toplevel)"
+
+if ! git -C "$top" rev-parse --quiet --verify "$rev^{commit}" >/dev/null; then
+    echo "$0: ‘$rev’ is not a git revision" >&2
+    exit 1
+fi
+
+if ! git -C "$top" cat-file -e "$rev:src/hydra-queue-runner/queue-runner-bench.cc" 2>/dev/null; then
+    echo "$0: revision ‘$rev’ predates the scheduler benchmark; pick a later baseline" >&2
+    exit 1
+fi
+
+tmp="$(mktemp -d)"
+
+cleanup() {
+    git -C "$top" worktree remove --force "$tmp/tree" 2>/dev/null || true
+    rm -rf "$tmp"
+}
+trap cleanup EXIT
+
+echo "building the benchmark at $rev..." >&2
+git -C "$top" worktree add --detach --quiet "$tmp/tree" "$rev"
+(
+    cd "$tmp/tree"
+    ./bootstrap >/dev/null
+    ./configure >/dev/null
+    make -C src/hydra-queue-runner hydra-queue-runner-bench >/dev/null
+)
+
+echo "running the benchmark at $rev..." >&2
+"$tmp/tree/src/hydra-queue-runner/hydra-queue-runner-bench" --output "$tmp/baseline.json" "$@" >/dev/null
+
+echo "running the benchmark of the working tree..." >&2
+make -C "$here" hydra-queue-runner-bench >/dev/null
+"$here/hydra-queue-runner-bench" --baseline "$tmp/baseline.json" "$@"
@@ -1,11 +1,18 @@
 #include <algorithm>
 #include <cmath>
+#include <future>
+#include <regex>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+#include <nlohmann/json.hpp>
 
 #include "build-result.hh"
+#include "hydra-build-result.hh"
 #include "serve-protocol.hh"
 #include "state.hh"
 #include "util.hh"
@@ -16,13 +23,6 @@
 using namespace nix;
 
 
-struct Child
-{
-    Pid pid;
-    AutoCloseFD to, from;
-};
-
-
 static void append(Strings & dst, const Strings & src)
 {
     dst.insert(dst.end(), src.begin(), src.end());
@@ -48,7 +48,322 @@ static Strings extraStoreArgs(std::string & machine)
     return result;
 }
 
-static void openConnection(Machine::ptr machine, Path tmpDir, int stderrFD, Child & child)
+/* Return the SSH options common to the master connection and the
+   sessions of a machine. */
+static Strings sshArgs(Machine::ptr machine, const std::string & sshName, const Path & tmpDir)
+{
+    Strings argv = {"ssh", sshName};
+    if (machine->sshKey != "") append(argv, {"-i", machine->sshKey});
+    if (machine->sshPublicHostKey != "") {
+        Path fileName = tmpDir + "/host-key";
+        auto p = machine->sshName.find("@");
+        std::string host = p != std::string::npos ? std::string(machine->sshName, p + 1) : machine->sshName;
+        writeFile(fileName, host + " " + machine->sshPublicHostKey + "\n");
+        append(argv, {"-oUserKnownHostsFile=" + fileName});
+    }
+    append(argv, { "-x", "-a", "-oBatchMode=yes", "-oConnectTimeout=60", "-oTCPKeepAlive=yes" });
+    return argv;
+}
+
+
+/* Run ‘nix’ with arguments ‘args’ on ‘machine’ through the SSH master
+   of ‘conn’. Return its output, or nothing if it failed. */
+static std::optional<std::string> runNixOnMachine(Machine::ptr machine,
+    RemoteConnection & conn, const Strings & args)
+{
+    auto sshName = machine->sshName;
+    Strings extraArgs = extraStoreArgs(sshName);
+    auto argv = sshArgs(machine, sshName, conn.tmpDir);
+    append(argv, { "-S", conn.master->socketPath, "--", "nix", "--extra-experimental-features", "nix-command" });
+    for (auto & arg : args)
+        argv.push_back(shellEscape(arg));
+    append(argv, extraArgs);
+    argv.pop_front();
+
+    auto [status, output] = runProgram(RunOptions { .program = "ssh", .args = argv });
+    if (!statusOk(status)) return std::nullopt;
+    return output;
+}
+
+
+/* Record the type and size of ‘path’ given its ‘nix store ls --json’
+   entry. */
+static NarMemberData & addNarMember(NarMemberDatas & members, const Path & path,
+    const nlohmann::json & entry)
+{
+    auto & member(members[path]);
+    auto type = entry.value("type", "");
+    if (type == "regular") {
+        member.type = FSAccessor::Type::tRegular;
+        member.fileSize = entry.value("size", (uint64_t) 0);
+    } else if (type == "directory")
+        member.type = FSAccessor::Type::tDirectory;
+    else if (type == "symlink")
+        member.type = FSAccessor::Type::tSymlink;
+    else
+        member.type = FSAccessor::Type::tMissing;
+    return member;
+}
+
+
+/* Let ‘machine’ copy the output paths ‘infos’ to the binary cache
+   ‘uploadUri’ itself, rather than sending them to us. Since we don't
+   get the NARs, fill in the data that getBuildOutput() needs (the
+   type of each output, the ‘nix-support’ files and the build
+   products) by asking the machine. */
+static void uploadFromMachine(Machine::ptr machine, RemoteConnection & conn,
+    Store & destStore, const std::string & uploadUri,
+    const std::map<StorePath, ValidPathInfo> & infos, NarMemberDatas & members)
+{
+    Strings args = { "copy", "--to", uploadUri };
+    for (auto & [path, info] : infos)
+        args.push_back(destStore.printStorePath(path));
+    if (!runNixOnMachine(machine, conn, args))
+        throw Error("machine ‘%s’ failed to upload its outputs to ‘%s’", machine->sshName, uploadUri);
+
+    for (auto & [path, info] : infos)
+        if (!destStore.isValidPath(path))
+            throw Error("output ‘%s’ uploaded by ‘%s’ is not valid in the binary cache",
+                destStore.printStorePath(path), machine->sshName);
+
+    auto ls = [&](const Path & path, bool recursive) -> std::optional<nlohmann::json> {
+        Strings args = { "store", "ls", "--json", path };
+        if (recursive) args.push_back("--recursive");
+        auto output = runNixOnMachine(machine, conn, args);
+        if (!output) return std::nullopt;
+        return nlohmann::json::parse(*output);
+    };
+
+    /* The build products that are regular files. These are hashed
+       with a single command once all outputs have been listed. */
+    std::vector<std::string> toHash;
+
+    for (auto & [path, info] : infos) {
+        auto pathS = destStore.printStorePath(path);
+
+        auto root = ls(pathS, false);
+        if (!root)
+            throw Error("cannot list output ‘%s’ on ‘%s’", pathS, machine->sshName);
+        if (addNarMember(members, pathS, *root).type != FSAccessor::Type::tDirectory) continue;
+
+        auto nixSupport = pathS + "/nix-support";
+        auto dir = ls(nixSupport, true);
+        if (!dir) continue;
+        addNarMember(members, nixSupport, *dir);
+
+        for (auto & [name, entry] : dir->value("entries", nlohmann::json::object()).items()) {
+            auto & member(addNarMember(members, nixSupport + "/" + name, entry));
+            if (member.type != FSAccessor::Type::tRegular
+                || (name != "hydra-build-products" && name != "hydra-release-name" && name != "hydra-metrics"))
+                continue;
+            member.contents = runNixOnMachine(machine, conn, { "store", "cat", nixSupport + "/" + name });
+            if (!member.contents)
+                throw Error("cannot read ‘%s/%s’ on ‘%s’", nixSupport, name, machine->sshName);
+        }
+
+        /* Get the size and hash of the build products. */
+        auto products = members.find(nixSupport + "/hydra-build-products");
+        if (products == members.end() || !products->second.contents) continue;
+
+        for (auto & line : tokenizeString<Strings>(*products->second.contents, "\n")) {
+            auto parsed = parseBuildProduct(line);
+            if (!parsed) continue;
+            auto & product(parsed->path);
+            if (product != pathS && !hasPrefix(product, pathS + "/")) continue;
+            if (members.count(product)) continue;
+
+            auto entry = ls(product, false);
+            if (!entry) continue;
+            auto & member(addNarMember(members, product, *entry));
+            if (member.type == FSAccessor::Type::tRegular)
+                toHash.push_back(product);
+        }
+    }
+
+    if (toHash.empty()) return;
+
+    /* ‘nix hash file’ prints one hash per line, in the order of its
+       arguments. */
+    Strings hashArgs = { "hash", "file", "--type", "sha256", "--base16" };
+    hashArgs.insert(hashArgs.end(), toHash.begin(), toHash.end());
+    auto output = runNixOnMachine(machine, conn, hashArgs);
+    if (!output)
+        throw Error("cannot hash %d build products on ‘%s’", toHash.size(), machine->sshName);
+
+    auto hashes = tokenizeString<std::vector<std::string>>(*output, "\n");
+    if (hashes.size() != toHash.size())
+        throw Error("‘nix hash file’ on ‘%s’ returned %d hashes for %d files",
+            machine->sshName, hashes.size(), toHash.size());
+
+    for (size_t n = 0; n < toHash.size(); ++n)
+        members.at(toHash[n]).sha256 = Hash::parseAny(trim(hashes[n]), htSHA256);
+}
+
+
+/* Whether SSH compression is enabled for a machine, i.e. whether
+   its URI has ‘?compress=true’, as for Nix's ‘ssh://’ stores. */
+static bool useCompression(const std::string & sshName)
+{
+    try {
+        auto parsed = parseURL(sshName);
+        auto i = parsed.query.find("compress");
+        return i != parsed.query.end() && (i->second == "true" || i->second == "1");
+    } catch (BadURL &) {
+        return false;
+    }
+}
+
+
+/* Masters of machines that use compression are replaced after this
+   many seconds, since SSH only reports the compressed byte counts
+   when a master exits. Other masters are kept until they die. */
+static const time_t maxSshMasterAge = 600;
+
+/* How long to wait for an SSH master that another thread is starting.
+   This is the same as ssh's ConnectTimeout. */
+static const std::chrono::seconds maxSshMasterWait(60);
+
+
+Machine::State::SshMaster::~SshMaster()
+{
+    /* Let the master exit cleanly so that it reports the bytes it
+       transferred. */
+    if (pid != -1) {
+        pid.setKillSignal(SIGTERM);
+        try {
+            pid.kill();
+        } catch (...) {
+            ignoreException();
+        }
+    }
+
+    if (!compress) return;
+
+    try {
+        auto state = machineState.lock();
+        if (!state || !pathExists(logFile)) return;
+        static std::regex r("Transferred: sent ([0-9]+), received ([0-9]+) bytes");
+        auto log = readFile(logFile);
+        std::smatch match;
+        if (std::regex_search(log, match, r)) {
+            state->bytesSentCompressed += std::stoull(match[1]);
+            state->bytesReceivedCompressed += std::stoull(match[2]);
+        }
+    } catch (...) {
+        ignoreException();
+    }
+}
+
+
+/* Start the SSH master process of ‘master’ and wait until it has
+   connected. */
+static void startSshMaster(Machine::ptr machine, const std::string & sshName,
+    Machine::State::SshMaster & master)
+{
+    auto argv = sshArgs(machine, sshName, master.tmpDir);
+    append(argv,
+        { "-M", "-N", "-n", "-S", master.socketPath
+        , "-oServerAliveInterval=60", "-oServerAliveCountMax=3"
+        , "-oLocalCommand=echo started", "-oPermitLocalCommand=yes" });
+    if (master.compress)
+        append(argv, { "-C", "-oLogLevel=VERBOSE" });
+
+    AutoCloseFD logFD = open(master.logFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    if (!logFD) throw SysError("creating log file ‘%s’", master.logFile);
+
+    Pipe out;
+    out.create();
+
+    master.pid = startProcess([&]() {
+        restoreProcessContext();
+
+        if (dup2(out.writeSide.get(), STDOUT_FILENO) == -1)
+            throw SysError("cannot dup output pipe to stdout");
+
+        if (dup2(logFD.get(), STDERR_FILENO) == -1)
+            throw SysError("cannot dup stderr");
+
+        execvp(argv.front().c_str(), (char * *) stringsToCharPtrs(argv).data()); // FIXME: remove cast
+
+        throw SysError("cannot start ssh");
+    });
+
+    out.writeSide = -1;
+
+    std::string reply;
+    try {
+        reply = readLine(out.readSide.get());
+    } catch (EndOfFile & e) { }
+
+    if (reply != "started")
+        throw Error("cannot connect to ‘%1%’: %2%", machine->sshName, chomp(readFile(master.logFile)));
+}
+
+
+/* Return the SSH master connection to ‘machine’, starting it if
+   there is none or the previous one died or (for compressed masters)
+   is too old. The master is started without holding the lock, so
+   that dropping it (on a failure or a machines reload) doesn't wait
+   for a slow connect. Other threads that need it in the meantime
+   wait for it to start, up to maxSshMasterWait. */
+static std::shared_ptr<Machine::State::SshMaster> getSshMaster(Machine::ptr machine,
+    const std::string & sshName, bool & reused)
+{
+    std::shared_ptr<Machine::State::SshMaster> master;
+    bool starting = false;
+
+    {
+        auto master_(machine->state->sshMaster.lock());
+
+        if (*master_) {
+            if ((*master_)->started.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+                master = *master_;
+            else {
+                int status;
+                if (waitpid((*master_)->pid, &status, WNOHANG) != 0)
+                    (*master_)->pid.release();
+                else if (!(*master_)->compress || (*master_)->startedAt + maxSshMasterAge > time(0)) {
+                    reused = true;
+                    return *master_;
+                }
+                *master_ = nullptr;
+            }
+        }
+
+        if (!master) {
+            master = std::make_shared<Machine::State::SshMaster>(machine->state);
+            master->compress = useCompression(machine->sshName);
+            *master_ = master;
+            starting = true;
+        }
+    }
+
+    if (starting) {
+        try {
+            startSshMaster(machine, sshName, *master);
+        } catch (...) {
+            {
+                auto master_(machine->state->sshMaster.lock());
+                if (*master_ == master) *master_ = nullptr;
+            }
+            master->startedPromise.set_exception(std::current_exception());
+            throw;
+        }
+        master->startedPromise.set_value();
+        return master;
+    }
+
+    /* Another thread is starting the master. */
+    if (master->started.wait_for(maxSshMasterWait) != std::future_status::ready)
+        throw Error("timed out waiting for the SSH master of ‘%s’ to start", machine->sshName);
+    master->started.get();
+    reused = true;
+    return master;
+}
+
+
+static void openConnection(Machine::ptr machine, Path tmpDir, int stderrFD,
+    RemoteConnection & conn, bool & reused)
 {
     std::string pgmName;
     Pipe to, from;
@@ -63,22 +378,13 @@ static void openConnection(Machine::ptr machine, Path tmpDir, int stderrFD, Chil
         pgmName = "ssh";
         auto sshName = machine->sshName;
         Strings extraArgs = extraStoreArgs(sshName);
-        argv = {"ssh", sshName};
-        if (machine->sshKey != "") append(argv, {"-i", machine->sshKey});
-        if (machine->sshPublicHostKey != "") {
-            Path fileName = tmpDir + "/host-key";
-            auto p = machine->sshName.find("@");
-            std::string host = p != std::string::npos ? std::string(machine->sshName, p + 1) : machine->sshName;
-            writeFile(fileName, host + " " + machine->sshPublicHostKey + "\n");
-            append(argv, {"-oUserKnownHostsFile=" + fileName});
-        }
-        append(argv,
-            { "-x", "-a", "-oBatchMode=yes", "-oConnectTimeout=60", "-oTCPKeepAlive=yes"
-            , "--", "nix-store", "--serve", "--write" });
+        conn.master = getSshMaster(machine, sshName, reused);
+        argv = sshArgs(machine, sshName, tmpDir);
+        append(argv, { "-S", conn.master->socketPath, "--", "nix-store", "--serve", "--write" });
         append(argv, extraArgs);
     }
 
-    child.pid = startProcess([&]() {
+    conn.pid = startProcess([&]() {
         restoreProcessContext();
 
         if (dup2(to.readSide.get(), STDIN_FILENO) == -1)
@@ -98,15 +404,213 @@ static void openConnection(Machine::ptr machine, Path tmpDir, int stderrFD, Chil
     to.readSide = -1;
     from.writeSide = -1;
 
-    child.to = to.writeSide.release();
-    child.from = from.readSide.release();
+    conn.toFD = to.writeSide.release();
+    conn.fromFD = from.readSide.release();
+    conn.to = FdSink(conn.toFD.get());
+    conn.from = FdSource(conn.fromFD.get());
+}
+
+
+/* Perform the ‘nix-store --serve’ handshake. */
+static void handshake(Machine::ptr machine, RemoteConnection & conn)
+{
+    conn.to << SERVE_MAGIC_1 << 0x206;
+    conn.to.flush();
+
+    unsigned int magic = readInt(conn.from);
+    if (magic != SERVE_MAGIC_2)
+        throw Error("protocol mismatch with ‘nix-store --serve’ on ‘%1%’", machine->sshName);
+    conn.remoteVersion = readInt(conn.from);
+    if (GET_PROTOCOL_MAJOR(conn.remoteVersion) != 0x200)
+        throw Error("unsupported ‘nix-store --serve’ protocol version on ‘%1%’", machine->sshName);
+}
+
+
+/* The sessions to a machine used for a parallel transfer. Session 0
+   is the step's own connection; the others are opened on demand. */
+struct Sessions
+{
+    Machine::ptr machine;
+    RemoteConnection & main;
+    int stderrFD;
+    std::vector<std::unique_ptr<RemoteConnection>> extra;
+
+    Sessions(Machine::ptr machine, RemoteConnection & main, int stderrFD, size_t nrSessions)
+        : machine(machine), main(main), stderrFD(stderrFD)
+        , extra(std::max(nrSessions, (size_t) 1) - 1)
+    { }
+
+    /* Return session ‘n’. Different threads must use different
+       sessions. */
+    RemoteConnection & get(size_t n)
+    {
+        if (n == 0) return main;
+        auto & conn(extra.at(n - 1));
+        if (!conn) {
+            conn = std::make_unique<RemoteConnection>();
+            bool reused;
+            openConnection(machine, conn->tmpDir, stderrFD, *conn, reused);
+            try {
+                handshake(machine, *conn);
+            } catch (EndOfFile & e) {
+                throw Error("cannot open an additional session to ‘%1%’", machine->sshName);
+            }
+        }
+        return *conn;
+    }
+
+    bool usedExtra()
+    {
+        for (auto & conn : extra)
+            if (conn) return true;
+        return false;
+    }
+
+    /* Return the bytes received and sent by the additional
+       sessions. */
+    std::pair<uint64_t, uint64_t> bytes()
+    {
+        std::pair<uint64_t, uint64_t> res{0, 0};
+        for (auto & conn : extra)
+            if (conn) {
+                res.first += conn->from.read;
+                res.second += conn->to.written;
+            }
+        return res;
+    }
+};
+
+
+/* Transfer the paths in ‘graph’, which maps each path to the paths
+   in ‘graph’ that it references, using the calling thread and up to
+   ‘parallelism - 1’ threads of ‘pool’. A path is handed to ‘transfer’
+   only after all its references have been transferred. Each call
+   gets at most ‘batchSize’ paths, which don't depend on each other.
+   If the pool is busy, the calling thread does all the work. */
+static void transferPaths(WorkerPool & pool,
+    const std::map<StorePath, StorePathSet> & graph,
+    size_t parallelism, size_t batchSize,
+    std::function<void(size_t worker, const StorePathSet & paths)> transfer)
+{
+    struct Queue
+    {
+        std::map<StorePath, size_t> blockedBy;
+        std::map<StorePath, StorePaths> referrers;
+        std::list<StorePath> ready;
+        size_t left = 0;
+        std::exception_ptr ex;
+
+        /* The number of pool threads working for us, and whether we
+           have returned. Work items that start after that do
+           nothing. */
+        size_t running = 0;
+        bool finished = false;
+    };
+
+    struct Shared
+    {
+        Sync<Queue> queue_;
+        std::condition_variable wakeup;
+    };
+
+    /* Work items that haven't started by the time we return only
+       touch this. */
+    auto shared = std::make_shared<Shared>();
+    auto & queue_(shared->queue_);
+    auto & wakeup(shared->wakeup);
+
+    size_t nrWorkers = std::max(std::min(parallelism, graph.size()), (size_t) 1);
+
+    {
+        auto queue(queue_.lock());
+        for (auto & [path, refs] : graph) {
+            size_t n = 0;
+            for (auto & ref : refs)
+                if (ref != path) {
+                    queue->referrers[ref].push_back(path);
+                    n++;
+                }
+            queue->blockedBy[path] = n;
+            if (!n) queue->ready.push_back(path);
+        }
+        queue->left = graph.size();
+    }
+
+    auto worker = [&](size_t n) {
+        try {
+            while (true) {
+                StorePathSet batch;
+
+                {
+                    auto queue(queue_.lock());
+                    while (queue->ready.empty() && queue->left && !queue->ex)
+                        queue.wait(wakeup);
+                    if (!queue->left || queue->ex) return;
+                    /* Leave some work for the other threads. */
+                    size_t max = std::min(batchSize, std::max(queue->ready.size() / nrWorkers, (size_t) 1));
+                    while (!queue->ready.empty() && batch.size() < max) {
+                        batch.insert(queue->ready.front());
+                        queue->ready.pop_front();
+                    }
+                }
+
+                transfer(n, batch);
+
+                {
+                    auto queue(queue_.lock());
+                    for (auto & path : batch) {
+                        queue->left--;
+                        for (auto & referrer : queue->referrers[path])
+                            if (--queue->blockedBy[referrer] == 0)
+                                queue->ready.push_back(referrer);
+                    }
+                }
+
+                wakeup.notify_all();
+            }
+        } catch (...) {
+            {
+                auto queue(queue_.lock());
+                if (!queue->ex) queue->ex = std::current_exception();
+            }
+            wakeup.notify_all();
+        }
+    };
+
+    for (size_t n = 1; n < nrWorkers; ++n)
+        pool.enqueue([shared, &worker, n]() {
+            {
+                auto queue(shared->queue_.lock());
+                if (queue->finished) return;
+                queue->running++;
+            }
+            worker(n);
+            {
+                auto queue(shared->queue_.lock());
+                queue->running--;
+            }
+            shared->wakeup.notify_all();
+        });
+
+    worker(0);
+
+    auto queue(queue_.lock());
+    queue->finished = true;
+    while (queue->running)
+        queue.wait(wakeup);
+    if (queue->ex) std::rethrow_exception(queue->ex);
 }
 
 
+/* Copy the closure of ‘paths’ to the remote machine. */
 static void copyClosureTo(std::timed_mutex & sendMutex, Store & destStore,
-    FdSource & from, FdSink & to, const StorePathSet & paths,
+    Sessions & sessions, WorkerPool & pool, size_t parallelism, const StorePathSet & paths,
+    Tracer & tracer, const Tracer::Context & trace,
     bool useSubstitutes = false)
 {
+    auto & from(sessions.main.from);
+    auto & to(sessions.main.to);
+
     StorePathSet closure;
     destStore.computeFSClosure(paths, closure);
 
@@ -125,130 +629,168 @@ static void copyClosureTo(std::timed_mutex & sendMutex, Store & destStore,
 
     if (present.size() == closure.size()) return;
 
-    auto sorted = destStore.topoSortPaths(closure);
-
-    StorePathSet missing;
-    for (auto i = sorted.rbegin(); i != sorted.rend(); ++i)
-        if (!present.count(*i)) missing.insert(*i);
+    std::map<StorePath, StorePathSet> missing;
+    for (auto & path : closure)
+        if (!present.count(path)) missing.emplace(path, StorePathSet());
 
     printMsg(lvlDebug, "sending %d missing paths", missing.size());
 
+    Tracer::Span lockSpan(tracer, trace, "waiting_for_send_lock");
     std::unique_lock<std::timed_mutex> sendLock(sendMutex,
         std::chrono::seconds(600));
+    lockSpan.stop();
 
-    to << cmdImportPaths;
-    destStore.exportPaths(missing, to);
-    to.flush();
+    if (parallelism <= 1 || missing.size() == 1) {
+        StorePathSet missing2;
+        for (auto & i : missing) missing2.insert(i.first);
+
+        to << cmdImportPaths;
+        destStore.exportPaths(missing2, to);
+        to.flush();
 
-    if (readInt(from) != 1)
-        throw Error("remote machine failed to import closure");
+        if (readInt(from) != 1)
+            throw Error("remote machine failed to import closure");
+
+        return;
+    }
+
+    /* Send independent paths through separate sessions. */
+    for (auto & [path, refs] : missing)
+        for (auto & ref : destStore.queryPathInfo(path)->references)
+            if (missing.count(ref)) refs.insert(ref);
+
+    transferPaths(pool, missing, parallelism, 256, [&](size_t n, const StorePathSet & batch) {
+        auto & conn(sessions.get(n));
+        conn.to << cmdImportPaths;
+        destStore.exportPaths(batch, conn.to);
+        conn.to.flush();
+        if (readInt(conn.from) != 1)
+            throw Error("remote machine failed to import closure");
+    });
+
+    /* Paths imported by the other sessions are not protected from
+       garbage collection by this session, so lock them now. */
+    if (sessions.usedExtra()) {
+        to << cmdQueryValidPaths << 1 << false;
+        workerProtoWrite(destStore, to, closure);
+        to.flush();
+        if (WorkerProto<StorePathSet>::read(destStore, from).size() != closure.size())
+            throw Error("remote machine failed to import closure");
+    }
 }
 
 
-// FIXME: use Store::topoSortPaths().
-StorePaths reverseTopoSortPaths(const std::map<StorePath, ValidPathInfo> & paths)
+void State::disableMachine(Machine::ptr machine)
 {
-    StorePaths sorted;
-    StorePathSet visited;
+    /* Disable this machine until a certain period of time has
+       passed. This period increases on every consecutive
+       failure. However, don't count failures that occurred soon
+       after the last one (to take into account steps started in
+       parallel). */
+    auto info(machine->state->connectInfo.lock());
+    auto now = std::chrono::system_clock::now();
+    if (info->consecutiveFailures == 0 || info->lastFailure < now - std::chrono::seconds(30)) {
+        info->consecutiveFailures = std::min(info->consecutiveFailures + 1, (unsigned int) 4);
+        info->lastFailure = now;
+        int delta = retryInterval * std::pow(retryBackoff, info->consecutiveFailures - 1) + (rand() % 30);
+        printMsg(lvlInfo, "will disable machine ‘%1%’ for %2%s", machine->sshName, delta);
+        info->disabledUntil = now + std::chrono::seconds(delta);
+    }
 
-    std::function<void(const StorePath & path)> dfsVisit;
+    /* Don't reuse the SSH master in case it's the cause of the
+       failure. */
+    *machine->state->sshMaster.lock() = nullptr;
+}
 
-    dfsVisit = [&](const StorePath & path) {
-        if (!visited.insert(path).second) return;
 
-        auto info = paths.find(path);
-        auto references = info == paths.end() ? StorePathSet() : info->second.references;
+void State::accountTransfer(Machine::ptr machine, uint64_t received, uint64_t sent)
+{
+    bytesReceived += received;
+    bytesSent += sent;
+    machine->state->bytesReceived += received;
+    machine->state->bytesSent += sent;
+}
 
-        for (auto & i : references)
-            /* Don't traverse into paths that don't exist.  That can
-               happen due to substitutes for non-existent paths. */
-            if (i != path && paths.count(i))
-                dfsVisit(i);
 
-        sorted.push_back(path);
-    };
+void State::StepRun::closeConnection()
+{
+    if (!remote) return;
+
+    {
+        auto activeStepState(activeStep->state_.lock());
+        activeStepState->pid = -1;
+
+        /* FIXME: there is a slight race here with step
+           cancellation in State::processQueueChange(), which
+           could call kill() on this pid after we've done waitpid()
+           on it. With pid wrap-around, there is a tiny
+           possibility that we end up killing another
+           process. Meh. */
+    }
 
-    for (auto & i : paths)
-        dfsVisit(i.first);
+    state.accountTransfer(reservation->machine, remote->from.read, remote->to.written);
 
-    return sorted;
+    remote.reset();
 }
 
 
-void State::buildRemote(ref<Store> destStore,
-    Machine::ptr machine, Step::ptr step,
-    unsigned int maxSilentTime, unsigned int buildTimeout, unsigned int repeats,
-    RemoteResult & result, std::shared_ptr<ActiveStep> activeStep,
-    std::function<void(StepState)> updateStep,
-    NarMemberDatas & narMembers)
+void State::startRemoteBuild(ref<Store> destStore, StepRun & run,
+    std::function<void(StepState)> updateStep)
 {
     assert(BuildResult::TimedOut == 8);
 
+    auto & step(run.reservation->step);
+    auto & machine(run.reservation->machine);
+    auto & result(run.result);
+
     std::string base(step->drvPath.to_string());
     result.logFile = logDir + "/" + std::string(base, 0, 2) + "/" + std::string(base, 2);
+    if (compressBuildLogs) result.logFile += ".bz2";
     AutoDelete autoDelete(result.logFile, false);
 
     createDirs(dirOf(result.logFile));
 
-    AutoCloseFD logFD = open(result.logFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666);
-    if (!logFD) throw SysError("creating log file ‘%s’", result.logFile);
-
-    nix::Path tmpDir = createTempDir();
-    AutoDelete tmpDirDel(tmpDir, true);
+    /* With compression, the processes below write to a pipe read by
+       the log compressor, which keeps going until they have all
+       exited, even if this step is long gone by then. */
+    AutoCloseFD logFD;
+    if (compressBuildLogs)
+        result.log = logCompressor.create(result.logFile, logFD);
+    else {
+        logFD = open(result.logFile.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0666);
+        if (!logFD) throw SysError("creating log file ‘%s’", result.logFile);
+    }
 
     try {
 
         updateStep(ssConnecting);
 
+        auto connectStart = std::chrono::steady_clock::now();
+        Tracer::Span connectSpan(tracer, run.trace, "connect");
+
         // FIXME: rewrite to use Store.
-        Child child;
-        openConnection(machine, tmpDir, logFD.get(), child);
+        run.remote = std::make_unique<RemoteConnection>();
+        auto & conn(*run.remote);
+        bool reused = false;
+        openConnection(machine, conn.tmpDir, logFD.get(), conn, reused);
 
         {
-            auto activeStepState(activeStep->state_.lock());
+            auto activeStepState(run.activeStep->state_.lock());
             if (activeStepState->cancelled) throw Error("step cancelled");
-            activeStepState->pid = child.pid;
+            activeStepState->pid = conn.pid;
         }
 
-        Finally clearPid([&]() {
-            auto activeStepState(activeStep->state_.lock());
-            activeStepState->pid = -1;
-
-            /* FIXME: there is a slight race here with step
-               cancellation in State::processQueueChange(), which
-               could call kill() on this pid after we've done waitpid()
-               on it. With pid wrap-around, there is a tiny
-               possibility that we end up killing another
-               process. Meh. */
-        });
-
-        FdSource from(child.from.get());
-        FdSink to(child.to.get());
-
-        Finally updateStats([&]() {
-            bytesReceived += from.read;
-            bytesSent += to.written;
-        });
+        auto & to(conn.to);
 
         /* Handshake. */
-        unsigned int remoteVersion;
-
         try {
-            to << SERVE_MAGIC_1 << 0x206;
-            to.flush();
-
-            unsigned int magic = readInt(from);
-            if (magic != SERVE_MAGIC_2)
-                throw Error("protocol mismatch with ‘nix-store --serve’ on ‘%1%’", machine->sshName);
-            remoteVersion = readInt(from);
-            if (GET_PROTOCOL_MAJOR(remoteVersion) != 0x200)
-                throw Error("unsupported ‘nix-store --serve’ protocol version on ‘%1%’", machine->sshName);
-            if (GET_PROTOCOL_MINOR(remoteVersion) < 3 && repeats > 0)
+            handshake(machine, conn);
+            if (GET_PROTOCOL_MINOR(conn.remoteVersion) < 3 && run.repeats > 0)
                 throw Error("machine ‘%1%’ does not support repeating a build; please upgrade it to Nix 1.12", machine->sshName);
 
         } catch (EndOfFile & e) {
-            child.pid.wait();
-            std::string s = chomp(readFile(result.logFile));
+            conn.pid.wait();
+            std::string s = chomp(result.log ? result.log->tail() : readFile(result.logFile));
             throw Error("cannot connect to ‘%1%’: %2%", machine->sshName, s);
         }
 
@@ -257,6 +799,19 @@ void State::buildRemote(ref<Store> destStore,
             info->consecutiveFailures = 0;
         }
 
+        connectSpan.stop();
+
+        auto connectTime = std::chrono::duration_cast<std::chrono::milliseconds>(
+            std::chrono::steady_clock::now() - connectStart).count();
+        nrConnections++;
+        machine->state->nrConnections++;
+        totalConnectTimeMs += connectTime;
+        machine->state->totalConnectTimeMs += connectTime;
+        if (reused) {
+            nrConnectionsReused++;
+            machine->state->nrConnectionsReused++;
+        }
+
         /* Gather the inputs. If the remote side is Nix <= 1.9, we have to
            copy the entire closure of ‘drvPath’, as well as the required
            outputs of the input derivations. On Nix > 1.9, we only need to
@@ -264,17 +819,19 @@ void State::buildRemote(ref<Store> destStore,
            outputs of the input derivations. */
         updateStep(ssSendingInputs);
 
+        auto drv = getStepDerivation(*step);
+
         StorePathSet inputs;
-        BasicDerivation basicDrv(*step->drv);
+        BasicDerivation basicDrv(*drv);
 
-        for (auto & p : step->drv->inputSrcs)
+        for (auto & p : drv->inputSrcs)
             inputs.insert(p);
 
-        for (auto & input : step->drv->inputDrvs) {
-            auto drv2 = localStore->readDerivation(input.first);
+        for (auto & input : drv->inputDrvs) {
+            auto drv2 = getDerivation(input.first);
             for (auto & name : input.second) {
-                if (auto i = get(drv2.outputs, name)) {
-                    auto outPath = i->path(*localStore, drv2.name, name);
+                if (auto i = get(drv2->outputs, name)) {
+                    auto outPath = i->path(*localStore, drv2->name, name);
                     inputs.insert(*outPath);
                     basicDrv.inputSrcs.insert(*outPath);
                 }
@@ -287,7 +844,7 @@ void State::buildRemote(ref<Store> destStore,
            store. */
         if (localStore != std::shared_ptr<Store>(destStore)) {
             copyClosure(*localStore, *destStore,
-                step->drv->inputSrcs,
+                drv->inputSrcs,
                 NoRepair, NoCheckSigs, NoSubstitute);
         }
 
@@ -300,6 +857,7 @@ void State::buildRemote(ref<Store> destStore,
                 localStore->printStorePath(step->drvPath), machine->sshName);
 
             auto now1 = std::chrono::steady_clock::now();
+            Tracer::Span span(tracer, run.trace, "copy_closure_to");
 
             /* Copy the input closure. */
             if (machine->isLocalhost()) {
@@ -307,23 +865,44 @@ void State::buildRemote(ref<Store> destStore,
                 destStore->computeFSClosure(inputs, closure);
                 copyPaths(*destStore, *localStore, closure, NoRepair, NoCheckSigs, NoSubstitute);
             } else {
-                copyClosureTo(machine->state->sendLock, *destStore, from, to, inputs, true);
+                Sessions sessions(machine, conn, logFD.get(), maxParallelCopyClosure);
+                Finally updateStats([&]() {
+                    auto [received, sent] = sessions.bytes();
+                    accountTransfer(machine, received, sent);
+                });
+                copyClosureTo(machine->state->sendLock, *destStore, sessions, copyPool, maxParallelCopyClosure, inputs,
+                    tracer, run.trace, true);
             }
 
             auto now2 = std::chrono::steady_clock::now();
 
-            result.overhead += std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+            auto copyTime = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+            result.overhead += copyTime;
+            machine->state->totalCopyToTimeMs += copyTime;
+        }
+
+        /* The outputs of the input derivations are now present on
+           the machine. */
+        if (localityAwareDispatch) {
+            auto recentOutputs(machine->state->recentOutputs.lock());
+            for (auto & input : drv->inputDrvs)
+                recentOutputs->insert(input.first.to_string());
         }
 
         autoDelete.cancel();
 
         /* Truncate the log to get rid of messages about substitutions
            etc. on the remote system. */
-        if (lseek(logFD.get(), SEEK_SET, 0) != 0)
-            throw SysError("seeking to the start of log file ‘%s’", result.logFile);
+        if (result.log)
+            result.log->truncate();
+
+        else {
+            if (lseek(logFD.get(), SEEK_SET, 0) != 0)
+                throw SysError("seeking to the start of log file ‘%s’", result.logFile);
 
-        if (ftruncate(logFD.get(), 0) == -1)
-            throw SysError("truncating log file ‘%s’", result.logFile);
+            if (ftruncate(logFD.get(), 0) == -1)
+                throw SysError("truncating log file ‘%s’", result.logFile);
+        }
 
         logFD = -1;
 
@@ -336,25 +915,41 @@ void State::buildRemote(ref<Store> destStore,
 
         to << cmdBuildDerivation << localStore->printStorePath(step->drvPath);
         writeDerivation(to, *localStore, basicDrv);
-        to << maxSilentTime << buildTimeout;
-        if (GET_PROTOCOL_MINOR(remoteVersion) >= 2)
+        to << run.maxSilentTime << run.buildTimeout;
+        if (GET_PROTOCOL_MINOR(conn.remoteVersion) >= 2)
             to << maxLogSize;
-        if (GET_PROTOCOL_MINOR(remoteVersion) >= 3) {
-            to << repeats // == build-repeat
+        if (GET_PROTOCOL_MINOR(conn.remoteVersion) >= 3) {
+            to << run.repeats // == build-repeat
                << step->isDeterministic; // == enforce-determinism
         }
         to.flush();
 
         result.startTime = time(0);
-        int res;
-        {
-            MaintainCount<counter> mc(nrStepsBuilding);
-            res = readInt(from);
-        }
+
+    } catch (Error & e) {
+        disableMachine(machine);
+        throw;
+    }
+}
+
+
+void State::finishRemoteBuild(ref<Store> destStore, StepRun & run,
+    std::function<void(StepState)> updateStep)
+{
+    auto & step(run.reservation->step);
+    auto & machine(run.reservation->machine);
+    auto & result(run.result);
+    auto & conn(*run.remote);
+    auto & from(conn.from);
+    auto & to(conn.to);
+
+    try {
+
+        int res = readInt(from);
         result.stopTime = time(0);
 
         result.errorMsg = readString(from);
-        if (GET_PROTOCOL_MINOR(remoteVersion) >= 3) {
+        if (GET_PROTOCOL_MINOR(conn.remoteVersion) >= 3) {
             result.timesBuilt = readInt(from);
             result.isNonDeterministic = readInt(from);
             auto start = readInt(from);
@@ -366,7 +961,7 @@ void State::buildRemote(ref<Store> destStore,
                 result.stopTime = stop;
             }
         }
-        if (GET_PROTOCOL_MINOR(remoteVersion) >= 6) {
+        if (GET_PROTOCOL_MINOR(conn.remoteVersion) >= 6) {
             WorkerProto<DrvOutputs>::read(*localStore, from);
         }
         switch ((BuildResult::Status) res) {
@@ -417,6 +1012,9 @@ void State::buildRemote(ref<Store> destStore,
 
         result.errorMsg = "";
 
+        if (localityAwareDispatch)
+            machine->state->recentOutputs.lock()->insert(step->drvPath.to_string());
+
         /* If the path was substituted or already valid, then we didn't
            get a build log. */
         if (result.isCached) {
@@ -424,6 +1022,7 @@ void State::buildRemote(ref<Store> destStore,
                 localStore->printStorePath(step->drvPath), machine->sshName);
             unlink(result.logFile.c_str());
             result.logFile = "";
+            result.log = nullptr;
         }
 
         /* Copy the output paths. */
@@ -435,7 +1034,7 @@ void State::buildRemote(ref<Store> destStore,
             auto now1 = std::chrono::steady_clock::now();
 
             StorePathSet outputs;
-            for (auto & i : step->drv->outputsAndOptPaths(*localStore)) {
+            for (auto & i : getStepDerivation(*step)->outputsAndOptPaths(*localStore)) {
                 if (i.second.second)
                    outputs.insert(*i.second.second);
             }
@@ -443,6 +1042,7 @@ void State::buildRemote(ref<Store> destStore,
             /* Get info about each output path. */
             std::map<StorePath, ValidPathInfo> infos;
             size_t totalNarSize = 0;
+            Tracer::Span querySpan(tracer, run.trace, "query_path_infos");
             to << cmdQueryPathInfos;
             workerProtoWrite(*localStore, to, outputs);
             to.flush();
@@ -468,66 +1068,100 @@ void State::buildRemote(ref<Store> destStore,
                 infos.insert_or_assign(info.path, info);
             }
 
+            querySpan.stop();
+
+            /* Remember the sizes and references of the outputs, so
+               that getBuildOutput() doesn't have to query them. */
+            for (auto & [path, info] : infos)
+                closureSizes.insert(info);
+
             if (totalNarSize > maxOutputSize) {
                 result.stepStatus = bsNarSizeLimitExceeded;
                 return;
             }
 
-            /* Copy each path. */
-            printMsg(lvlDebug, "copying outputs of ‘%s’ from ‘%s’ (%d bytes)",
-                localStore->printStorePath(step->drvPath), machine->sshName, totalNarSize);
+            if (!builderUploadUri.empty() && !machine->isLocalhost()) {
+                printMsg(lvlDebug, "uploading outputs of ‘%s’ from ‘%s’ to ‘%s’ (%d bytes)",
+                    localStore->printStorePath(step->drvPath), machine->sshName, builderUploadUri, totalNarSize);
+                Tracer::Span uploadSpan(tracer, run.trace, "upload_from_builder");
+                uploadFromMachine(machine, conn, *destStore, builderUploadUri, infos, run.narMembers);
+            } else {
+                /* Copy each path. */
+                printMsg(lvlDebug, "copying outputs of ‘%s’ from ‘%s’ (%d bytes)",
+                    localStore->printStorePath(step->drvPath), machine->sshName, totalNarSize);
+
+                /* Paths that don't depend on each other are received
+                   through separate sessions. */
+                std::map<StorePath, StorePathSet> graph;
+                for (auto & [path, info] : infos) {
+                    auto & refs(graph[path]);
+                    for (auto & ref : info.references)
+                        /* Don't wait for paths that don't exist. That can
+                           happen due to substitutes for non-existent paths. */
+                        if (infos.count(ref)) refs.insert(ref);
+                }
 
-            auto pathsSorted = reverseTopoSortPaths(infos);
+                AutoCloseFD devNull = open("/dev/null", O_WRONLY);
+                if (!devNull) throw SysError("opening /dev/null");
 
-            for (auto & path : pathsSorted) {
-                auto & info = infos.find(path)->second;
+                Sessions sessions(machine, conn, devNull.get(), std::min((size_t) maxParallelCopyClosure, infos.size()));
+                Finally updateStats([&]() {
+                    auto [received, sent] = sessions.bytes();
+                    accountTransfer(machine, received, sent);
+                });
 
-                /* Receive the NAR from the remote and add it to the
-                   destination store. Meanwhile, extract all the info from the
-                   NAR that getBuildOutput() needs. */
-                auto source2 = sinkToSource([&](Sink & sink)
-                {
-                    /* Note: we should only send the command to dump the store
-                       path to the remote if the NAR is actually going to get read
-                       by the destination store, which won't happen if this path
-                       is already valid on the destination store. Since this
-                       lambda function only gets executed if someone tries to read
-                       from source2, we will send the command from here rather
-                       than outside the lambda. */
-                    to << cmdDumpStorePath << localStore->printStorePath(path);
-                    to.flush();
-
-                    TeeSource tee(from, sink);
-                    extractNarData(tee, localStore->printStorePath(path), narMembers);
+                std::vector<NarMemberDatas> narMembers(sessions.extra.size() + 1);
+
+                Tracer::Span importSpan(tracer, run.trace, "import_outputs");
+
+                transferPaths(copyPool, graph, maxParallelCopyClosure, 1, [&](size_t n, const StorePathSet & batch) {
+                    auto & session(sessions.get(n));
+
+                    for (auto & path : batch) {
+                        auto & info = infos.find(path)->second;
+
+                        /* Receive the NAR from the remote and add it to the
+                           destination store. Meanwhile, extract all the info from the
+                           NAR that getBuildOutput() needs. */
+                        auto source2 = sinkToSource([&](Sink & sink)
+                        {
+                            /* Note: we should only send the command to dump the store
+                               path to the remote if the NAR is actually going to get read
+                               by the destination store, which won't happen if this path
+                               is already valid on the destination store. Since this
+                               lambda function only gets executed if someone tries to read
+                               from source2, we will send the command from here rather
+                               than outside the lambda. */
+                            session.to << cmdDumpStorePath << localStore->printStorePath(path);
+                            session.to.flush();
+
+                            TeeSource tee(session.from, sink);
+                            extractNarData(tee, localStore->printStorePath(path), narMembers[n], lazyNarHashing);
+                        });
+
+                        destStore->addToStore(info, *source2, NoRepair, NoCheckSigs);
+                    }
                 });
 
-                destStore->addToStore(info, *source2, NoRepair, NoCheckSigs);
+                importSpan.stop();
+
+                for (auto & members : narMembers)
+                    run.narMembers.merge(members);
             }
 
             auto now2 = std::chrono::steady_clock::now();
 
-            result.overhead += std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+            auto copyTime = std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+            result.overhead += copyTime;
+            machine->state->totalCopyFromTimeMs += copyTime;
         }
 
         /* Shut down the connection. */
-        child.to = -1;
-        child.pid.wait();
+        conn.toFD = -1;
+        conn.pid.wait();
 
     } catch (Error & e) {
-        /* Disable this machine until a certain period of time has
-           passed. This period increases on every consecutive
-           failure. However, don't count failures that occurred soon
-           after the last one (to take into account steps started in
-           parallel). */
-        auto info(machine->state->connectInfo.lock());
-        auto now = std::chrono::system_clock::now();
-        if (info->consecutiveFailures == 0 || info->lastFailure < now - std::chrono::seconds(30)) {
-            info->consecutiveFailures = std::min(info->consecutiveFailures + 1, (unsigned int) 4);
-            info->lastFailure = now;
-            int delta = retryInterval * std::pow(retryBackoff, info->consecutiveFailures - 1) + (rand() % 30);
-            printMsg(lvlInfo, "will disable machine ‘%1%’ for %2%s", machine->sshName, delta);
-            info->disabledUntil = now + std::chrono::seconds(delta);
-        }
+        disableMachine(machine);
         throw;
     }
 }
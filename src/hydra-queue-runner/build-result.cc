@@ -8,10 +8,40 @@
 using namespace nix;
 
 
+std::optional<BuildProduct> parseBuildProduct(const std::string & line)
+{
+    static std::regex regex(
+        "([a-zA-Z0-9_-]+)" // type (e.g. "doc")
+        "[[:space:]]+"
+        "([a-zA-Z0-9_-]+)" // subtype (e.g. "readme")
+        "[[:space:]]+"
+        "(\"[^\"]+\"|[^[:space:]\"]+)" // path (may be quoted)
+        "([[:space:]]+([^[:space:]]+))?" // entry point
+        , std::regex::extended);
+
+    std::smatch match;
+    if (!std::regex_match(line, match, regex)) return std::nullopt;
+
+    BuildProduct product;
+    product.type = match[1];
+    product.subtype = match[2];
+    std::string s(match[3]);
+    product.path = s[0] == '"' ? std::string(s, 1, s.size() - 2) : s;
+    product.defaultPath = match[5];
+
+    if (product.path == "" || product.path[0] != '/') return std::nullopt;
+    product.path = canonPath(product.path);
+
+    return product;
+}
+
+
 BuildOutput getBuildOutput(
     nix::ref<Store> store,
     NarMemberDatas & narMembers,
-    const Derivation & drv)
+    const Derivation & drv,
+    bool lazyHashing,
+    ClosureSizeCache * closureSizes)
 {
     BuildOutput res;
 
@@ -19,14 +49,19 @@ BuildOutput getBuildOutput(
     StorePathSet outputs;
     StorePathSet closure;
     for (auto & i : drv.outputsAndOptPaths(*store))
-        if (i.second.second) {
-            store->computeFSClosure(*i.second.second, closure);
+        if (i.second.second)
             outputs.insert(*i.second.second);
+    if (closureSizes) {
+        res.closureSize = closureSizes->closureSize(*store, outputs);
+        for (auto & output : outputs)
+            res.size += closureSizes->narSize(*store, output);
+    } else {
+        store->computeFSClosure(outputs, closure);
+        for (auto & path : closure) {
+            auto info = store->queryPathInfo(path);
+            res.closureSize += info->narSize;
+            if (outputs.count(path)) res.size += info->narSize;
         }
-    for (auto & path : closure) {
-        auto info = store->queryPathInfo(path);
-        res.closureSize += info->narSize;
-        if (outputs.count(path)) res.size += info->narSize;
     }
 
     /* Fetch missing data. Usually buildRemote() will have extracted
@@ -39,21 +74,16 @@ BuildOutput getBuildOutput(
             {
                 store->narFromPath(output, sink);
             });
-            extractNarData(*source, outputS, narMembers);
+            extractNarData(*source, outputS, narMembers, lazyHashing);
         }
     }
 
     /* Get build products. */
     bool explicitProducts = false;
 
-    std::regex regex(
-        "([a-zA-Z0-9_-]+)" // type (e.g. "doc")
-        "[[:space:]]+"
-        "([a-zA-Z0-9_-]+)" // subtype (e.g. "readme")
-        "[[:space:]]+"
-        "(\"[^\"]+\"|[^[:space:]\"]+)" // path (may be quoted)
-        "([[:space:]]+([^[:space:]]+))?" // entry point
-        , std::regex::extended);
+    /* The regular files among the products that the extractor
+       didn't hash, per output. */
+    std::map<StorePath, std::set<Path>> unhashed;
 
     for (auto & output : outputs) {
         auto outputS = store->printStorePath(output);
@@ -70,23 +100,14 @@ BuildOutput getBuildOutput(
         explicitProducts = true;
 
         for (auto & line : tokenizeString<Strings>(productsFile->second.contents.value(), "\n")) {
-            BuildProduct product;
-
-            std::smatch match;
-            if (!std::regex_match(line, match, regex)) continue;
-
-            product.type = match[1];
-            product.subtype = match[2];
-            std::string s(match[3]);
-            product.path = s[0] == '"' ? std::string(s, 1, s.size() - 2) : s;
-            product.defaultPath = match[5];
+            auto parsed = parseBuildProduct(line);
+            if (!parsed) continue;
+            auto & product(*parsed);
 
             /* Ensure that the path exists and points into the Nix
                store. */
             // FIXME: should we disallow products referring to other
             // store paths, or that are outside the input closure?
-            if (product.path == "" || product.path[0] != '/') continue;
-            product.path = canonPath(product.path);
             if (!store->isInStore(product.path)) continue;
 
             auto file = narMembers.find(product.path);
@@ -97,13 +118,28 @@ BuildOutput getBuildOutput(
             if (file->second.type == FSAccessor::Type::tRegular) {
                 product.isRegular = true;
                 product.fileSize = file->second.fileSize.value();
-                product.sha256hash = file->second.sha256.value();
+                product.sha256hash = file->second.sha256;
+                if (!product.sha256hash) {
+                    /* Products may live in other outputs. */
+                    auto path = store->toStorePath(product.path).first;
+                    unhashed[path].insert(product.path);
+                }
             }
 
             res.products.push_back(product);
         }
     }
 
+    /* Hash the products that the extractor skipped, by reading them
+       again. This only happens for products that live in another
+       output than the one declaring them. */
+    for (auto & [path, files] : unhashed)
+        hashNarMembers(*store, path, files, narMembers);
+
+    for (auto & product : res.products)
+        if (product.isRegular && !product.sha256hash)
+            product.sha256hash = narMembers.find(product.path)->second.sha256.value();
+
     /* If no build products were explicitly declared, then add all
        outputs as a product of type "nix-build". */
     if (!explicitProducts) {
@@ -1,9 +1,15 @@
 #include <cmath>
+#include <fstream>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
 
 #include "state.hh"
 #include "hydra-build-result.hh"
 #include "finally.hh"
 #include "binary-cache-store.hh"
+#include "compression.hh"
 
 using namespace nix;
 
@@ -16,39 +22,94 @@ void setThreadName(const std::string & name)
 }
 
 
-void State::builder(MachineReservation::ptr reservation)
+static const char * phaseName(StepState phase)
+{
+    switch (phase) {
+        case ssPreparing: return "preparing";
+        case ssConnecting: return "connecting";
+        case ssSendingInputs: return "sending_inputs";
+        case ssBuilding: return "building";
+        case ssReceivingOutputs: return "receiving_outputs";
+        case ssPostProcessing: return "post_processing";
+    }
+    return "unknown";
+}
+
+
+void State::StepRun::enterPhase(std::optional<StepState> next)
 {
-    setThreadName("bld~" + std::string(reservation->step->drvPath.to_string()));
+    auto now = std::chrono::steady_clock::now();
 
-    StepResult res = sRetry;
+    if (phase) {
+        auto duration = now - phaseStart;
 
+        state.prom.step_phase_seconds.Add(
+            {{"machine", reservation->machine->sshName}, {"phase", phaseName(*phase)}},
+            prometheus::Histogram::BucketBoundaries{1, 5, 15, 60, 300, 900, 3600, 4 * 3600, 12 * 3600})
+            .Observe(std::chrono::duration<double>(duration).count());
+
+        auto stop = Tracer::clock::now();
+        state.tracer.record(phaseName(*phase), trace,
+            stop - std::chrono::duration_cast<Tracer::clock::duration>(duration), stop);
+    }
+
+    phase = next;
+    phaseStart = now;
+}
+
+
+void State::builder(MachineReservation::ptr reservation)
+{
     nrStepsStarted++;
 
-    Step::wptr wstep = reservation->step;
+    auto run = std::make_shared<StepRun>(*this, std::move(reservation));
+    run->activeStep = std::make_shared<ActiveStep>();
+    run->activeStep->step = run->reservation->step;
+    activeSteps_.lock()->insert(run->activeStep);
 
-    {
-        auto activeStep = std::make_shared<ActiveStep>();
-        activeStep->step = reservation->step;
-        activeSteps_.lock()->insert(activeStep);
+    runStep(run);
+}
+
+
+void State::runStep(StepRun::ptr run)
+{
+    setThreadName("bld~" + std::string(run->reservation->step->drvPath.to_string()));
+
+    StepResult res = sRetry;
+
+    Step::wptr wstep = run->reservation->step;
 
+    {
         Finally removeActiveStep([&]() {
-            activeSteps_.lock()->erase(activeStep);
+            /* A parked step is owned by the step waiter now. */
+            if (res == sParked) return;
+            try {
+                cleanupStep(getDestStore(), *run);
+            } catch (...) {
+                ignoreException();
+            }
+            activeSteps_.lock()->erase(run->activeStep);
         });
 
         try {
             auto destStore = getDestStore();
-            res = doBuildStep(destStore, reservation, activeStep);
+            res = run->remote
+                ? resumeBuildStep(destStore, run)
+                : doBuildStep(destStore, run);
         } catch (std::exception & e) {
             printMsg(lvlError, "uncaught exception building ‘%s’ on ‘%s’: %s",
-                localStore->printStorePath(reservation->step->drvPath),
-                reservation->machine->sshName,
+                localStore->printStorePath(run->reservation->step->drvPath),
+                run->reservation->machine->sshName,
                 e.what());
         }
     }
 
+    if (res == sParked) return;
+
     /* Release the machine and wake up the dispatcher. */
-    assert(reservation.unique());
-    reservation = 0;
+    run->closeConnection();
+    assert(run->reservation.unique());
+    run->reservation = 0;
     wakeDispatcher();
 
     /* If there was a temporary failure, retry the step after an
@@ -71,12 +132,167 @@ void State::builder(MachineReservation::ptr reservation)
 }
 
 
-State::StepResult State::doBuildStep(nix::ref<Store> destStore,
-    MachineReservation::ptr reservation,
-    std::shared_ptr<ActiveStep> activeStep)
+void State::cleanupStep(nix::ref<Store> destStore, StepRun & run)
+{
+    if (run.stepNr && !run.stepFinished) {
+        printError("marking step %d of build %d as orphaned", run.stepNr, run.buildId);
+        auto orphanedSteps_(orphanedSteps.lock());
+        orphanedSteps_->emplace(run.buildId, run.stepNr);
+    }
+
+    if (run.stepNr && uploadLogsToBinaryCache && run.result.logFile != ""
+        && destStore.dynamic_pointer_cast<BinaryCacheStore>())
+    {
+        auto upload = [this, destStore, drvPath(run.reservation->step->drvPath),
+            logFile(run.result.logFile)]()
+        {
+            logUploadPool.enqueue([this, destStore, drvPath, logFile]() {
+                uploadLog(destStore, drvPath, logFile);
+            });
+        };
+
+        /* A compressed log is complete once the processes writing
+           it have exited, which normally happened before the step
+           finished. */
+        if (run.result.log)
+            logCompressor.whenDone(*run.result.log, upload);
+        else
+            upload();
+    }
+}
+
+
+void State::uploadLog(nix::ref<Store> destStore, const StorePath & drvPath,
+    const Path & logFile)
+{
+    /* The CompressLog plugin may have compressed the log in the
+       meantime. */
+    auto path = logFile;
+    if (!pathExists(path) && pathExists(path + ".bz2"))
+        path += ".bz2";
+    if (!pathExists(path)) return;
+
+    /* Stream the log from disk rather than reading it into memory.
+       Binary cache stores may need to seek in it (e.g. to get its
+       size), so a compressed log is decompressed into a temporary
+       file first. */
+    Path plainPath = path;
+    AutoDelete deletePlain;
+    if (hasSuffix(path, ".bz2")) {
+        plainPath = std::string(path, 0, path.size() - 4) + ".upload";
+        deletePlain.reset(plainPath, false);
+        AutoCloseFD fd = open(plainPath.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0600);
+        if (!fd) throw SysError("creating ‘%s’", plainPath);
+        FdSink sink(fd.get());
+        auto decompressor = makeDecompressionSink("bzip2", sink);
+        readFile(path, *decompressor);
+        decompressor->finish();
+        sink.flush();
+    }
+
+    auto store = destStore.dynamic_pointer_cast<BinaryCacheStore>();
+
+    for (unsigned int tries = 1; ; ++tries) {
+        try {
+            auto stream = std::make_shared<std::fstream>(plainPath, std::ios::in | std::ios::binary);
+            if (!*stream) throw SysError("opening build log ‘%s’", plainPath);
+            store->upsertFile("log/" + std::string(drvPath.to_string()), stream, "text/plain; charset=utf-8");
+            break;
+        } catch (Error & e) {
+            if (tries >= maxLogUploadTries) {
+                nrLogUploadFailures++;
+                throw Error("uploading build log ‘%s’: %s", logFile, e.msg());
+            }
+            int delta = retryInterval * std::pow(retryBackoff, tries - 1);
+            printMsg(lvlError, "uploading build log ‘%s’ failed, will retry after %ss: %s", logFile, delta, e.msg());
+            nrLogUploadRetries++;
+            std::this_thread::sleep_for(std::chrono::seconds(delta));
+        }
+    }
+
+    nrLogsUploaded++;
+    unlink(path.c_str());
+}
+
+
+void State::parkStep(StepRun::ptr run)
+{
+    int fd = run->remote->fromFD.get();
+
+    parkedSteps.lock()->insert_or_assign(fd, run);
+    nrStepsBuilding++;
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLONESHOT;
+    event.data.fd = fd;
+
+    if (epoll_ctl(stepWaiterFD.get(), EPOLL_CTL_ADD, fd, &event) == -1) {
+        nrStepsBuilding--;
+        parkedSteps.lock()->erase(fd);
+        throw SysError("waiting for the result of ‘%s’", localStore->printStorePath(run->reservation->step->drvPath));
+    }
+}
+
+
+void State::stepWaiter()
 {
-    auto & step(reservation->step);
-    auto & machine(reservation->machine);
+    std::vector<struct epoll_event> events(64);
+
+    while (true) {
+        try {
+            int n = epoll_wait(stepWaiterFD.get(), events.data(), events.size(), -1);
+            if (n == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("waiting for build results");
+            }
+
+            for (int i = 0; i < n; ++i) {
+                int fd = events[i].data.fd;
+
+                StepRun::ptr run;
+                {
+                    auto parkedSteps_(parkedSteps.lock());
+                    auto j = parkedSteps_->find(fd);
+                    if (j == parkedSteps_->end()) continue;
+                    run = j->second;
+                    parkedSteps_->erase(j);
+                }
+
+                /* The fd is already disarmed (EPOLLONESHOT), so a
+                   failure here is harmless. */
+                epoll_ctl(stepWaiterFD.get(), EPOLL_CTL_DEL, fd, nullptr);
+
+                nrStepsBuilding--;
+
+                builderPool.enqueue([this, run]() { runStep(run); });
+            }
+        } catch (std::exception & e) {
+            printMsg(lvlError, "step waiter: %s", e.what());
+            sleep(1);
+        }
+    }
+}
+
+
+void State::handleStepError(StepRun & run, Error & e)
+{
+    auto & result(run.result);
+    if (run.activeStep->state_.lock()->cancelled) {
+        printInfo("marking step %d of build %d as cancelled", run.stepNr, run.buildId);
+        result.stepStatus = bsCancelled;
+        result.canRetry = false;
+    } else {
+        result.stepStatus = bsAborted;
+        result.errorMsg = e.msg();
+        result.canRetry = true;
+    }
+}
+
+
+State::StepResult State::doBuildStep(nix::ref<Store> destStore, StepRun::ptr run)
+{
+    auto & step(run->reservation->step);
+    auto & machine(run->reservation->machine);
 
     {
         auto step_(step->state.lock());
@@ -96,89 +312,104 @@ State::StepResult State::doBuildStep(nix::ref<Store> destStore,
        State::processQueueChange() to detect whether a step can be
        cancelled (namely if there are no more Builds referring to
        it). */
-    BuildID buildId;
-    std::optional<StorePath> buildDrvPath;
-    unsigned int maxSilentTime, buildTimeout;
-    unsigned int repeats = step->isDeterministic ? 1 : 0;
+    auto & buildId(run->buildId);
+    run->repeats = step->isDeterministic ? 1 : 0;
 
     auto conn(dbPool.get());
 
     {
-        std::set<Build::ptr> dependents;
-        std::set<Step::ptr> steps;
-        getDependents(step, dependents, steps);
-
-        if (dependents.empty()) {
-            /* Apparently all builds that depend on this derivation
-               are gone (e.g. cancelled). So don't bother. This is
-               very unlikely to happen, because normally Steps are
-               only kept alive by being reachable from a
-               Build. However, it's possible that a new Build just
-               created a reference to this step. So to handle that
-               possibility, we retry this step (putting it back in
-               the runnable queue). If there are really no strong
-               pointers to the step, it will be deleted. */
-            printMsg(lvlInfo, "maybe cancelling build step ‘%s’", localStore->printStorePath(step->drvPath));
-            return sMaybeCancelled;
-        }
-
         Build::ptr build;
+        std::vector<Build::ptr> direct;
+        /* Only known after a full walk. */
+        std::optional<size_t> nrDependents;
+
+        /* Usually the builds of which this is the top-level step, or
+           the representative dependent build, give us a build
+           without having to walk all the steps that depend on this
+           one. They must still be queued, otherwise they may have
+           been cancelled, in which case the walk below decides
+           whether the step is still needed. Per-jobset repeats do
+           need all dependent builds. */
+        if (jobsetRepeats.empty()) {
+            auto builds_(builds.lock());
+            auto isQueued = [&](const Build::ptr & b) {
+                auto i = builds_->find(b->id);
+                return i != builds_->end() && i->second == b;
+            };
+            auto step_(step->state.lock());
+            for (auto & b : step_->builds) {
+                auto b2 = b.lock();
+                if (b2 && isQueued(b2)) direct.push_back(b2);
+            }
+            if (!direct.empty())
+                build = direct.back();
+            else if (auto representative = step_->representativeBuild.lock(); representative && isQueued(representative))
+                build = representative;
+        }
 
-        for (auto build2 : dependents) {
-            if (build2->drvPath == step->drvPath) {
-                build = build2;
-                pqxx::work txn(*conn);
-                notifyBuildStarted(txn, build->id);
-                txn.commit();
+        if (!build) {
+            std::set<Build::ptr> dependents;
+            std::set<Step::ptr> steps;
+            getDependents(step, dependents, steps);
+
+            if (dependents.empty()) {
+                /* Apparently all builds that depend on this derivation
+                   are gone (e.g. cancelled). So don't bother. This is
+                   very unlikely to happen, because normally Steps are
+                   only kept alive by being reachable from a
+                   Build. However, it's possible that a new Build just
+                   created a reference to this step. So to handle that
+                   possibility, we retry this step (putting it back in
+                   the runnable queue). If there are really no strong
+                   pointers to the step, it will be deleted. */
+                printMsg(lvlInfo, "maybe cancelling build step ‘%s’", localStore->printStorePath(step->drvPath));
+                return sMaybeCancelled;
             }
-            {
-                auto i = jobsetRepeats.find(std::make_pair(build2->projectName, build2->jobsetName));
-                if (i != jobsetRepeats.end())
-                    repeats = std::max(repeats, i->second);
+
+            for (auto build2 : dependents) {
+                if (build2->drvPath == step->drvPath) {
+                    build = build2;
+                    direct.push_back(build2);
+                }
+                {
+                    auto i = jobsetRepeats.find(std::make_pair(build2->projectName, build2->jobsetName));
+                    if (i != jobsetRepeats.end())
+                        run->repeats = std::max(run->repeats, i->second);
+                }
             }
+            if (!build) build = *dependents.begin();
+            nrDependents = dependents.size();
+
+            step->state.lock()->representativeBuild = build;
         }
-        if (!build) build = *dependents.begin();
 
-        buildId = build->id;
-        buildDrvPath = build->drvPath;
-        maxSilentTime = build->maxSilentTime;
-        buildTimeout = build->buildTimeout;
+        for (auto & b : direct)
+            queueDbUpdate(b->id, [this, id(b->id)](pqxx::work & txn) {
+                notifyBuildStarted(txn, id);
+            });
 
-        printInfo("performing step ‘%s’ %d times on ‘%s’ (needed by build %d and %d others)",
-            localStore->printStorePath(step->drvPath), repeats + 1, machine->sshName, buildId, (dependents.size() - 1));
+        buildId = build->id;
+        run->buildDrvPath = build->drvPath;
+        run->maxSilentTime = build->maxSilentTime;
+        run->buildTimeout = build->buildTimeout;
+
+        if (nrDependents)
+            printInfo("performing step ‘%s’ %d times on ‘%s’ (needed by build %d and %d others)",
+                localStore->printStorePath(step->drvPath), run->repeats + 1, machine->sshName, buildId, (*nrDependents - 1));
+        else
+            printInfo("performing step ‘%s’ %d times on ‘%s’ (needed by build %d and possibly others)",
+                localStore->printStorePath(step->drvPath), run->repeats + 1, machine->sshName, buildId);
     }
 
     if (!buildOneDone)
-        buildOneDone = buildId == buildOne && step->drvPath == *buildDrvPath;
+        buildOneDone = buildId == buildOne && step->drvPath == *run->buildDrvPath;
 
-    RemoteResult result;
-    BuildOutput res;
-    unsigned int stepNr = 0;
-    bool stepFinished = false;
-
-    Finally clearStep([&]() {
-        if (stepNr && !stepFinished) {
-            printError("marking step %d of build %d as orphaned", stepNr, buildId);
-            auto orphanedSteps_(orphanedSteps.lock());
-            orphanedSteps_->emplace(buildId, stepNr);
-        }
-
-        if (stepNr) {
-            /* Upload the log file to the binary cache. FIXME: should
-               be done on a worker thread. */
-            try {
-                auto store = destStore.dynamic_pointer_cast<BinaryCacheStore>();
-                if (uploadLogsToBinaryCache && store && pathExists(result.logFile)) {
-                    store->upsertFile("log/" + std::string(step->drvPath.to_string()), readFile(result.logFile), "text/plain; charset=utf-8");
-                    unlink(result.logFile.c_str());
-                }
-            } catch (...) {
-                ignoreException();
-            }
-        }
-    });
+    run->trace.buildId = buildId;
+    tracer.record("runnable", run->trace, run->reservation->runnableSince, run->reservation->reservedAt);
+    tracer.record("waiting_for_builder", run->trace, run->reservation->reservedAt, Tracer::clock::now());
 
-    time_t stepStartTime = result.startTime = time(0);
+    auto & result(run->result);
+    run->stepStartTime = result.startTime = time(0);
 
     /* If any of the outputs have previously failed, then don't bother
        building again. */
@@ -189,42 +420,87 @@ State::StepResult State::doBuildStep(nix::ref<Store> destStore,
         /* Create a build step record indicating that we started
            building. */
         {
+            Tracer::Span span(tracer, run->trace, "create_step");
             auto mc = startDbUpdate();
             pqxx::work txn(*conn);
-            stepNr = createBuildStep(txn, result.startTime, buildId, step, machine->sshName, bsBusy);
+            run->stepNr = run->trace.stepNr = createBuildStep(txn, result.startTime, buildId, step, machine->sshName, bsBusy);
             txn.commit();
         }
 
         auto updateStep = [&](StepState stepState) {
-            pqxx::work txn(*conn);
-            updateBuildStep(txn, buildId, stepNr, stepState);
-            txn.commit();
+            run->enterPhase(stepState);
+            queueDbUpdate(buildId, [this, buildId, stepNr(run->stepNr), stepState](pqxx::work & txn) {
+                updateBuildStep(txn, buildId, stepNr, stepState);
+            });
         };
 
-        /* Do the build. */
-        NarMemberDatas narMembers;
-
+        /* Start the build. While the remote machine is building, the
+           step is parked so that it doesn't hold a thread or a
+           database connection. */
         try {
             /* FIXME: referring builds may have conflicting timeouts. */
-            buildRemote(destStore, machine, step, maxSilentTime, buildTimeout, repeats, result, activeStep, updateStep, narMembers);
-        } catch (Error & e) {
-            if (activeStep->state_.lock()->cancelled) {
-                printInfo("marking step %d of build %d as cancelled", stepNr, buildId);
-                result.stepStatus = bsCancelled;
-                result.canRetry = false;
-            } else {
-                result.stepStatus = bsAborted;
-                result.errorMsg = e.msg();
-                result.canRetry = true;
+            startRemoteBuild(destStore, *run, updateStep);
+            if (!run->remote->from.hasData()) {
+                parkStep(run);
+                return sParked;
             }
+        } catch (Error & e) {
+            handleStepError(*run, e);
+            run->closeConnection();
         }
 
-        if (result.stepStatus == bsSuccess) {
-            updateStep(ssPostProcessing);
-            res = getBuildOutput(destStore, narMembers, *step->drv);
-        }
+        /* The result has already arrived, so there's no point in
+           parking the step. */
+        if (run->remote) return resumeBuildStep(destStore, run);
     }
 
+    return finishStep(run, {});
+}
+
+
+State::StepResult State::resumeBuildStep(nix::ref<Store> destStore, StepRun::ptr run)
+{
+    auto & step(run->reservation->step);
+    auto & result(run->result);
+
+    auto updateStep = [&](StepState stepState) {
+        run->enterPhase(stepState);
+        queueDbUpdate(run->buildId, [this, buildId(run->buildId), stepNr(run->stepNr), stepState](pqxx::work & txn) {
+            updateBuildStep(txn, buildId, stepNr, stepState);
+        });
+    };
+
+    try {
+        finishRemoteBuild(destStore, *run, updateStep);
+    } catch (Error & e) {
+        handleStepError(*run, e);
+    }
+
+    run->closeConnection();
+
+    BuildOutput res;
+
+    if (result.stepStatus == bsSuccess) {
+        updateStep(ssPostProcessing);
+        Tracer::Span span(tracer, run->trace, "get_build_output");
+        res = getBuildOutput(destStore, run->narMembers, *getStepDerivation(*step), lazyNarHashing, &closureSizes);
+    }
+
+    return finishStep(run, res);
+}
+
+
+State::StepResult State::finishStep(StepRun::ptr run, const BuildOutput & res)
+{
+    auto & step(run->reservation->step);
+    auto & machine(run->reservation->machine);
+    auto & buildId(run->buildId);
+    auto & result(run->result);
+    auto & stepNr(run->stepNr);
+    auto & stepFinished(run->stepFinished);
+
+    run->enterPhase({});
+
     time_t stepStopTime = time(0);
     if (!result.stopTime) result.stopTime = stepStopTime;
 
@@ -233,24 +509,21 @@ State::StepResult State::doBuildStep(nix::ref<Store> destStore,
     if (result.stepStatus != bsAborted)
         result.errorMsg = "";
 
-    /* Account the time we spent building this step by dividing it
-       among the jobsets that depend on it. */
-    {
-        auto step_(step->state.lock());
-        if (!step_->jobsets.empty()) {
-            // FIXME: loss of precision.
-            time_t charge = (result.stopTime - result.startTime) / step_->jobsets.size();
-            for (auto & jobset : step_->jobsets)
-                jobset->addStep(result.startTime, charge);
-        }
-    }
-
-    /* Finish the step in the database. */
-    if (stepNr) {
-        pqxx::work txn(*conn);
-        finishBuildStep(txn, result, buildId, stepNr, machine->sshName);
-        txn.commit();
-    }
+    chargeStep(step, result.startTime, result.stopTime);
+
+    /* Finish the step in the database. If that fails, the step is
+       still marked as busy, so it's treated as orphaned. */
+    if (stepNr)
+        queueDbUpdate(buildId, [this, result, buildId, stepNr, machineName(machine->sshName),
+                trace(run->trace), queued(Tracer::clock::now())](pqxx::work & txn) {
+            finishBuildStep(txn, result, buildId, stepNr, machineName);
+            tracer.record("finish_step_in_db", trace, queued, Tracer::clock::now());
+        }, [this, buildId, stepNr](bool committed) {
+            if (!committed) {
+                printError("marking step %d of build %d as orphaned", stepNr, buildId);
+                orphanedSteps.lock()->emplace(buildId, stepNr);
+            }
+        });
 
     /* The step had a hopefully temporary failure (e.g. network
        issue). Retry a number of times. */
@@ -264,9 +537,11 @@ State::StepResult State::doBuildStep(nix::ref<Store> destStore,
             retry = step_->tries + 1 < maxTries;
         }
         if (retry) {
-            auto mc = startDbUpdate();
             stepFinished = true;
-            if (buildOneDone) exit(1);
+            if (buildOneDone) {
+                flushDbUpdates();
+                exit(1);
+            }
             return sRetry;
         }
     }
@@ -275,126 +550,141 @@ State::StepResult State::doBuildStep(nix::ref<Store> destStore,
 
         assert(stepNr);
 
-        for (auto & i : step->drv->outputsAndOptPaths(*localStore)) {
+        if (durationAwareScheduling && !result.isCached)
+            recordStepDuration(step->drvPath, result.stopTime - result.startTime);
+
+        for (auto & i : getStepDerivation(*step)->outputsAndOptPaths(*localStore)) {
             if (i.second.second)
                addRoot(*i.second.second);
         }
 
-        /* Register success in the database for all Build objects that
-           have this step as the top-level step. Since the queue
-           monitor thread may be creating new referring Builds
-           concurrently, and updating the database may fail, we do
-           this in a loop, marking all known builds, repeating until
-           there are no unmarked builds.
-        */
+        /* Register success in the database. The database is updated
+           asynchronously; a build's notification is sent after it
+           has been marked, and it's removed from ‘builds’ once that
+           has been committed. */
+        finishSucceededStep(step, [&](Build::ptr b) {
+            printInfo("marking build %1% as succeeded", b->id);
+            queueDbUpdate(b->id,
+                [this, b, res, isCached(buildId != b->id || result.isCached),
+                 startTime(result.startTime), stopTime(result.stopTime)](pqxx::work & txn)
+                {
+                    markSucceededBuild(txn, b, res, isCached, startTime, stopTime);
+                    notifyBuildFinished(txn, b->id, {});
+                },
+                [this, b](bool committed) { removeFinishedBuild(b, committed); });
+        });
 
-        std::vector<BuildID> buildIDs;
+        stepFinished = true;
 
-        while (true) {
+    } else
+        failStep(step, buildId, result, machine, stepFinished);
 
-            /* Get the builds that have this one as the top-level. */
-            std::vector<Build::ptr> direct;
-            {
-                auto steps_(steps.lock());
-                auto step_(step->state.lock());
+    // FIXME: keep stats about aborted steps?
+    nrStepsDone++;
+    totalStepTime += stepStopTime - run->stepStartTime;
+    totalStepBuildTime += result.stopTime - result.startTime;
+    machine->state->nrStepsDone++;
+    machine->state->totalStepTime += stepStopTime - run->stepStartTime;
+    machine->state->totalStepBuildTime += result.stopTime - result.startTime;
 
-                for (auto & b_ : step_->builds) {
-                    auto b = b_.lock();
-                    if (b && !b->finishedInDB) direct.push_back(b);
-                }
+    if (buildOneDone) {
+        flushDbUpdates();
+        exit(0); // testing hack; FIXME: this won't run plugins
+    }
 
-                /* If there are no builds left to update in the DB,
-                   then we're done (except for calling
-                   finishBuildStep()). Delete the step from
-                   ‘steps’. Since we've been holding the ‘steps’ lock,
-                   no new referrers can have been added in the
-                   meantime or be added afterwards. */
-                if (direct.empty()) {
-                    printMsg(lvlDebug, "finishing build step ‘%s’",
-                        localStore->printStorePath(step->drvPath));
-                    steps_->erase(step->drvPath);
-                }
-            }
+    return sDone;
+}
 
-            /* Update the database. */
-            {
-                auto mc = startDbUpdate();
 
-                pqxx::work txn(*conn);
+void State::chargeStep(Step::ptr step, time_t startTime, time_t stopTime)
+{
+    auto step_(step->state.lock());
+    if (!step_->jobsets.empty()) {
+        // FIXME: loss of precision.
+        time_t charge = (stopTime - startTime) / step_->jobsets.size();
+        for (auto & jobset : step_->jobsets)
+            jobset->addStep(startTime, charge);
+    }
+}
 
-                for (auto & b : direct) {
-                    printInfo("marking build %1% as succeeded", b->id);
-                    markSucceededBuild(txn, b, res, buildId != b->id || result.isCached,
-                        result.startTime, result.stopTime);
-                }
 
-                txn.commit();
-            }
+void State::finishSucceededStep(Step::ptr step, std::function<void(Build::ptr)> markBuild)
+{
+    /* Since the queue monitor thread may be creating new referring
+       Builds concurrently, we do this in a loop, marking all known
+       builds, repeating until there are no unmarked builds. */
+    while (true) {
 
-            stepFinished = true;
+        /* Get the builds that have this one as the top-level. */
+        std::vector<Build::ptr> direct;
+        {
+            auto steps_(steps.lock());
+            auto step_(step->state.lock());
 
-            if (direct.empty()) break;
+            for (auto & b_ : step_->builds) {
+                auto b = b_.lock();
+                if (b && !b->finishedInDB && !b->finishQueued.exchange(true))
+                    direct.push_back(b);
+            }
 
-            /* Remove the direct dependencies from ‘builds’. This will
-               cause them to be destroyed. */
-            for (auto & b : direct) {
-                auto builds_(builds.lock());
-                b->finishedInDB = true;
-                builds_->erase(b->id);
-                buildIDs.push_back(b->id);
+            /* If there are no builds left to update in the DB, then
+               we're done (except for calling finishBuildStep()).
+               Delete the step from ‘steps’. Since we've been holding
+               the ‘steps’ lock, no new referrers can have been added
+               in the meantime or be added afterwards. */
+            if (direct.empty()) {
+                printMsg(lvlDebug, "finishing build step ‘%s’",
+                    localStore->printStorePath(step->drvPath));
+                steps_->erase(step->drvPath);
             }
         }
 
-        /* Send notification about the builds that have this step as
-           the top-level. */
-        {
-            pqxx::work txn(*conn);
-            for (auto id : buildIDs)
-                notifyBuildFinished(txn, id, {});
-            txn.commit();
-        }
+        for (auto & b : direct)
+            markBuild(b);
 
-        /* Wake up any dependent steps that have no other
-           dependencies. */
-        {
-            auto step_(step->state.lock());
-            for (auto & rdepWeak : step_->rdeps) {
-                auto rdep = rdepWeak.lock();
-                if (!rdep) continue;
+        if (direct.empty()) break;
+    }
 
-                bool runnable = false;
-                {
-                    auto rdep_(rdep->state.lock());
-                    rdep_->deps.erase(step);
-                    /* Note: if the step has not finished
-                       initialisation yet, it will be made runnable in
-                       createStep(), if appropriate. */
-                    if (rdep_->deps.empty() && rdep_->created) runnable = true;
-                }
+    /* Wake up any dependent steps that have no other
+       dependencies. */
+    auto step_(step->state.lock());
+    for (auto & rdepWeak : step_->rdeps) {
+        auto rdep = rdepWeak.lock();
+        if (!rdep) continue;
 
-                if (runnable) makeRunnable(rdep);
-            }
+        bool runnable = false;
+        {
+            auto rdep_(rdep->state.lock());
+            std::erase(rdep_->deps, step);
+            /* Note: if the step has not finished initialisation yet,
+               it will be made runnable in createStep(), if
+               appropriate. */
+            if (rdep_->deps.empty() && rdep_->created) runnable = true;
         }
 
-    } else
-        failStep(*conn, step, buildId, result, machine, stepFinished);
+        if (runnable) makeRunnable(rdep);
+    }
+}
 
-    // FIXME: keep stats about aborted steps?
-    nrStepsDone++;
-    totalStepTime += stepStopTime - stepStartTime;
-    totalStepBuildTime += result.stopTime - result.startTime;
-    machine->state->nrStepsDone++;
-    machine->state->totalStepTime += stepStopTime - stepStartTime;
-    machine->state->totalStepBuildTime += result.stopTime - result.startTime;
 
-    if (buildOneDone) exit(0); // testing hack; FIXME: this won't run plugins
+void State::removeFinishedBuild(Build::ptr build, bool committed)
+{
+    /* This will cause the build to be destroyed. If it couldn't be
+       marked as finished, the queue monitor will load it again. */
+    {
+        auto builds_(builds.lock());
+        build->finishedInDB = committed;
+        builds_->erase(build->id);
+    }
 
-    return sDone;
+    if (!committed) {
+        printError("could not mark build %d as finished; will reload it from the queue", build->id);
+        rescanQueue = true;
+    }
 }
 
 
 void State::failStep(
-    Connection & conn,
     Step::ptr step,
     BuildID buildId,
     const RemoteResult & result,
@@ -402,17 +692,38 @@ void State::failStep(
     bool & stepFinished)
 {
     /* Register failure in the database for all Build objects that
-       directly or indirectly depend on this step. */
+       directly or indirectly depend on this step. This is done
+       asynchronously, on the writer of ‘buildId’, so it's ordered
+       after the updates of this step. */
 
     std::vector<BuildID> dependentIDs;
 
+    /* Remember failed paths in the database so that they won't be
+       built again. */
+    std::vector<std::string> failedOutputs;
+    if (result.stepStatus != bsCachedFailure && result.canCache)
+        for (auto & i : getStepDerivation(*step)->outputsAndOptPaths(*localStore))
+            if (i.second.second)
+                failedOutputs.push_back(localStore->printStorePath(*i.second.second));
+
     while (true) {
-        /* Get the builds and steps that depend on this step. */
-        std::set<Build::ptr> indirect;
+        /* Until the FailedPaths insert below has committed, a build
+           that is loaded in the meantime must still see the outputs
+           as failed, or it would create the step again. */
+        addPendingFailedPaths(failedOutputs, true);
+
+        /* Get the builds and steps that depend on this step, and
+           that haven't been marked yet. */
+        std::vector<Build::ptr> indirect;
         {
             auto steps_(steps.lock());
+            std::set<Build::ptr> dependents;
             std::set<Step::ptr> steps;
-            getDependents(step, indirect, steps);
+            getDependents(step, dependents, steps);
+
+            for (auto & build : dependents)
+                if (!build->finishedInDB && !build->finishQueued.exchange(true))
+                    indirect.push_back(build);
 
             /* If there are no builds left, delete all referring
                steps from ‘steps’. As for the success case, we can
@@ -426,71 +737,71 @@ void State::failStep(
             }
         }
 
-        if (indirect.empty() && stepFinished) break;
-
-        /* Update the database. */
-        {
-            auto mc = startDbUpdate();
-
-            pqxx::work txn(conn);
-
-            /* Create failed build steps for every build that
-               depends on this, except when this step is cached
-               and is the top-level of that build (since then it's
-               redundant with the build's isCachedBuild field). */
-            for (auto & build : indirect) {
-                if ((result.stepStatus == bsCachedFailure && build->drvPath == step->drvPath) ||
-                    ((result.stepStatus != bsCachedFailure && result.stepStatus != bsUnsupported) && buildId == build->id) ||
-                    build->finishedInDB)
-                    continue;
-                createBuildStep(txn,
-                    0, build->id, step, machine ? machine->sshName : "",
-                    result.stepStatus, result.errorMsg, buildId == build->id ? 0 : buildId);
-            }
+        if (indirect.empty() && stepFinished) {
+            addPendingFailedPaths(failedOutputs, false);
+            break;
+        }
 
-            /* Mark all builds that depend on this derivation as failed. */
-            for (auto & build : indirect) {
-                if (build->finishedInDB) continue;
-                printError("marking build %1% as failed", build->id);
-                txn.exec_params0
-                    ("update Builds set finished = 1, buildStatus = $2, startTime = $3, stopTime = $4, isCachedBuild = $5, notificationPendingSince = $4 where id = $1 and finished = 0",
-                     build->id,
-                     (int) (build->drvPath != step->drvPath && result.buildStatus() == bsFailed ? bsDepFailed : result.buildStatus()),
-                     result.startTime,
-                     result.stopTime,
-                     result.stepStatus == bsCachedFailure ? 1 : 0);
-                nrBuildsDone++;
-            }
+        for (auto & build : indirect) {
+            printError("marking build %1% as failed", build->id);
+            dependentIDs.push_back(build->id);
+            if (!buildOneDone && buildOne == build->id) buildOneDone = true;
+        }
 
-            /* Remember failed paths in the database so that they
-               won't be built again. */
-            if (result.stepStatus != bsCachedFailure && result.canCache)
-                for (auto & i : step->drv->outputsAndOptPaths(*localStore))
-                    if (i.second.second)
-                       txn.exec_params0("insert into FailedPaths values ($1)", localStore->printStorePath(*i.second.second));
+        /* Update the database. */
+        queueDbUpdate(buildId,
+            [this, step, buildId, result, indirect, failedOutputs,
+             machineName(machine ? machine->sshName : "")](pqxx::work & txn)
+            {
+                /* Create failed build steps for every build that
+                   depends on this, except when this step is cached
+                   and is the top-level of that build (since then it's
+                   redundant with the build's isCachedBuild field). */
+                for (auto & build : indirect) {
+                    if ((result.stepStatus == bsCachedFailure && build->drvPath == step->drvPath) ||
+                        ((result.stepStatus != bsCachedFailure && result.stepStatus != bsUnsupported) && buildId == build->id))
+                        continue;
+                    createBuildStep(txn,
+                        0, build->id, step, machineName,
+                        result.stepStatus, result.errorMsg, buildId == build->id ? 0 : buildId);
+                }
 
-            txn.commit();
-        }
+                /* Mark all builds that depend on this derivation as failed. */
+                for (auto & build : indirect)
+                    txn.exec_params0
+                        ("update Builds set finished = 1, buildStatus = $2, startTime = $3, stopTime = $4, isCachedBuild = $5, notificationPendingSince = $4 where id = $1 and finished = 0",
+                         build->id,
+                         (int) (build->drvPath != step->drvPath && result.buildStatus() == bsFailed ? bsDepFailed : result.buildStatus()),
+                         result.startTime,
+                         result.stopTime,
+                         result.stepStatus == bsCachedFailure ? 1 : 0);
+
+                for (auto & path : failedOutputs)
+                    txn.exec_prepared0("insert-failed-path", path);
+            },
+            [this, indirect, failedOutputs](bool committed)
+            {
+                if (committed) {
+                    for (auto & path : failedOutputs)
+                        addFailedPath(path);
+                    nrBuildsDone += indirect.size();
+                }
+                addPendingFailedPaths(failedOutputs, false);
+                for (auto & build : indirect)
+                    removeFinishedBuild(build, committed);
+            });
 
         stepFinished = true;
-
-        /* Remove the indirect dependencies from ‘builds’. This
-           will cause them to be destroyed. */
-        for (auto & b : indirect) {
-            auto builds_(builds.lock());
-            b->finishedInDB = true;
-            builds_->erase(b->id);
-            dependentIDs.push_back(b->id);
-            if (!buildOneDone && buildOne == b->id) buildOneDone = true;
-        }
     }
 
+    /* The remaining dependencies of the failed builds have fewer
+       dependents now. */
+    if (!dependentIDs.empty()) criticalPathsStale = true;
+
     /* Send notification about this build and its dependents. */
-    {
-        pqxx::work txn(conn);
+    queueDbUpdate(buildId, [this, buildId, dependentIDs](pqxx::work & txn) {
         notifyBuildFinished(txn, buildId, dependentIDs);
-        txn.commit();
-    }
+    });
 }
 
 
@@ -0,0 +1,58 @@
+#include "closure-size-cache.hh"
+
+using namespace nix;
+
+
+void ClosureSizeCache::insert(const ValidPathInfo & info)
+{
+    paths_.lock()->upsert(info.path, PathInfo { .narSize = info.narSize, .references = info.references });
+}
+
+
+ClosureSizeCache::PathInfo ClosureSizeCache::get(Store & store, const StorePath & path)
+{
+    if (auto info = paths_.lock()->get(path)) {
+        nrHits++;
+        return *info;
+    }
+
+    nrMisses++;
+    auto info = store.queryPathInfo(path);
+    insert(*info);
+    return PathInfo { .narSize = info->narSize, .references = info->references };
+}
+
+
+uint64_t ClosureSizeCache::narSize(Store & store, const StorePath & path)
+{
+    return get(store, path).narSize;
+}
+
+
+uint64_t ClosureSizeCache::closureSize(Store & store, const StorePathSet & paths)
+{
+    if (paths.size() == 1)
+        if (auto size = closures_.lock()->get(*paths.begin())) {
+            nrHits++;
+            return *size;
+        }
+
+    uint64_t size = 0;
+    StorePathSet done;
+    std::vector<StorePath> todo(paths.begin(), paths.end());
+
+    while (!todo.empty()) {
+        auto path = std::move(todo.back());
+        todo.pop_back();
+        if (!done.insert(path).second) continue;
+        auto info = get(store, path);
+        size += info.narSize;
+        for (auto & ref : info.references)
+            if (!done.count(ref)) todo.push_back(ref);
+    }
+
+    if (paths.size() == 1)
+        closures_.lock()->upsert(*paths.begin(), size);
+
+    return size;
+}
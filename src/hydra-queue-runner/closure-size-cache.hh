@@ -0,0 +1,50 @@
+#pragma once
+
+#include <atomic>
+
+#include "lru-cache.hh"
+#include "store-api.hh"
+#include "sync.hh"
+
+
+/* A cache of the NAR sizes and references of store paths, and of the
+   closure sizes of single paths, shared by all builds. Since store
+   paths are immutable, the entries never become stale. It can be fed
+   with path infos that we receive anyway (e.g. when copying outputs
+   from a build machine), so that computing the closure size of a
+   build usually doesn't need to query the store at all. */
+class ClosureSizeCache
+{
+public:
+
+    /* ‘capacity’ is the maximum number of store paths. */
+    ClosureSizeCache(size_t capacity)
+        : paths_(capacity), closures_(capacity)
+    { }
+
+    void insert(const nix::ValidPathInfo & info);
+
+    /* Return the NAR size of ‘path’. */
+    uint64_t narSize(nix::Store & store, const nix::StorePath & path);
+
+    /* Return the total NAR size of the closure of ‘paths’, counting
+       each path once. Paths that aren't cached are queried from
+       ‘store’. */
+    uint64_t closureSize(nix::Store & store, const nix::StorePathSet & paths);
+
+    std::atomic<uint64_t> nrHits{0}, nrMisses{0};
+
+private:
+
+    struct PathInfo
+    {
+        uint64_t narSize;
+        nix::StorePathSet references;
+    };
+
+    nix::Sync<nix::LRUCache<nix::StorePath, PathInfo>> paths_;
+
+    nix::Sync<nix::LRUCache<nix::StorePath, uint64_t>> closures_;
+
+    PathInfo get(nix::Store & store, const nix::StorePath & path);
+};
@@ -0,0 +1,126 @@
+#include "state.hh"
+
+using namespace nix;
+
+
+/* The number of times an update that fails by itself is applied
+   before giving up on it. */
+static const unsigned int maxDbUpdateTries = 3;
+
+
+void State::queueDbUpdate(BuildID buildId, DbUpdate && update, DbUpdateDone && done)
+{
+    auto & writer(*dbWriters[buildId % dbWriters.size()]);
+    {
+        auto writer_(writer.state_.lock());
+        writer_->pending.emplace_back(std::move(update), std::move(done));
+        writer_->queued++;
+    }
+    writer.wakeup.notify_one();
+    nrDbUpdatesQueued++;
+    prom.db_write_queue_length.Increment();
+}
+
+
+void State::flushDbUpdates()
+{
+    for (auto & writer : dbWriters) {
+        auto writer_(writer->state_.lock());
+        auto queued = writer_->queued;
+        while (writer_->done < queued)
+            writer_.wait(writer->flushed);
+    }
+}
+
+
+void State::dbWriter(DbWriter & writer)
+{
+    while (true) {
+        std::vector<std::pair<DbUpdate, DbUpdateDone>> batch;
+
+        {
+            auto writer_(writer.state_.lock());
+            while (writer_->pending.empty())
+                writer_.wait(writer.wakeup);
+            while (!writer_->pending.empty() && batch.size() < maxDbWriteBatch) {
+                batch.push_back(std::move(writer_->pending.front()));
+                writer_->pending.pop_front();
+            }
+        }
+
+        /* Apply the batch in a single transaction. If that fails for
+           a reason other than a lost connection, apply the updates
+           one at a time, so that one bad update doesn't cause the
+           others to be lost. An update that fails by itself is
+           retried a few times, since the failure may be transient
+           (e.g. a deadlock). If the connection is lost during the
+           commit, we can't tell whether it went through. The batch is
+           then taken to be committed rather than applied again, since
+           the updates aren't idempotent (e.g. they allocate build
+           step numbers). */
+        auto apply = [&](const std::vector<DbUpdate *> & updates) {
+            while (true) {
+                auto conn(dbPool.get());
+                try {
+                    auto mc = startDbUpdate();
+                    auto now1 = std::chrono::steady_clock::now();
+                    pqxx::work txn(*conn);
+                    for (auto update : updates)
+                        (*update)(txn);
+                    txn.commit();
+                    auto now2 = std::chrono::steady_clock::now();
+                    prom.db_write_commit_seconds.Observe(
+                        std::chrono::duration<double>(now2 - now1).count());
+                    return true;
+                } catch (pqxx::broken_connection & e) {
+                    printError("database writer: %s; retrying in 5 seconds", e.what());
+                    conn.markBad();
+                    sleep(5);
+                } catch (pqxx::in_doubt_error & e) {
+                    printError("database writer: %s; assuming that %d updates were committed", e.what(), updates.size());
+                    conn.markBad();
+                    nrDbUpdatesInDoubt++;
+                    return true;
+                } catch (std::exception & e) {
+                    if (updates.size() == 1)
+                        printError("database update failed: %s", e.what());
+                    return false;
+                }
+            }
+        };
+
+        std::vector<DbUpdate *> all;
+        for (auto & [update, done] : batch) all.push_back(&update);
+
+        std::vector<bool> committed(all.size(), true);
+
+        if (!apply(all))
+            for (size_t n = 0; n < all.size(); ++n)
+                for (unsigned int tries = 1; !(committed[n] = apply({all[n]})); ++tries) {
+                    if (tries >= maxDbUpdateTries) {
+                        printError("giving up on database update after %d tries", tries);
+                        nrDbUpdatesFailed++;
+                        break;
+                    }
+                    sleep(1);
+                }
+
+        for (size_t n = 0; n < batch.size(); ++n)
+            if (auto & done = batch[n].second) {
+                try {
+                    done(committed[n]);
+                } catch (std::exception & e) {
+                    printError("database writer: %s", e.what());
+                }
+            }
+
+        prom.db_write_queue_length.Decrement(batch.size());
+        prom.db_write_updates.Increment(batch.size());
+
+        {
+            auto writer_(writer.state_.lock());
+            writer_->done += batch.size();
+        }
+        writer.flushed.notify_all();
+    }
+}
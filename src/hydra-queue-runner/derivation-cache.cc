@@ -0,0 +1,80 @@
+#include "derivation-cache.hh"
+
+using namespace nix;
+
+
+/* A rough estimate of the heap memory used by a derivation. It only
+   needs to be good enough to keep the total size of the cache in
+   check. */
+static size_t footprint(const StorePath & drvPath, const Derivation & drv)
+{
+    /* Per-node overhead of the std::map and std::set members. */
+    const size_t nodeSize = 48;
+
+    auto pathSize = [&](const StorePath & path) {
+        return sizeof(path) + path.to_string().size();
+    };
+
+    size_t size = sizeof(drv) + pathSize(drvPath)
+        + drv.name.size() + drv.platform.size() + drv.builder.size();
+
+    for (auto & arg : drv.args)
+        size += sizeof(arg) + arg.size();
+
+    for (auto & [name, value] : drv.env)
+        size += nodeSize + 2 * sizeof(std::string) + name.size() + value.size();
+
+    for (auto & [name, output] : drv.outputs)
+        size += nodeSize + sizeof(std::string) + sizeof(output) + name.size();
+
+    for (auto & path : drv.inputSrcs)
+        size += nodeSize + pathSize(path);
+
+    for (auto & [path, outputs] : drv.inputDrvs) {
+        size += nodeSize + pathSize(path) + sizeof(outputs);
+        for (auto & name : outputs)
+            size += nodeSize + sizeof(name) + name.size();
+    }
+
+    return size;
+}
+
+
+std::shared_ptr<Derivation> DerivationCache::lookup(const StorePath & drvPath)
+{
+    auto state(state_.lock());
+
+    auto i = state->entries.find(drvPath);
+    if (i == state->entries.end()) return nullptr;
+
+    state->lru.splice(state->lru.begin(), state->lru, i->second);
+
+    return i->second->drv;
+}
+
+
+size_t DerivationCache::insert(const StorePath & drvPath, std::shared_ptr<Derivation> drv)
+{
+    auto size = footprint(drvPath, *drv);
+
+    auto state(state_.lock());
+
+    /* Another thread may have read the same derivation. */
+    if (state->entries.count(drvPath)) return 0;
+
+    state->lru.push_front({drvPath, drv, size});
+    state->entries.emplace(drvPath, state->lru.begin());
+    state->size += size;
+
+    size_t evicted = 0;
+
+    while (state->size > maxSize && !state->lru.empty()) {
+        auto & entry(state->lru.back());
+        state->size -= entry.size;
+        state->entries.erase(entry.drvPath);
+        state->lru.pop_back();
+        evicted++;
+    }
+
+    return evicted;
+}
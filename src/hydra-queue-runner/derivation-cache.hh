@@ -0,0 +1,59 @@
+#pragma once
+
+#include <list>
+#include <memory>
+#include <unordered_map>
+
+#include "derivations.hh"
+#include "sync.hh"
+
+
+/* A bounded cache of parsed derivations. When the estimated memory
+   footprint of the cached derivations exceeds ‘maxSize’ bytes, the
+   least recently used ones are evicted. Cached derivations are shared
+   between all users, so they must not be modified. */
+class DerivationCache
+{
+public:
+
+    DerivationCache(size_t maxSize) : maxSize(maxSize) { }
+
+    /* Return the derivation ‘drvPath’ if it's in the cache. */
+    std::shared_ptr<nix::Derivation> lookup(const nix::StorePath & drvPath);
+
+    /* Add a derivation to the cache. Returns the number of
+       derivations that were evicted. */
+    size_t insert(const nix::StorePath & drvPath, std::shared_ptr<nix::Derivation> drv);
+
+    /* The estimated memory footprint of the cache in bytes. */
+    size_t size()
+    {
+        return state_.lock()->size;
+    }
+
+    size_t count()
+    {
+        return state_.lock()->entries.size();
+    }
+
+private:
+
+    const size_t maxSize;
+
+    struct Entry
+    {
+        nix::StorePath drvPath;
+        std::shared_ptr<nix::Derivation> drv;
+        size_t size;
+    };
+
+    struct State
+    {
+        /* Most recently used first. */
+        std::list<Entry> lru;
+        std::unordered_map<nix::StorePath, std::list<Entry>::iterator> entries;
+        size_t size = 0;
+    };
+
+    nix::Sync<State> state_;
+};
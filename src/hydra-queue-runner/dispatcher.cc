@@ -2,6 +2,7 @@
 #include <cmath>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
 
 #include "state.hh"
 
@@ -22,7 +23,7 @@ void State::makeRunnable(Step::ptr step)
 
     {
         auto runnable_(runnable.lock());
-        runnable_->push_back(step);
+        runnable_->push(step);
     }
 
     wakeDispatcher();
@@ -46,6 +47,7 @@ void State::dispatcher()
             auto now2 = std::chrono::steady_clock::now();
 
             dispatchTimeMs += std::chrono::duration_cast<std::chrono::milliseconds>(now2 - now1).count();
+            prom.dispatch_seconds.Observe(std::chrono::duration<double>(now2 - now1).count());
 
             /* Sleep until we're woken up (either because a runnable build
                is added, or because a build finishes). */
@@ -138,150 +140,108 @@ system_time State::doDispatch()
                     a.currentJobs > b.currentJobs;
             });
 
-        /* Sort the runnable steps by priority. Priority is establised
-           as follows (in order of precedence):
-
-           - The global priority of the builds that depend on the
-             step. This allows admins to bump a build to the front of
-             the queue.
-
-           - The lowest used scheduling share of the jobsets depending
-             on the step.
-
-           - The local priority of the build, as set via the build's
-             meta.schedulingPriority field. Note that this is not
-             quite correct: the local priority should only be used to
-             establish priority between builds in the same jobset, but
-             here it's used between steps in different jobsets if they
-             happen to have the same lowest used scheduling share. But
-             that's not very likely.
-
-           - The lowest ID of the builds depending on the step;
-             i.e. older builds take priority over new ones.
-
-           FIXME: O(n lg n); obviously, it would be better to keep a
-           runnable queue sorted by priority. */
-        struct StepInfo
-        {
-            Step::ptr step;
-
-            /* The lowest share used of any jobset depending on this
-               step. */
-            double lowestShareUsed = 1e9;
-
-            /* Info copied from step->state to ensure that the
-               comparator is a partial ordering (see MachineInfo). */
-            int highestGlobalPriority;
-            int highestLocalPriority;
-            BuildID lowestBuildID;
-
-            StepInfo(Step::ptr step, Step::State & step_) : step(step)
-            {
-                for (auto & jobset : step_.jobsets)
-                    lowestShareUsed = std::min(lowestShareUsed, jobset->shareUsed());
-                highestGlobalPriority = step_.highestGlobalPriority;
-                highestLocalPriority = step_.highestLocalPriority;
-                lowestBuildID = step_.lowestBuildID;
-            }
-        };
-
-        std::vector<StepInfo> runnableSorted;
-
-        struct RunnablePerType
-        {
-            unsigned int count{0};
-            std::chrono::seconds waitTime{0};
-        };
+        /* With duration-aware scheduling, the runnable queue hands
+           out the steps on the critical path first, so give the
+           fastest machines the first pick. */
+        if (durationAwareScheduling)
+            stable_sort(machinesSorted.begin(), machinesSorted.end(),
+                [](const MachineInfo & a, const MachineInfo & b) -> bool
+                {
+                    return a.machine->speedFactor > b.machine->speedFactor;
+                });
 
-        std::unordered_map<std::string, RunnablePerType> runnablePerType;
+        /* Find a machine with a free slot and find a step to run
+           on it. Once we find such a pair, we restart the outer
+           loop because the machine sorting will have changed. The
+           runnable queue gives us the steps in order of priority
+           (see RunnableQueue). */
+        Step::ptr step;
+        Machine::ptr machine;
+        std::map<std::string, RunnableQueue::TypeStats> runnablePerType;
 
         {
             auto runnable_(runnable.lock());
-            runnableSorted.reserve(runnable_->size());
-            for (auto i = runnable_->begin(); i != runnable_->end(); ) {
-                auto step = i->lock();
 
-                /* Remove dead steps. */
-                if (!step) {
-                    i = runnable_->erase(i);
-                    continue;
-                }
+            /* Steps that previously failed become eligible again once
+               their retry time has passed. */
+            sleepUntil = std::min(sleepUntil, runnable_->promote(now));
 
-                ++i;
+            for (auto & mi : machinesSorted) {
+                if (mi.machine->state->currentJobs >= mi.machine->maxJobs) continue;
 
-                auto & r = runnablePerType[step->systemType];
-                r.count++;
+                /* Only steps of a type that this machine supports
+                   are considered. */
+                step = runnable_->pop(mi.machine);
 
-                /* Skip previously failed steps that aren't ready
-                   to be retried. */
-                auto step_(step->state.lock());
-                r.waitTime += std::chrono::duration_cast<std::chrono::seconds>(now - step_->runnableSince);
-                if (step_->tries > 0 && step_->after > now) {
-                    if (step_->after < sleepUntil)
-                        sleepUntil = step_->after;
-                    continue;
+                if (step) {
+                    machine = mi.machine;
+                    break;
                 }
-
-                runnableSorted.emplace_back(step, *step_);
             }
-        }
 
-        sort(runnableSorted.begin(), runnableSorted.end(),
-            [](const StepInfo & a, const StepInfo & b)
-            {
-                return
-                    a.highestGlobalPriority != b.highestGlobalPriority ? a.highestGlobalPriority > b.highestGlobalPriority :
-                    a.lowestShareUsed != b.lowestShareUsed ? a.lowestShareUsed < b.lowestShareUsed :
-                    a.highestLocalPriority != b.highestLocalPriority ? a.highestLocalPriority > b.highestLocalPriority :
-                    a.lowestBuildID < b.lowestBuildID;
-            });
-
-        /* Find a machine with a free slot and find a step to run
-           on it. Once we find such a pair, we restart the outer
-           loop because the machine sorting will have changed. */
-        keepGoing = false;
-
-        for (auto & mi : machinesSorted) {
-            if (mi.machine->state->currentJobs >= mi.machine->maxJobs) continue;
-
-            for (auto & stepInfo : runnableSorted) {
-                auto & step(stepInfo.step);
-
-                /* Can this machine do this step? */
-                if (!mi.machine->supportsStep(step)) {
-                    debug("machine '%s' does not support step '%s' (system type '%s')",
-                        mi.machine->sshName, localStore->printStorePath(step->drvPath), step->drv->platform);
-                    continue;
-                }
-
-                /* Let's do this step. Remove it from the runnable
-                   list. FIXME: O(n). */
-                {
-                    auto runnable_(runnable.lock());
-                    bool removed = false;
-                    for (auto i = runnable_->begin(); i != runnable_->end(); )
-                        if (i->lock() == step) {
-                            i = runnable_->erase(i);
-                            removed = true;
-                            break;
-                        } else ++i;
-                    assert(removed);
-                    auto & r = runnablePerType[step->systemType];
-                    assert(r.count);
-                    r.count--;
-                }
-
-                /* Make a slot reservation and start a thread to
-                   do the build. */
-                auto builderThread = std::thread(&State::builder, this,
-                    std::make_shared<MachineReservation>(*this, step, mi.machine));
-                builderThread.detach(); // FIXME?
+            runnablePerType = runnable_->typeStats();
+        }
 
-                keepGoing = true;
-                break;
+        /* Among the machines that are as good a choice as ‘machine’,
+           prefer the one that already has most of the inputs of the
+           step, to avoid copying them. */
+        if (step && localityAwareDispatch) {
+            auto tier = [](const MachineInfo & mi) {
+                return std::make_pair(std::round(mi.currentJobs / mi.machine->speedFactor), mi.machine->speedFactor);
+            };
+
+            auto chosen = std::find_if(machinesSorted.begin(), machinesSorted.end(),
+                [&](const MachineInfo & mi) { return mi.machine == machine; });
+
+            std::vector<Machine::ptr> candidates;
+            for (auto & mi : machinesSorted)
+                if (mi.machine != machine
+                    && mi.currentJobs < mi.machine->maxJobs
+                    && tier(mi) == tier(*chosen)
+                    && mi.machine->supportsStep(step))
+                    candidates.push_back(mi.machine);
+
+            if (!candidates.empty()) {
+                auto overlap = [&](const Machine::ptr & m) {
+                    auto recentOutputs(m->state->recentOutputs.lock());
+                    size_t n = 0;
+                    for (auto h : step->inputHashes)
+                        if (recentOutputs->contains(h)) n++;
+                    return n;
+                };
+
+                auto best = overlap(machine);
+                for (auto & m : candidates)
+                    if (auto n = overlap(m); n > best) {
+                        best = n;
+                        machine = m;
+                    }
+
+                if (machine != chosen->machine)
+                    prom.dispatch_locality_picks.Increment();
             }
+        }
 
-            if (keepGoing) break;
+        keepGoing = (bool) step;
+
+        /* Make a slot reservation and hand the build to a builder
+           thread. */
+        if (step) {
+            auto runnableSince = step->state.lock()->runnableSince;
+            prom.step_wait_seconds.Add({{"system", step->type->systemType}},
+                prometheus::Histogram::BucketBoundaries{1, 10, 60, 300, 900, 3600, 4 * 3600, 12 * 3600, 24 * 3600})
+                .Observe(std::chrono::duration<double>(std::chrono::system_clock::now() - runnableSince).count());
+
+            auto reservation = std::make_shared<MachineReservation>(*this, step, machine);
+            reservation->runnableSince = runnableSince;
+#ifdef HYDRA_QUEUE_RUNNER_BENCH
+            if (onDispatch)
+                onDispatch(reservation);
+            else
+#endif
+            builderPool.enqueue([this, reservation]() mutable {
+                builder(std::move(reservation));
+            });
         }
 
         /* Update the stats for the auto-scaler. */
@@ -291,10 +251,12 @@ system_time State::doDispatch()
             for (auto & i : *machineTypes_)
                 i.second.runnable = 0;
 
+            auto now2 = std::chrono::system_clock::to_time_t(now);
+
             for (auto & i : runnablePerType) {
                 auto & j = (*machineTypes_)[i.first];
                 j.runnable = i.second.count;
-                j.waitTime = i.second.waitTime;
+                j.waitTime = std::chrono::seconds(i.second.count * now2 - i.second.runnableSinceSum);
             }
         }
 
@@ -320,45 +282,36 @@ void State::wakeDispatcher()
 
 void State::abortUnsupported()
 {
-    /* Make a copy of 'runnable' and 'machines' so we don't block them
-       very long. */
-    auto runnable2 = *runnable.lock();
-    auto machines2 = *machines.lock();
-
     system_time now = std::chrono::system_clock::now();
     auto now2 = time(0);
 
+    /* Get the runnable steps for which there is no machine. The
+       partitions of the runnable queue know which machines support
+       them, so this doesn't require checking every step against
+       every machine. */
+    auto unsupported = runnable.lock()->unsupported(now);
+
     std::unordered_set<Step::ptr> aborted;
 
     size_t count = 0;
 
-    for (auto & wstep : runnable2) {
-        auto step(wstep.lock());
-        if (!step) continue;
+    for (auto & [step, lastSupported] : unsupported) {
+        count++;
 
-        bool supported = false;
-        for (auto & machine : machines2) {
-            if (machine.second->supportsStep(step)) {
-                step->state.lock()->lastSupported = now;
-                supported = true;
-                break;
-            }
+        bool expired;
+        {
+            auto step_(step->state.lock());
+            step_->lastSupported = std::max(step_->lastSupported, lastSupported);
+            expired = std::chrono::duration_cast<std::chrono::seconds>(now - step_->lastSupported).count() >= maxUnsupportedTime;
         }
 
-        if (!supported)
-            count++;
-
-        if (!supported
-            && std::chrono::duration_cast<std::chrono::seconds>(now - step->state.lock()->lastSupported).count() >= maxUnsupportedTime)
-        {
+        if (expired) {
             printError("aborting unsupported build step '%s' (type '%s')",
                 localStore->printStorePath(step->drvPath),
-                step->systemType);
+                step->type->systemType);
 
             aborted.insert(step);
 
-            auto conn(dbPool.get());
-
             std::set<Build::ptr> dependents;
             std::set<Step::ptr> steps;
             getDependents(step, dependents, steps);
@@ -378,29 +331,28 @@ void State::abortUnsupported()
             bool stepFinished = false;
 
             failStep(
-                *conn, step, build->id,
+                step, build->id,
                 RemoteResult {
                     .stepStatus = bsUnsupported,
                     .errorMsg = fmt("unsupported system type '%s'",
-                        step->systemType),
+                        step->type->systemType),
                     .startTime = now2,
                     .stopTime = now2,
                 },
                 nullptr, stepFinished);
 
-            if (buildOneDone) exit(1);
+            if (buildOneDone) {
+                flushDbUpdates();
+                exit(1);
+            }
         }
     }
 
     /* Clean up 'runnable'. */
     {
         auto runnable_(runnable.lock());
-        for (auto i = runnable_->begin(); i != runnable_->end(); ) {
-            if (aborted.count(i->lock()))
-                i = runnable_->erase(i);
-            else
-                ++i;
-        }
+        for (auto & step : aborted)
+            runnable_->remove(step);
     }
 
     nrUnsupportedSteps = count;
@@ -410,11 +362,21 @@ void State::abortUnsupported()
 void Jobset::addStep(time_t startTime, time_t duration)
 {
     auto steps_(steps.lock());
-    (*steps_)[startTime] = duration;
+    auto & d((*steps_)[startTime]);
+    stepSeconds += duration - d;
+    d = duration;
     seconds += duration;
 }
 
 
+std::optional<double> Jobset::averageStepTime()
+{
+    auto steps_(steps.lock());
+    if (steps_->empty()) return std::nullopt;
+    return (double) stepSeconds / steps_->size();
+}
+
+
 void Jobset::pruneSteps()
 {
     time_t now = time(0);
@@ -423,6 +385,7 @@ void Jobset::pruneSteps()
         auto i = steps_->begin();
         if (i->first > now - schedulingWindow) break;
         seconds -= i->second;
+        stepSeconds -= i->second;
         steps_->erase(i);
     }
 }
@@ -435,7 +398,7 @@ State::MachineReservation::MachineReservation(State & state, Step::ptr step, Mac
 
     {
         auto machineTypes_(state.machineTypes.lock());
-        (*machineTypes_)[step->systemType].running++;
+        (*machineTypes_)[step->type->systemType].running++;
     }
 }
 
@@ -449,7 +412,7 @@ State::MachineReservation::~MachineReservation()
 
     {
         auto machineTypes_(state.machineTypes.lock());
-        auto & machineType = (*machineTypes_)[step->systemType];
+        auto & machineType = (*machineTypes_)[step->type->systemType];
         assert(machineType.running);
         machineType.running--;
         if (machineType.running == 0)
@@ -6,6 +6,7 @@
 #include "derivations.hh"
 #include "store-api.hh"
 #include "nar-extractor.hh"
+#include "closure-size-cache.hh"
 
 struct BuildProduct
 {
@@ -39,7 +40,15 @@ struct BuildOutput
     std::map<std::string, BuildMetric> metrics;
 };
 
+/* Parse a line of ‘nix-support/hydra-build-products’. This sets the
+   type, subtype, path and default path of the product. The path is
+   canonicalised but not otherwise checked. Returns nothing if the
+   line is malformed or the path isn't absolute. */
+std::optional<BuildProduct> parseBuildProduct(const std::string & line);
+
 BuildOutput getBuildOutput(
     nix::ref<nix::Store> store,
     NarMemberDatas & narMembers,
-    const nix::Derivation & drv);
+    const nix::Derivation & drv,
+    bool lazyHashing = false,
+    ClosureSizeCache * closureSizes = nullptr);
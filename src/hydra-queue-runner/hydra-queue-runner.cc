@@ -1,10 +1,19 @@
+#include <algorithm>
+#include <cstring>
 #include <iostream>
 #include <thread>
 #include <optional>
+#include <fstream>
 
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
+#include <sys/epoll.h>
+#include <poll.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
 
 #include <prometheus/exposer.h>
 
@@ -75,24 +84,221 @@ State::PromMetrics::PromMetrics()
             .Register(*registry)
             .Add({})
     )
+    , queue_changes_incremental(
+        prometheus::BuildCounter()
+            .Name("hydraqueuerunner_queue_changes_incremental_total")
+            .Help("Number of times cancellations and bumps of specific builds were processed")
+            .Register(*registry)
+            .Add({})
+    )
+    , queue_changes_full(
+        prometheus::BuildCounter()
+            .Name("hydraqueuerunner_queue_changes_full_total")
+            .Help("Number of times all queued builds were checked for cancellations and bumps")
+            .Register(*registry)
+            .Add({})
+    )
+    , db_write_queue_length(
+        prometheus::BuildGauge()
+            .Name("hydraqueuerunner_db_write_queue_length")
+            .Help("Number of asynchronous database updates waiting to be applied")
+            .Register(*registry)
+            .Add({})
+    )
+    , db_write_updates(
+        prometheus::BuildCounter()
+            .Name("hydraqueuerunner_db_write_updates_total")
+            .Help("Number of asynchronous database updates applied")
+            .Register(*registry)
+            .Add({})
+    )
+    , db_write_commit_seconds(
+        prometheus::BuildHistogram()
+            .Name("hydraqueuerunner_db_write_commit_seconds")
+            .Help("Time taken to apply and commit a batch of asynchronous database updates")
+            .Register(*registry)
+            .Add({}, prometheus::Histogram::BucketBoundaries{0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5})
+    )
+    , drv_cache_hits(
+        prometheus::BuildCounter()
+            .Name("hydraqueuerunner_drv_cache_hits_total")
+            .Help("Number of derivations found in the derivation cache")
+            .Register(*registry)
+            .Add({})
+    )
+    , drv_cache_misses(
+        prometheus::BuildCounter()
+            .Name("hydraqueuerunner_drv_cache_misses_total")
+            .Help("Number of derivations read from the store because they were not in the derivation cache")
+            .Register(*registry)
+            .Add({})
+    )
+    , drv_cache_evictions(
+        prometheus::BuildCounter()
+            .Name("hydraqueuerunner_drv_cache_evictions_total")
+            .Help("Number of derivations evicted from the derivation cache")
+            .Register(*registry)
+            .Add({})
+    )
+    , drv_cache_size(
+        prometheus::BuildGauge()
+            .Name("hydraqueuerunner_drv_cache_size_bytes")
+            .Help("Estimated memory footprint of the derivation cache")
+            .Register(*registry)
+            .Add({})
+    )
+    , dispatch_seconds(
+        prometheus::BuildHistogram()
+            .Name("hydraqueuerunner_dispatch_seconds")
+            .Help("Time taken by a run of the dispatcher")
+            .Register(*registry)
+            .Add({}, prometheus::Histogram::BucketBoundaries{0.0001, 0.0005, 0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1})
+    )
+    , step_wait_seconds(
+        prometheus::BuildHistogram()
+            .Name("hydraqueuerunner_step_wait_seconds")
+            .Help("Time between a step becoming runnable and being started, by system type")
+            .Register(*registry)
+    )
+    , step_phase_seconds(
+        prometheus::BuildHistogram()
+            .Name("hydraqueuerunner_step_phase_seconds")
+            .Help("Time spent in each phase of a build step, by machine")
+            .Register(*registry)
+    )
+    , db_transaction_seconds(
+        prometheus::BuildHistogram()
+            .Name("hydraqueuerunner_db_transaction_seconds")
+            .Help("Time taken by a database update transaction")
+            .Register(*registry)
+            .Add({}, prometheus::Histogram::BucketBoundaries{0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5})
+    )
+    , dispatch_locality_picks(
+        prometheus::BuildCounter()
+            .Name("hydraqueuerunner_dispatch_locality_picks_total")
+            .Help("Number of steps dispatched to a machine because it already had more of their inputs")
+            .Register(*registry)
+            .Add({})
+    )
+    , db_query_seconds(
+        prometheus::BuildHistogram()
+            .Name("hydraqueuerunner_db_query_seconds")
+            .Help("Time taken by read-only queries that may use the replica, by connection pool")
+            .Register(*registry)
+    )
+    , db_replica_lag_seconds(
+        prometheus::BuildGauge()
+            .Name("hydraqueuerunner_db_replica_lag_seconds")
+            .Help("How far the read replica lags behind the primary (+Inf if it can't be reached)")
+            .Register(*registry)
+            .Add({})
+    )
+    , db_replica_fallbacks(
+        prometheus::BuildCounter()
+            .Name("hydraqueuerunner_db_replica_fallbacks_total")
+            .Help("Number of reads that went to the primary because the replica failed")
+            .Register(*registry)
+            .Add({})
+    )
 {
 
 }
 
+
+/* Statements on the hot path, which are prepared once per connection
+   rather than planned on every execution. The read-only ones are also
+   prepared on replica connections. */
+static const struct { const char * name, * sql; bool readOnly; } preparedStatements[] = {
+    {"failed-paths",
+     "select 1 from FailedPaths where path = any($1) limit 1", true},
+    {"cached-build-outputs",
+     "select c.path, b.id, b.buildStatus, b.releaseName, b.closureSize, b.size, "
+     "(select json_agg(json_build_array(p.type, p.subtype, p.fileSize, p.sha256hash, p.path, p.name, p.defaultPath) order by p.productnr) "
+     " from BuildProducts p where p.build = b.id), "
+     "(select json_agg(json_build_array(m.name, m.unit, m.value)) from BuildMetrics m where m.build = b.id) "
+     "from (select distinct on (o.path) o.path, o.build from BuildOutputs o join Builds b on b.id = o.build "
+     "      where o.path = any($1) and b.finished = 1 and (b.buildStatus = 0 or b.buildStatus = 6) "
+     "      order by o.path, o.build desc) c "
+     "join Builds b on b.id = c.build", true},
+    {"unfinished-builds",
+     "select id, globalPriority from Builds where finished = 0 and id = any($1)", false},
+    {"is-unfinished",
+     "select 1 from Builds where id = $1 and finished = 0", false},
+    {"insert-failed-path",
+     "insert into FailedPaths values ($1)", false},
+    {"alloc-build-step",
+     "select max(stepnr) from BuildSteps where build = $1", false},
+    {"insert-build-step",
+     "insert into BuildSteps (build, stepnr, type, drvPath, busy, startTime, system, status, propagatedFrom, errorMsg, stopTime, machine) "
+     "values ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12) on conflict do nothing", false},
+    {"insert-build-step-output",
+     "insert into BuildStepOutputs (build, stepnr, name, path) values ($1, $2, $3, $4)", false},
+    {"update-build-step",
+     "update BuildSteps set busy = $1 where build = $2 and stepnr = $3 and busy != 0 and status is null", false},
+    {"finish-build-step",
+     "update BuildSteps set busy = 0, status = $1, errorMsg = $4, startTime = $5, stopTime = $6, machine = $7, overhead = $8, timesBuilt = $9, isNonDeterministic = $10 "
+     "where build = $2 and stepnr = $3", false},
+};
+
+
+static ref<Connection> openConnection(const std::string & var, bool readOnly)
+{
+    auto conn = make_ref<Connection>(var);
+    for (auto & stmt : preparedStatements)
+        if (stmt.readOnly || !readOnly)
+            conn->prepare(stmt.name, stmt.sql);
+    return conn;
+}
+
 State::State(std::optional<std::string> metricsAddrOpt)
     : config(std::make_unique<HydraConfig>())
+    , maxParallelCopyClosure(std::max(config->getIntOption("max_parallel_copy_closure", 4), (uint64_t) 1))
+    , nrCopyThreads(std::max(config->getIntOption("max_copy_threads", 32), (uint64_t) 1))
     , maxUnsupportedTime(config->getIntOption("max_unsupported_time", 0))
-    , dbPool(config->getIntOption("max_db_connections", 128))
+    , dbPool(config->getIntOption("max_db_connections", 128),
+        []() { return openConnection("HYDRA_DBI", false); })
+    , replicaPool(getEnv("HYDRA_DBI_REPLICA")
+        ? std::make_unique<Pool<Connection>>(config->getIntOption("max_replica_db_connections", 32),
+            []() { return openConnection("HYDRA_DBI_REPLICA", true); },
+            [](const ref<Connection> & conn) { return conn->is_open(); })
+        : nullptr)
+    , maxReplicaLag(config->getIntOption("max_replica_lag", 60))
+    , maxDbWriteBatch(std::max(config->getIntOption("max_db_write_batch", 100), (uint64_t) 1))
     , maxOutputSize(config->getIntOption("max_output_size", 2ULL << 30))
     , maxLogSize(config->getIntOption("max_log_size", 64ULL << 20))
+    , nrBuilderThreads(config->getIntOption("max_builder_threads", std::max(16U, 4 * std::thread::hardware_concurrency())))
+    , nrQueueThreads(std::max(config->getIntOption("max_queue_threads", 16), (uint64_t) 1))
+    , drvCache(config->getIntOption("max_derivation_cache_size", 256ULL << 20))
+    , closureSizes(std::max(config->getIntOption("max_closure_size_cache_entries", 1 << 17), (uint64_t) 1))
+    , compactSteps(config->getBoolOption("compact_steps", false))
+    , tracer(config->getIntOption("trace_buffer_size", 65536))
+    , durationAwareScheduling(config->getBoolOption("duration_aware_scheduling", false))
+    , localityAwareDispatch(config->getBoolOption("locality_aware_dispatch", true))
+    , queueResyncInterval(std::max(config->getIntOption("queue_resync_interval", 3600), (uint64_t) 1))
     , uploadLogsToBinaryCache(config->getBoolOption("upload_logs_to_binary_cache", false))
+    , nrLogUploadThreads(std::max(config->getIntOption("max_log_upload_threads", 4), (uint64_t) 1))
+    , maxLogUploadTries(std::max(config->getIntOption("max_log_upload_tries", 3), (uint64_t) 1))
+    , compressBuildLogs(config->getBoolOption("stream_compress_build_logs", false))
+    , nrLogCompressorThreads(std::max(config->getIntOption("log_compressor_threads", 2), (uint64_t) 1))
+    , builderUploadUri(config->getStrOption("builder_upload_store_uri", ""))
+    , lazyNarHashing(config->getBoolOption("lazy_nar_hashing", false))
     , rootsDir(config->getStrOption("gc_roots_dir", fmt("%s/gcroots/per-user/%s/hydra-roots", settings.nixStateDir, getEnvOrDie("LOGNAME"))))
     , metricsAddr(config->getStrOption("queue_runner_metrics_address", std::string{"127.0.0.1:9198"}))
 {
     hydraData = getEnvOrDie("HYDRA_DATA");
 
+    auto nrDbWriters = std::max(config->getIntOption("db_writer_threads", 1), (uint64_t) 1);
+    for (uint64_t n = 0; n < nrDbWriters; ++n)
+        dbWriters.push_back(std::make_unique<DbWriter>());
+
     logDir = canonPath(hydraData + "/build-logs");
 
+    /* Outputs uploaded by the machines don't go through our binary
+       cache store, so it must not remember that they were missing
+       when we checked them before the build. */
+    if (builderUploadUri != "")
+        settings.ttlNegativeNarInfoCache = 0;
+
     if (metricsAddrOpt.has_value()) {
         metricsAddr = metricsAddrOpt.value();
     }
@@ -111,11 +317,78 @@ State::State(std::optional<std::string> metricsAddrOpt)
 }
 
 
-nix::MaintainCount<counter> State::startDbUpdate()
+State::ActiveDbUpdate State::startDbUpdate()
 {
     if (nrActiveDbUpdates > 6)
         printError("warning: %d concurrent database updates; PostgreSQL may be stalled", nrActiveDbUpdates.load());
-    return MaintainCount<counter>(nrActiveDbUpdates);
+    return ActiveDbUpdate(nrActiveDbUpdates, prom.db_transaction_seconds);
+}
+
+
+void State::readFromReplica(std::function<void(Connection &)> f, Connection * primary)
+{
+    auto run = [&](Connection & conn, const std::string & pool) {
+        auto start = std::chrono::steady_clock::now();
+        f(conn);
+        prom.db_query_seconds.Add({{"pool", pool}},
+            prometheus::Histogram::BucketBoundaries{0.001, 0.005, 0.01, 0.05, 0.1, 0.5, 1, 5})
+            .Observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    };
+
+    if (replicaPool && replicaLag <= maxReplicaLag) {
+        /* Broken connections are dropped by the pool's validator. */
+        try {
+            auto conn(replicaPool->get());
+            run(*conn, "replica");
+            return;
+        } catch (pqxx::failure & e) {
+            prom.db_replica_fallbacks.Increment();
+            printMsg(lvlInfo, "reading from the primary database instead of the replica: %s", e.what());
+        }
+    }
+
+    if (primary)
+        run(*primary, "primary");
+    else {
+        auto conn(dbPool.get());
+        run(*conn, "primary");
+    }
+}
+
+
+void State::replicaMonitor()
+{
+    while (true) {
+        try {
+            /* The time since the last replayed transaction is only
+               the lag if the replica hasn't replayed the WAL that the
+               primary has written; otherwise the primary has simply
+               been idle. Compare with the primary's position rather
+               than with what the replica has received, since the
+               latter stops advancing if it loses its connection to
+               the primary. */
+            std::string primaryLsn;
+            {
+                auto conn(dbPool.get());
+                pqxx::work txn(*conn);
+                primaryLsn = txn.exec("select pg_current_wal_lsn()::text")[0][0].as<std::string>();
+            }
+
+            auto conn(replicaPool->get());
+            pqxx::work txn(*conn);
+            auto res = txn.exec_params1
+                ("select case when not pg_is_in_recovery() or pg_last_wal_replay_lsn() >= $1::pg_lsn then 0 "
+                 "else extract(epoch from now() - pg_last_xact_replay_timestamp()) end",
+                 primaryLsn);
+            /* Nothing has been replayed yet. */
+            replicaLag = res[0].is_null() ? std::numeric_limits<double>::infinity() : res[0].as<double>();
+        } catch (std::exception & e) {
+            printError("measuring the lag of the database replica: %s", e.what());
+            replicaLag = std::numeric_limits<double>::infinity();
+        }
+        prom.db_replica_lag_seconds.Set(replicaLag);
+        sleep(10);
+    }
 }
 
 
@@ -133,53 +406,7 @@ void State::parseMachines(const std::string & contents)
         oldMachines = *machines_;
     }
 
-    for (auto line : tokenizeString<Strings>(contents, "\n")) {
-        line = trim(std::string(line, 0, line.find('#')));
-        auto tokens = tokenizeString<std::vector<std::string>>(line);
-        if (tokens.size() < 3) continue;
-        tokens.resize(8);
-
-        auto machine = std::make_shared<Machine>();
-        machine->sshName = tokens[0];
-        machine->systemTypes = tokenizeString<StringSet>(tokens[1], ",");
-        machine->sshKey = tokens[2] == "-" ? std::string("") : tokens[2];
-        if (tokens[3] != "")
-            machine->maxJobs = string2Int<decltype(machine->maxJobs)>(tokens[3]).value();
-        else
-            machine->maxJobs = 1;
-        machine->speedFactor = atof(tokens[4].c_str());
-        if (tokens[5] == "-") tokens[5] = "";
-        machine->supportedFeatures = tokenizeString<StringSet>(tokens[5], ",");
-        if (tokens[6] == "-") tokens[6] = "";
-        machine->mandatoryFeatures = tokenizeString<StringSet>(tokens[6], ",");
-        for (auto & f : machine->mandatoryFeatures)
-            machine->supportedFeatures.insert(f);
-        if (tokens[7] != "" && tokens[7] != "-")
-            machine->sshPublicHostKey = base64Decode(tokens[7]);
-
-        /* Re-use the State object of the previous machine with the
-           same name. */
-        auto i = oldMachines.find(machine->sshName);
-        if (i == oldMachines.end())
-            printMsg(lvlChatty, "adding new machine ‘%1%’", machine->sshName);
-        else
-            printMsg(lvlChatty, "updating machine ‘%1%’", machine->sshName);
-        machine->state = i == oldMachines.end()
-            ? std::make_shared<Machine::State>()
-            : i->second->state;
-        newMachines[machine->sshName] = machine;
-    }
-
-    for (auto & m : oldMachines)
-        if (newMachines.find(m.first) == newMachines.end()) {
-            if (m.second->enabled)
-                printInfo("removing machine ‘%1%’", m.first);
-            /* Add a disabled Machine object to make sure stats are
-               maintained. */
-            auto machine = std::make_shared<Machine>(*(m.second));
-            machine->enabled = false;
-            newMachines[m.first] = machine;
-        }
+    bool changed = ::parseMachines(contents, oldMachines, newMachines);
 
     static bool warned = false;
     if (newMachines.empty() && !warned) {
@@ -187,13 +414,61 @@ void State::parseMachines(const std::string & contents)
         warned = true;
     }
 
-    auto machines_(machines.lock());
-    *machines_ = newMachines;
+    if (!changed) return;
+
+    {
+        auto machines_(machines.lock());
+        *machines_ = newMachines;
+    }
+
+    /* Determine which machines can build each type of runnable
+       step. */
+    {
+        std::vector<Machine::ptr> machines2;
+        for (auto & m : newMachines)
+            machines2.push_back(m.second);
+        runnable.lock()->setMachines(machines2);
+    }
 
     wakeDispatcher();
 }
 
 
+void State::reloadMachines()
+{
+    auto sources_(machinesSources.lock());
+
+    auto contents = sources_->files;
+    for (auto & [name, line] : sources_->extra)
+        contents += line + "\n";
+
+    parseMachines(contents);
+}
+
+
+void State::updateMachines(const std::vector<std::string> & payloads)
+{
+    {
+        auto sources_(machinesSources.lock());
+        for (auto & payload : payloads) {
+            auto tokens = tokenizeString<std::vector<std::string>>(payload);
+            if (tokens.size() >= 4 && tokens[0] == "add") {
+                /* Strip the "add" keyword. */
+                auto line = trim(std::string(payload, payload.find("add") + 3));
+                printInfo("adding machine ‘%s’ from notification", tokens[1]);
+                sources_->extra.insert_or_assign(tokens[1], line);
+            } else if (tokens.size() == 2 && tokens[0] == "remove") {
+                printInfo("removing machine ‘%s’ from notification", tokens[1]);
+                sources_->extra.erase(tokens[1]);
+            } else
+                printError("ignoring invalid machines update ‘%s’", payload);
+        }
+    }
+
+    reloadMachines();
+}
+
+
 void State::monitorMachinesFile()
 {
     std::string defaultMachinesFile = "/etc/nix/machines";
@@ -201,19 +476,35 @@ void State::monitorMachinesFile()
         getEnv("NIX_REMOTE_SYSTEMS").value_or(pathExists(defaultMachinesFile) ? defaultMachinesFile : ""), ":");
 
     if (machinesFiles.empty()) {
-        parseMachines("localhost " +
+        machinesSources.lock()->files = "localhost " +
             (settings.thisSystem == "x86_64-linux" ? "x86_64-linux,i686-linux" : settings.thisSystem.get())
             + " - " + std::to_string(settings.maxBuildJobs) + " 1 "
-            + concatStringsSep(",", settings.systemFeatures.get()));
+            + concatStringsSep(",", settings.systemFeatures.get());
+        reloadMachines();
         machinesReadyLock.unlock();
         return;
     }
 
+#ifdef __linux__
+    /* Watch the directories containing the machines files, so that
+       we notice them being written, replaced or deleted right
+       away. We still poll as a fallback, e.g. when a machines file
+       is a symlink whose target changes. */
+    AutoCloseFD inotifyFD = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+    if (!inotifyFD)
+        printError("warning: cannot watch the machines files: %s", strerror(errno));
+    else
+        for (auto & machinesFile : machinesFiles)
+            if (inotify_add_watch(inotifyFD.get(), dirOf(machinesFile).c_str(),
+                    IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM | IN_CREATE | IN_DELETE | IN_ATTRIB) == -1)
+                printError("warning: cannot watch ‘%s’: %s", dirOf(machinesFile), strerror(errno));
+#endif
+
     std::vector<struct stat> fileStats;
     fileStats.resize(machinesFiles.size());
     for (unsigned int n = 0; n < machinesFiles.size(); ++n) {
         auto & st(fileStats[n]);
-        st.st_ino = st.st_mtime = 0;
+        st.st_ino = st.st_mtime = st.st_size = 0;
     }
 
     auto readMachinesFiles = [&]() {
@@ -226,10 +517,10 @@ void State::monitorMachinesFile()
             if (stat(machinesFile.c_str(), &st) != 0) {
                 if (errno != ENOENT)
                     throw SysError("getting stats about ‘%s’", machinesFile);
-                st.st_ino = st.st_mtime = 0;
+                st.st_ino = st.st_mtime = st.st_size = 0;
             }
             auto & old(fileStats[n]);
-            if (old.st_ino != st.st_ino || old.st_mtime != st.st_mtime)
+            if (old.st_ino != st.st_ino || old.st_mtime != st.st_mtime || old.st_size != st.st_size)
                 anyChanged = true;
             old = st;
         }
@@ -248,7 +539,31 @@ void State::monitorMachinesFile()
             }
         }
 
-        parseMachines(contents);
+        machinesSources.lock()->files = contents;
+        reloadMachines();
+    };
+
+    /* Wait until something happens in the directories of the
+       machines files, or until ‘timeout’ seconds have passed. */
+    auto wait = [&](int timeout) {
+#ifdef __linux__
+        if (inotifyFD) {
+            struct pollfd fd{.fd = inotifyFD.get(), .events = POLLIN};
+            if (poll(&fd, 1, timeout * 1000) == -1 && errno != EINTR)
+                throw SysError("waiting for changes to the machines files");
+
+            /* Drain the events; readMachinesFiles() checks which
+               files actually changed. The short delay coalesces the
+               events of a single update. */
+            if (fd.revents & POLLIN) {
+                usleep(100 * 1000);
+                char buf[4096];
+                while (read(inotifyFD.get(), buf, sizeof(buf)) > 0) ;
+            }
+            return;
+        }
+#endif
+        sleep(timeout);
     };
 
     auto firstParse = true;
@@ -260,8 +575,7 @@ void State::monitorMachinesFile()
                 machinesReadyLock.unlock();
                 firstParse = false;
             }
-            // FIXME: use inotify.
-            sleep(30);
+            wait(30);
         } catch (std::exception & e) {
             printMsg(lvlError, "reloading machines file: %s", e.what());
             sleep(5);
@@ -283,7 +597,7 @@ void State::clearBusy(Connection & conn, time_t stopTime)
 
 unsigned int State::allocBuildStep(pqxx::work & txn, BuildID buildId)
 {
-    auto res = txn.exec_params1("select max(stepnr) from BuildSteps where build = $1", buildId);
+    auto res = txn.exec_prepared1("alloc-build-step", buildId);
     return res[0].is_null() ? 1 : res[0].as<int>() + 1;
 }
 
@@ -291,18 +605,20 @@ unsigned int State::allocBuildStep(pqxx::work & txn, BuildID buildId)
 unsigned int State::createBuildStep(pqxx::work & txn, time_t startTime, BuildID buildId, Step::ptr step,
     const std::string & machine, BuildStatus status, const std::string & errorMsg, BuildID propagatedFrom)
 {
+    auto drv = getStepDerivation(*step);
+
  restart:
     auto stepNr = allocBuildStep(txn, buildId);
 
-    auto r = txn.exec_params
-        ("insert into BuildSteps (build, stepnr, type, drvPath, busy, startTime, system, status, propagatedFrom, errorMsg, stopTime, machine) values ($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11, $12) on conflict do nothing",
+    auto r = txn.exec_prepared
+        ("insert-build-step",
          buildId,
          stepNr,
          0, // == build
          localStore->printStorePath(step->drvPath),
          status == bsBusy ? 1 : 0,
          startTime != 0 ? std::make_optional(startTime) : std::nullopt,
-         step->drv->platform,
+         drv->platform,
          status != bsBusy ? std::make_optional((int) status) : std::nullopt,
          propagatedFrom != 0 ? std::make_optional(propagatedFrom) : std::nullopt, // internal::params
          errorMsg != "" ? std::make_optional(errorMsg) : std::nullopt,
@@ -311,10 +627,10 @@ unsigned int State::createBuildStep(pqxx::work & txn, time_t startTime, BuildID
 
     if (r.affected_rows() == 0) goto restart;
 
-    for (auto & [name, output] : step->drv->outputs)
-        txn.exec_params0
-            ("insert into BuildStepOutputs (build, stepnr, name, path) values ($1, $2, $3, $4)",
-            buildId, stepNr, name, localStore->printStorePath(*output.path(*localStore, step->drv->name, name)));
+    for (auto & [name, output] : drv->outputs)
+        txn.exec_prepared0
+            ("insert-build-step-output",
+            buildId, stepNr, name, localStore->printStorePath(*output.path(*localStore, drv->name, name)));
 
     if (status == bsBusy)
         txn.exec(fmt("notify step_started, '%d\t%d'", buildId, stepNr));
@@ -325,8 +641,8 @@ unsigned int State::createBuildStep(pqxx::work & txn, time_t startTime, BuildID
 
 void State::updateBuildStep(pqxx::work & txn, BuildID buildId, unsigned int stepNr, StepState stepState)
 {
-    if (txn.exec_params
-        ("update BuildSteps set busy = $1 where build = $2 and stepnr = $3 and busy != 0 and status is null",
+    if (txn.exec_prepared
+        ("update-build-step",
          (int) stepState,
          buildId,
          stepNr).affected_rows() != 1)
@@ -339,8 +655,8 @@ void State::finishBuildStep(pqxx::work & txn, const RemoteResult & result,
 {
     assert(result.startTime);
     assert(result.stopTime);
-    txn.exec_params0
-        ("update BuildSteps set busy = 0, status = $1, errorMsg = $4, startTime = $5, stopTime = $6, machine = $7, overhead = $8, timesBuilt = $9, isNonDeterministic = $10 where build = $2 and stepnr = $3",
+    txn.exec_prepared0
+        ("finish-build-step",
          (int) result.stepStatus, buildId, stepNr,
          result.errorMsg != "" ? std::make_optional(result.errorMsg) : std::nullopt,
          result.startTime, result.stopTime,
@@ -438,12 +754,69 @@ void visitDependencies(std::function<void(Step::ptr)> visitor, Step::ptr start)
 }
 
 
+std::vector<Step::ptr> updateCriticalPaths(const std::vector<Step::ptr> & roots)
+{
+    /* The weight of a step is its estimated duration plus the
+       highest weight of the steps that depend on it, i.e. roughly
+       how long it will take to finish everything waiting for
+       it. Visit each step once, in a topological order in which
+       each step comes after its dependents (the reverse of the
+       post-order of a depth-first walk of the dependencies). */
+    std::vector<Step::ptr> order;
+    {
+        std::set<Step::ptr> visited;
+        std::vector<std::pair<Step::ptr, std::vector<Step::ptr>>> stack;
+
+        auto push = [&](const Step::ptr & step) {
+            if (visited.insert(step).second)
+                stack.emplace_back(step, step->state.lock()->deps);
+        };
+
+        for (auto & root : roots) {
+            push(root);
+            while (!stack.empty()) {
+                auto & deps(stack.back().second);
+                if (deps.empty()) {
+                    order.push_back(std::move(stack.back().first));
+                    stack.pop_back();
+                } else {
+                    auto dep = std::move(deps.back());
+                    deps.pop_back();
+                    push(dep);
+                }
+            }
+        }
+    }
+
+    std::vector<Step::ptr> changed;
+
+    for (auto i = order.rbegin(); i != order.rend(); ++i) {
+        auto & step(*i);
+
+        auto rdeps = step->state.lock()->rdeps;
+        float above = 0;
+        for (auto & rdepWeak : rdeps)
+            if (auto rdep = rdepWeak.lock())
+                above = std::max(above, rdep->state.lock()->criticalPath);
+
+        auto weight = step->estimatedDuration + above;
+
+        auto step_(step->state.lock());
+        if (step_->criticalPath == weight) continue;
+        step_->criticalPath = weight;
+        changed.push_back(step);
+    }
+
+    return changed;
+}
+
+
 void State::markSucceededBuild(pqxx::work & txn, Build::ptr build,
     const BuildOutput & res, bool isCachedBuild, time_t startTime, time_t stopTime)
 {
     if (build->finishedInDB) return;
 
-    if (txn.exec_params("select 1 from Builds where id = $1 and finished = 0", build->id).empty()) return;
+    if (txn.exec_prepared("is-unfinished", build->id).empty()) return;
 
     txn.exec_params0
         ("update Builds set finished = 1, buildStatus = $2, startTime = $3, stopTime = $4, size = $5, closureSize = $6, releaseName = $7, isCachedBuild = $8, notificationPendingSince = $4 where id = $1",
@@ -492,14 +865,93 @@ void State::markSucceededBuild(pqxx::work & txn, Build::ptr build,
 }
 
 
+std::shared_ptr<Derivation> State::getDerivation(const StorePath & drvPath)
+{
+    if (auto drv = drvCache.lookup(drvPath)) {
+        prom.drv_cache_hits.Increment();
+        return drv;
+    }
+
+    prom.drv_cache_misses.Increment();
+
+    auto drv = std::make_shared<Derivation>(localStore->readDerivation(drvPath));
+
+    prom.drv_cache_evictions.Increment(drvCache.insert(drvPath, drv));
+    prom.drv_cache_size.Set(drvCache.size());
+
+    return drv;
+}
+
+
+std::shared_ptr<Derivation> State::getStepDerivation(const Step & step)
+{
+    if (step.drv) return step.drv;
+    return getDerivation(step.drvPath);
+}
+
+
 bool State::checkCachedFailure(Step::ptr step, Connection & conn)
 {
-    pqxx::work txn(conn);
-    for (auto & i : step->drv->outputsAndOptPaths(*localStore))
+    std::vector<std::string> paths;
+    for (auto & i : getStepDerivation(*step)->outputsAndOptPaths(*localStore))
         if (i.second.second)
-            if (!txn.exec_params("select 1 from FailedPaths where path = $1", localStore->printStorePath(*i.second.second)).empty())
-                return true;
-    return false;
+            paths.push_back(localStore->printStorePath(*i.second.second));
+    if (paths.empty()) return false;
+
+    nrFailedPathChecks++;
+
+    /* Only ask the database about paths that may have failed. */
+    {
+        auto failedPaths_(failedPaths.lock());
+        for (auto & path : paths)
+            if (failedPaths_->pending.count(path)) return true;
+        if (failedPaths_->filter) {
+            std::erase_if(paths, [&](const std::string & path) {
+                return !failedPaths_->filter->contains(path);
+            });
+            if (paths.empty()) return false;
+        }
+    }
+
+    nrFailedPathQueries++;
+    bool failed = false;
+    readFromReplica([&](Connection & conn) {
+        pqxx::work txn(conn);
+        failed = !txn.exec_prepared("failed-paths", paths).empty();
+    }, &conn);
+    return failed;
+}
+
+
+void State::addFailedPath(const std::string & path)
+{
+    auto failedPaths_(failedPaths.lock());
+
+    if (failedPaths_->added)
+        failedPaths_->added->push_back(path);
+
+    if (!failedPaths_->filter) return;
+
+    /* Inserting into a full filter would make it forget paths, so
+       fall back to the database until it has been reloaded. */
+    if (failedPaths_->filter->full()) {
+        failedPaths_->filter.reset();
+        failedPaths_->reload = true;
+        return;
+    }
+
+    failedPaths_->filter->insert(path);
+}
+
+
+void State::addPendingFailedPaths(const std::vector<std::string> & paths, bool add)
+{
+    auto failedPaths_(failedPaths.lock());
+    for (auto & path : paths)
+        if (add)
+            failedPaths_->pending.insert(path);
+        else
+            failedPaths_->pending.erase(failedPaths_->pending.find(path));
 }
 
 
@@ -520,6 +972,263 @@ void State::notifyBuildFinished(pqxx::work & txn, BuildID buildId,
 }
 
 
+static prometheus::ClientMetric metricValue(double value, std::vector<prometheus::ClientMetric::Label> labels = {})
+{
+    prometheus::ClientMetric metric;
+    metric.label = std::move(labels);
+    metric.counter.value = value;
+    metric.gauge.value = value;
+    return metric;
+}
+
+
+std::vector<prometheus::MetricFamily> State::StateCollector::Collect() const
+{
+    std::vector<prometheus::MetricFamily> families;
+
+    auto family = [](const std::string & name, const std::string & help, prometheus::MetricType type)
+    {
+        return prometheus::MetricFamily{.name = "hydraqueuerunner_" + name, .help = help, .type = type};
+    };
+
+    auto gauge = [&](const std::string & name, const std::string & help, double value) {
+        families.push_back(family(name, help, prometheus::MetricType::Gauge));
+        families.back().metric.push_back(metricValue(value));
+    };
+
+    auto counter = [&](const std::string & name, const std::string & help, double value) {
+        families.push_back(family(name, help, prometheus::MetricType::Counter));
+        families.back().metric.push_back(metricValue(value));
+    };
+
+    gauge("builds_queued", "Number of queued builds", state.builds.lock()->size());
+    gauge("steps_active", "Number of steps assigned to a machine", state.activeSteps_.lock()->size());
+    gauge("steps_building", "Number of steps being built", state.nrStepsBuilding);
+    gauge("steps_copying_to", "Number of steps copying their inputs to a machine", state.nrStepsCopyingTo);
+    gauge("steps_copying_from", "Number of steps copying their outputs from a machine", state.nrStepsCopyingFrom);
+    gauge("steps_waiting", "Number of steps waiting for a copy slot", state.nrStepsWaiting);
+    gauge("steps_unsupported", "Number of steps not supported by any machine", state.nrUnsupportedSteps);
+    gauge("steps_parked", "Number of steps waiting for their remote build to finish", state.parkedSteps.lock()->size());
+    gauge("steps_runnable", "Number of runnable steps", state.runnable.lock()->size());
+    gauge("db_connections", "Number of open database connections", state.dbPool.count());
+    gauge("db_updates_active", "Number of database updates in progress", state.nrActiveDbUpdates);
+    gauge("builder_threads_active", "Number of builder threads running a step", state.builderPool.active());
+    gauge("builder_tasks_queued", "Number of steps waiting for a builder thread", state.builderPool.queued());
+    gauge("log_uploads_active", "Number of build logs being uploaded to the binary cache", state.logUploadPool.active());
+    gauge("log_uploads_queued", "Number of build logs waiting to be uploaded to the binary cache", state.logUploadPool.queued());
+
+    counter("builds_read_total", "Number of builds read from the database", state.nrBuildsRead);
+    counter("builds_done_total", "Number of builds finished", state.nrBuildsDone);
+    counter("steps_started_total", "Number of steps started", state.nrStepsStarted);
+    counter("steps_done_total", "Number of steps finished", state.nrStepsDone);
+    counter("step_retries_total", "Number of step retries", state.nrRetries);
+    counter("step_time_seconds_total", "Total time spent on steps, including copying", state.totalStepTime);
+    counter("step_build_time_seconds_total", "Total time spent building steps", state.totalStepBuildTime);
+    counter("bytes_sent_total", "Bytes sent to build machines", state.bytesSent);
+    counter("bytes_received_total", "Bytes received from build machines", state.bytesReceived);
+    counter("queue_wakeups_total", "Number of times the queue monitor was woken up", state.nrQueueWakeups);
+    counter("dispatcher_wakeups_total", "Number of times the dispatcher was woken up", state.nrDispatcherWakeups);
+    counter("logs_uploaded_total", "Number of build logs uploaded to the binary cache", state.nrLogsUploaded);
+    counter("log_upload_retries_total", "Number of failed build log uploads that were retried", state.nrLogUploadRetries);
+    counter("log_upload_failures_total", "Number of build logs that could not be uploaded", state.nrLogUploadFailures);
+    counter("failed_path_checks_total", "Number of steps checked for a cached failure", state.nrFailedPathChecks);
+    counter("failed_path_queries_total", "Number of cached failure checks that had to query the database", state.nrFailedPathQueries);
+    counter("log_compressor_bytes_in_total", "Bytes of build logs compressed while they were written", state.logCompressor.bytesIn);
+    counter("log_compressor_bytes_out_total", "Bytes written by the build log compressor", state.logCompressor.bytesOut);
+    counter("closure_size_cache_hits_total", "Number of path and closure sizes found in the closure size cache", state.closureSizes.nrHits);
+    counter("closure_size_cache_misses_total", "Number of path infos queried from the store to compute closure sizes", state.closureSizes.nrMisses);
+    counter("nar_extractor_bytes_total", "Bytes of file contents read from NARs by the extractor", narExtractorStats.bytesRead);
+    counter("nar_extractor_hashed_bytes_total", "Bytes of file contents hashed by the extractor", narExtractorStats.bytesHashed);
+    counter("nar_extractor_hash_seconds_total", "Time spent hashing file contents in the extractor", narExtractorStats.hashTimeUs / 1e6);
+    counter("nar_extractor_rehashed_paths_total", "Number of build products hashed by reading their NAR again", narExtractorStats.nrRehashedPaths);
+
+    {
+        auto enabled = family("machine_enabled", "Whether the machine is enabled", prometheus::MetricType::Gauge);
+        auto currentJobs = family("machine_current_jobs", "Number of steps running on the machine", prometheus::MetricType::Gauge);
+        auto failures = family("machine_consecutive_failures", "Number of consecutive failures of the machine", prometheus::MetricType::Gauge);
+        auto stepsDone = family("machine_steps_done_total", "Number of steps finished on the machine", prometheus::MetricType::Counter);
+        auto stepTime = family("machine_step_time_seconds_total", "Total time spent on steps on the machine, including copying", prometheus::MetricType::Counter);
+        auto stepBuildTime = family("machine_step_build_time_seconds_total", "Total time spent building steps on the machine", prometheus::MetricType::Counter);
+        auto bytesSent = family("machine_bytes_sent_total", "Bytes sent to the machine", prometheus::MetricType::Counter);
+        auto bytesReceived = family("machine_bytes_received_total", "Bytes received from the machine", prometheus::MetricType::Counter);
+
+        auto machines_(state.machines.lock());
+        for (auto & i : *machines_) {
+            auto & m(i.second);
+            auto & s(m->state);
+            std::vector<prometheus::ClientMetric::Label> labels{{"machine", m->sshName}};
+            enabled.metric.push_back(metricValue(m->enabled, labels));
+            currentJobs.metric.push_back(metricValue(s->currentJobs, labels));
+            failures.metric.push_back(metricValue(s->connectInfo.lock()->consecutiveFailures, labels));
+            stepsDone.metric.push_back(metricValue(s->nrStepsDone, labels));
+            stepTime.metric.push_back(metricValue(s->totalStepTime, labels));
+            stepBuildTime.metric.push_back(metricValue(s->totalStepBuildTime, labels));
+            bytesSent.metric.push_back(metricValue(s->bytesSent, labels));
+            bytesReceived.metric.push_back(metricValue(s->bytesReceived, labels));
+        }
+
+        for (auto f : {&enabled, &currentJobs, &failures, &stepsDone, &stepTime, &stepBuildTime, &bytesSent, &bytesReceived})
+            families.push_back(std::move(*f));
+    }
+
+    {
+        auto runnable = family("system_steps_runnable", "Number of runnable steps, by system type", prometheus::MetricType::Gauge);
+        auto running = family("system_steps_running", "Number of running steps, by system type", prometheus::MetricType::Gauge);
+
+        auto machineTypes_(state.machineTypes.lock());
+        for (auto & i : *machineTypes_) {
+            std::vector<prometheus::ClientMetric::Label> labels{{"system", i.first}};
+            runnable.metric.push_back(metricValue(i.second.runnable, labels));
+            running.metric.push_back(metricValue(i.second.running, labels));
+        }
+
+        families.push_back(std::move(runnable));
+        families.push_back(std::move(running));
+    }
+
+    return families;
+}
+
+
+std::map<std::string, double> State::DemandCollector::platformStepTimes() const
+{
+    /* How long the step durations are used before they're read
+       again. */
+    const time_t maxAge = 600;
+
+    auto now = time(0);
+
+    {
+        auto stepTimes_(stepTimes.lock());
+        if (stepTimes_->fetched + maxAge > now) return stepTimes_->perPlatform;
+
+        /* Don't retry right away if the database is unavailable, and
+           let concurrent scrapes use the old durations in the
+           meantime. */
+        stepTimes_->fetched = now;
+    }
+
+    std::map<std::string, double> perPlatform;
+
+    try {
+        state.readFromReplica([&](Connection & conn) {
+            pqxx::work txn(conn);
+            auto res = txn.exec_params
+                ("select system, avg(stopTime - startTime) from BuildSteps "
+                 "where stopTime > $1 and startTime is not null and stopTime is not null "
+                 "and type = 0 and status = 0 and system is not null group by system",
+                 now - Jobset::schedulingWindow);
+            perPlatform.clear();
+            for (auto const & row : res)
+                perPlatform[row[0].as<std::string>()] = row[1].as<double>();
+        });
+    } catch (std::exception & e) {
+        printError("reading step durations: %s", e.what());
+        return stepTimes.lock()->perPlatform;
+    }
+
+    auto stepTimes_(stepTimes.lock());
+    std::swap(stepTimes_->perPlatform, perPlatform);
+    return stepTimes_->perPlatform;
+}
+
+
+std::vector<prometheus::MetricFamily> State::DemandCollector::Collect() const
+{
+    struct Demand
+    {
+        unsigned int runnable = 0, running = 0;
+        std::vector<double> waits;
+        double work = 0;
+    };
+
+    std::map<std::pair<std::string, std::set<std::string>>, Demand> demand;
+
+    auto perPlatform = platformStepTimes();
+
+    /* The expected duration of a step: the average of recent steps
+       of its jobsets, or failing that, of recent steps for the same
+       platform. */
+    auto expectedTime = [&](const Step & step, const std::vector<Jobset::ptr> & jobsets) {
+        double total = 0;
+        unsigned int n = 0;
+        for (auto & jobset : jobsets)
+            if (auto t = jobset->averageStepTime()) {
+                total += *t;
+                n++;
+            }
+        if (n) return total / n;
+        auto i = perPlatform.find(step.type->platform);
+        return i == perPlatform.end() ? 0.0 : i->second;
+    };
+
+    auto now = std::chrono::system_clock::now();
+
+    for (auto & step : state.runnable.lock()->steps()) {
+        system_time runnableSince;
+        std::vector<Jobset::ptr> jobsets;
+        {
+            auto step_(step->state.lock());
+            runnableSince = step_->runnableSince;
+            jobsets = step_->jobsets;
+        }
+        auto & d(demand[{step->type->platform, step->type->requiredSystemFeatures}]);
+        d.runnable++;
+        d.waits.push_back(std::chrono::duration<double>(now - runnableSince).count());
+        d.work += expectedTime(*step, jobsets);
+    }
+
+    std::vector<std::shared_ptr<ActiveStep>> activeSteps;
+    {
+        auto activeSteps_(state.activeSteps_.lock());
+        activeSteps.assign(activeSteps_->begin(), activeSteps_->end());
+    }
+
+    for (auto & activeStep : activeSteps) {
+        auto & step(activeStep->step);
+        auto jobsets = step->state.lock()->jobsets;
+        auto & d(demand[{step->type->platform, step->type->requiredSystemFeatures}]);
+        d.running++;
+        d.work += std::max(0.0, expectedTime(*step, jobsets)
+            - std::chrono::duration<double>(now - activeStep->startTime).count());
+    }
+
+    auto family = [](const std::string & name, const std::string & help)
+    {
+        return prometheus::MetricFamily{.name = "hydraqueuerunner_demand_" + name, .help = help, .type = prometheus::MetricType::Gauge};
+    };
+
+    auto runnable = family("runnable", "Number of runnable steps");
+    auto running = family("running", "Number of running steps");
+    auto waitTotal = family("wait_seconds_total", "Total time that the runnable steps have been waiting");
+    auto waitP95 = family("wait_seconds_p95", "95th percentile of the time that the runnable steps have been waiting");
+    auto work = family("work_seconds", "Expected machine time needed to finish the runnable and running steps");
+
+    for (auto & [type, d] : demand) {
+        std::vector<prometheus::ClientMetric::Label> labels{
+            {"system", type.first},
+            {"features", concatStringsSep(",", type.second)},
+        };
+
+        double total = 0, p95 = 0;
+        for (auto w : d.waits) total += w;
+        if (!d.waits.empty()) {
+            auto i = d.waits.begin() + (d.waits.size() - 1) * 95 / 100;
+            std::nth_element(d.waits.begin(), i, d.waits.end());
+            p95 = *i;
+        }
+
+        runnable.metric.push_back(metricValue(d.runnable, labels));
+        running.metric.push_back(metricValue(d.running, labels));
+        waitTotal.metric.push_back(metricValue(total, labels));
+        waitP95.metric.push_back(metricValue(p95, labels));
+        work.metric.push_back(metricValue(d.work, labels));
+    }
+
+    return {runnable, running, waitTotal, waitP95, work};
+}
+
+
 std::shared_ptr<PathLocks> State::acquireGlobalLock()
 {
     Path lockPath = hydraData + "/queue-runner/lock";
@@ -564,7 +1273,24 @@ void State::dumpStatus(Connection & conn)
         {"dispatchTimeMs", dispatchTimeMs.load()},
         {"dispatchTimeAvgMs", nrDispatcherWakeups == 0 ? 0.0 : (float) dispatchTimeMs / nrDispatcherWakeups},
         {"nrDbConnections", dbPool.count()},
+        {"nrReplicaDbConnections", replicaPool ? replicaPool->count() : 0},
+        {"replicaLag", replicaPool ? (double) replicaLag : 0.0},
         {"nrActiveDbUpdates", nrActiveDbUpdates.load()},
+        {"nrDbUpdatesQueued", nrDbUpdatesQueued.load()},
+        {"nrDbUpdatesFailed", nrDbUpdatesFailed.load()},
+        {"nrDbUpdatesInDoubt", nrDbUpdatesInDoubt.load()},
+        {"nrBuilderThreads", builderPool.size()},
+        {"nrBuilderThreadsActive", builderPool.active()},
+        {"nrBuilderTasksQueued", builderPool.queued()},
+        {"nrCopyThreadsActive", copyPool.active()},
+        {"nrStepsParked", parkedSteps.lock()->size()},
+        {"nrLogUploadsQueued", logUploadPool.queued()},
+        {"nrLogsUploaded", nrLogsUploaded.load()},
+        {"nrLogUploadFailures", nrLogUploadFailures.load()},
+        {"nrConnections", nrConnections.load()},
+        {"nrConnectionsReused", nrConnectionsReused.load()},
+        {"totalConnectTimeMs", totalConnectTimeMs.load()},
+        {"avgConnectTimeMs", nrConnections == 0 ? 0.0 : (float) totalConnectTimeMs / nrConnections},
     };
     {
         {
@@ -575,8 +1301,7 @@ void State::dumpStatus(Connection & conn)
         }
         {
             auto runnable_(runnable.lock());
-            for (auto i = runnable_->begin(); i != runnable_->end(); )
-                if (i->lock()) ++i; else i = runnable_->erase(i);
+            runnable_->prune();
             statusJson["nrRunnableSteps"] = runnable_->size();
         }
         if (nrStepsDone) {
@@ -603,6 +1328,15 @@ void State::dumpStatus(Connection & conn)
                     {"disabledUntil", std::chrono::system_clock::to_time_t(info->disabledUntil)},
                     {"lastFailure", std::chrono::system_clock::to_time_t(info->lastFailure)},
                     {"consecutiveFailures", info->consecutiveFailures},
+                    {"nrConnections", s->nrConnections.load()},
+                    {"nrConnectionsReused", s->nrConnectionsReused.load()},
+                    {"totalConnectTimeMs", s->totalConnectTimeMs.load()},
+                    {"bytesSent", s->bytesSent.load()},
+                    {"bytesReceived", s->bytesReceived.load()},
+                    {"totalCopyToTimeMs", s->totalCopyToTimeMs.load()},
+                    {"totalCopyFromTimeMs", s->totalCopyFromTimeMs.load()},
+                    {"bytesSentCompressed", s->bytesSentCompressed.load()},
+                    {"bytesReceivedCompressed", s->bytesReceivedCompressed.load()},
                 };
 
                 if (s->currentJobs == 0)
@@ -758,6 +1492,52 @@ void State::showStatus()
 }
 
 
+std::string State::traceFile() const
+{
+    return hydraData + "/queue-runner/trace.json";
+}
+
+
+void State::dumpTrace(Connection & conn)
+{
+    auto path = traceFile();
+    auto tmpPath = path + ".tmp";
+
+    createDirs(dirOf(path));
+
+    {
+        std::ofstream str(tmpPath);
+        tracer.writeChromeTrace(str);
+        if (!str) throw Error("writing ‘%s’", tmpPath);
+    }
+
+    if (rename(tmpPath.c_str(), path.c_str()) == -1)
+        throw SysError("renaming ‘%s’", tmpPath);
+
+    pqxx::work txn(conn);
+    txn.exec("notify trace_dumped");
+    txn.commit();
+}
+
+
+void State::showTrace()
+{
+    auto conn(dbPool.get());
+    receiver traceDumped(*conn, "trace_dumped");
+
+    {
+        pqxx::work txn(*conn);
+        txn.exec("notify dump_trace");
+        txn.commit();
+    }
+
+    if (conn->await_notification(5, 0) == 0)
+        throw Error("queue runner did not respond");
+
+    std::cout << readFile(traceFile());
+}
+
+
 void State::unlock()
 {
     auto lock = acquireGlobalLock();
@@ -795,13 +1575,17 @@ void State::run(BuildID buildOne)
     auto exposerPort = promExposer.GetListeningPorts().front();
 
     promExposer.RegisterCollectable(prom.registry);
+    stateCollector = std::make_shared<StateCollector>(*this);
+    promExposer.RegisterCollectable(stateCollector);
+    demandCollector = std::make_shared<DemandCollector>(*this);
+    promExposer.RegisterCollectable(demandCollector, "/demand");
 
     std::cout << "Started the Prometheus exporter, listening on "
         << metricsAddr << "/metrics (port " << exposerPort << ")"
         << std::endl;
 
     Store::Params localParams;
-    localParams["max-connections"] = "16";
+    localParams["max-connections"] = std::to_string(std::max(nrQueueThreads, (size_t) 16));
     localParams["max-connection-age"] = "600";
     localStore = openStore(getEnv("NIX_REMOTE").value_or(""), localParams);
 
@@ -823,6 +1607,29 @@ void State::run(BuildID buildOne)
         dumpStatus(*conn);
     }
 
+    stepWaiterFD = epoll_create1(EPOLL_CLOEXEC);
+    if (!stepWaiterFD) throw SysError("creating epoll instance");
+
+    for (auto & writer : dbWriters)
+        std::thread([this, &writer]() { dbWriter(*writer); }).detach();
+
+    builderPool.start(nrBuilderThreads);
+    queuePool.start(nrQueueThreads);
+
+    if (maxParallelCopyClosure > 1)
+        copyPool.start(nrCopyThreads);
+
+    if (replicaPool)
+        std::thread([&]() { replicaMonitor(); }).detach();
+
+    if (uploadLogsToBinaryCache)
+        logUploadPool.start(nrLogUploadThreads);
+
+    if (compressBuildLogs)
+        logCompressor.start(nrLogCompressorThreads);
+
+    std::thread(&State::stepWaiter, this).detach();
+
     machinesReadyLock.lock();
     std::thread(&State::monitorMachinesFile, this).detach();
 
@@ -883,9 +1690,16 @@ void State::run(BuildID buildOne)
         try {
             auto conn(dbPool.get());
             receiver dumpStatus_(*conn, "dump_status");
+            receiver dumpTrace_(*conn, "dump_trace");
+            receiver machinesUpdate_(*conn, "machines_update");
             while (true) {
                 conn->await_notification();
-                dumpStatus(*conn);
+                if (auto payloads = machinesUpdate_.getAll(); !payloads.empty())
+                    updateMachines(payloads);
+                if (dumpStatus_.get())
+                    dumpStatus(*conn);
+                if (dumpTrace_.get())
+                    dumpTrace(*conn);
             }
         } catch (std::exception & e) {
             printMsg(lvlError, "main thread: %s", e.what());
@@ -895,6 +1709,10 @@ void State::run(BuildID buildOne)
 }
 
 
+/* The benchmark (queue-runner-bench.cc) is built from the same
+   sources, with its own main(). */
+#ifndef HYDRA_QUEUE_RUNNER_BENCH
+
 int main(int argc, char * * argv)
 {
     return handleExceptions(argv[0], [&]() {
@@ -909,6 +1727,7 @@ int main(int argc, char * * argv)
 
         bool unlock = false;
         bool status = false;
+        bool trace = false;
         BuildID buildOne = 0;
         std::optional<std::string> metricsAddrOpt = std::nullopt;
 
@@ -917,6 +1736,8 @@ int main(int argc, char * * argv)
                 unlock = true;
             else if (*arg == "--status")
                 status = true;
+            else if (*arg == "--trace")
+                trace = true;
             else if (*arg == "--build-one") {
                 if (auto b = string2Int<BuildID>(getArg(*arg, arg, end)))
                     buildOne = *b;
@@ -934,9 +1755,13 @@ int main(int argc, char * * argv)
         State state{metricsAddrOpt};
         if (status)
             state.showStatus();
+        else if (trace)
+            state.showTrace();
         else if (unlock)
             state.unlock();
         else
             state.run(buildOne);
     });
 }
+
+#endif
@@ -0,0 +1,223 @@
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+
+#include "log-compressor.hh"
+#include "compression.hh"
+
+using namespace nix;
+
+
+/* How much of the end of a log to keep in memory. */
+static const size_t maxTailSize = 8192;
+
+
+LogCompressor::LogCompressor(size_t maxFrameSize, std::chrono::seconds maxFrameIdle)
+    : maxFrameSize(std::max(maxFrameSize, (size_t) 1))
+    , maxFrameIdle(maxFrameIdle)
+{
+}
+
+
+void LogCompressor::start(size_t nrThreads)
+{
+    assert(threads.empty());
+
+    for (size_t n = 0; n < std::max(nrThreads, (size_t) 1); ++n) {
+        auto thread = std::make_unique<Thread>();
+        thread->wakeupPipe.create();
+        if (fcntl(thread->wakeupPipe.readSide.get(), F_SETFL, O_NONBLOCK) == -1
+            || fcntl(thread->wakeupPipe.writeSide.get(), F_SETFL, O_NONBLOCK) == -1)
+            throw SysError("making the log compressor's pipe non-blocking");
+        threads.push_back(std::move(thread));
+    }
+
+    for (auto & thread : threads)
+        std::thread([this, thread(thread.get())]() { run(*thread); }).detach();
+}
+
+
+std::shared_ptr<LogCompressor::Log> LogCompressor::create(const Path & path, AutoCloseFD & writeSide)
+{
+    auto log = std::make_shared<Log>();
+    log->path = path;
+    log->maxFrameSize = maxFrameSize;
+
+    log->fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY | O_CLOEXEC, 0666);
+    if (!log->fd) throw SysError("creating log file ‘%s’", path);
+    log->fileSink = std::make_unique<FdSink>(log->fd.get());
+
+    Pipe pipe;
+    pipe.create();
+    if (fcntl(pipe.readSide.get(), F_SETFL, O_NONBLOCK) == -1)
+        throw SysError("making the pipe of log ‘%s’ non-blocking", path);
+    log->readSide = std::move(pipe.readSide);
+    writeSide = std::move(pipe.writeSide);
+
+    assert(!threads.empty());
+    auto & thread(*threads[nextThread++ % threads.size()]);
+
+    thread.logs_.lock()->insert(log);
+
+    if (::write(thread.wakeupPipe.writeSide.get(), "x", 1) == -1 && errno != EAGAIN)
+        throw SysError("waking up the log compressor");
+
+    return log;
+}
+
+
+void LogCompressor::whenDone(Log & log, std::function<void()> callback)
+{
+    {
+        std::lock_guard<std::mutex> lock(log.mutex);
+        if (!log.done) {
+            log.onDone = std::move(callback);
+            return;
+        }
+    }
+    callback();
+}
+
+
+void LogCompressor::Log::write(std::string_view data)
+{
+    if (!stream) stream = makeCompressionSink("bzip2", *fileSink).get_ptr();
+    (*stream)(data);
+    frameSize += data.size();
+    bytesIn += data.size();
+    lastWrite = std::chrono::steady_clock::now();
+
+    tail_.append(data);
+    if (tail_.size() > 2 * maxTailSize)
+        tail_.erase(0, tail_.size() - maxTailSize);
+
+    if (frameSize >= maxFrameSize) endFrame();
+}
+
+
+void LogCompressor::Log::endFrame()
+{
+    if (!stream) return;
+    stream->finish();
+    stream.reset();
+    fileSink->flush();
+    frameSize = 0;
+}
+
+
+bool LogCompressor::Log::drain(bool discard)
+{
+    /* This can't starve the other logs, since the writers can't get
+       ahead of us by more than the size of the pipe buffer. */
+    char buf[65536];
+    while (true) {
+        auto n = read(readSide.get(), buf, sizeof(buf));
+        if (n == 0) return false;
+        if (n == -1) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return true;
+            throw SysError("reading log ‘%s’", path);
+        }
+        if (!discard) write({buf, (size_t) n});
+    }
+}
+
+
+void LogCompressor::Log::truncate()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (done) return;
+
+    drain(true);
+
+    stream.reset();
+    fileSink.reset();
+    if (lseek(fd.get(), 0, SEEK_SET) != 0)
+        throw SysError("seeking to the start of log file ‘%s’", path);
+    if (ftruncate(fd.get(), 0) == -1)
+        throw SysError("truncating log file ‘%s’", path);
+    fileSink = std::make_unique<FdSink>(fd.get());
+
+    frameSize = 0;
+    bytesIn = 0;
+    tail_.clear();
+}
+
+
+std::string LogCompressor::Log::tail()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!done) drain(!fileSink);
+    return tail_.size() > maxTailSize ? tail_.substr(tail_.size() - maxTailSize) : tail_;
+}
+
+
+void LogCompressor::run(Thread & thread)
+{
+    while (true) {
+        try {
+            std::vector<std::shared_ptr<Log>> logs;
+            for (auto & log : *thread.logs_.lock())
+                logs.push_back(log);
+
+            std::vector<struct pollfd> fds(logs.size() + 1);
+            fds[0] = {.fd = thread.wakeupPipe.readSide.get(), .events = POLLIN, .revents = 0};
+            for (size_t n = 0; n < logs.size(); ++n)
+                fds[n + 1] = {.fd = logs[n]->readSide.get(), .events = POLLIN, .revents = 0};
+
+            if (poll(fds.data(), fds.size(), 1000) == -1) {
+                if (errno == EINTR) continue;
+                throw SysError("polling build logs");
+            }
+
+            if (fds[0].revents) {
+                char buf[1024];
+                while (read(thread.wakeupPipe.readSide.get(), buf, sizeof(buf)) > 0) ;
+            }
+
+            auto now = std::chrono::steady_clock::now();
+
+            for (size_t n = 0; n < logs.size(); ++n) {
+                auto & log(*logs[n]);
+                std::unique_lock<std::mutex> lock(log.mutex);
+
+                bool eof = false;
+                try {
+                    /* After a write error, keep reading the pipe so
+                       that the build isn't killed by SIGPIPE. */
+                    if (fds[n + 1].revents)
+                        eof = !log.drain(!log.fileSink);
+                    if (log.fileSink && (eof || now - log.lastWrite >= maxFrameIdle))
+                        log.endFrame();
+                } catch (std::exception & e) {
+                    printError("error writing build log ‘%s’: %s", log.path, e.what());
+                    log.stream.reset();
+                    log.fileSink.reset();
+                }
+
+                if (!eof) continue;
+
+                if (log.fileSink) {
+                    bytesOut += log.fileSink->written;
+                    log.fileSink.reset();
+                }
+                bytesIn += log.bytesIn;
+                log.fd = -1;
+                log.readSide = -1;
+                log.done = true;
+                auto onDone = std::move(log.onDone);
+                lock.unlock();
+
+                thread.logs_.lock()->erase(logs[n]);
+
+                if (onDone) onDone();
+            }
+
+        } catch (std::exception & e) {
+            printError("log compressor: %s", e.what());
+            sleep(1);
+        }
+    }
+}
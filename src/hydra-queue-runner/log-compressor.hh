@@ -0,0 +1,119 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <set>
+#include <string>
+#include <vector>
+
+#include "serialise.hh"
+#include "sync.hh"
+#include "util.hh"
+
+namespace nix { struct CompressionSink; }
+
+
+/* Writes the logs of build steps compressed with bzip2. The processes
+   talking to a build machine get the write side of a pipe as their
+   stderr, and a small pool of threads reads those pipes and
+   compresses what it reads. Each log is handled by one thread. A log
+   is finished once every process holding its write side has exited,
+   regardless of what happened to the step.
+
+   The log is written as a sequence of bzip2 streams: the current
+   stream is ended whenever it has grown by ‘maxFrameSize’ bytes, or
+   the log has been quiet for ‘maxFrameIdle’. ‘bzip2 -dc’ decompresses
+   such a file as a whole, and it can also show the log of a running
+   build up to the last complete stream. */
+class LogCompressor
+{
+public:
+
+    class Log
+    {
+        friend class LogCompressor;
+
+        std::mutex mutex;
+
+        nix::Path path;
+
+        nix::AutoCloseFD readSide, fd;
+
+        std::unique_ptr<nix::FdSink> fileSink;
+
+        /* The current bzip2 stream, if any, and the number of bytes
+           written to it. */
+        std::shared_ptr<nix::CompressionSink> stream;
+        size_t frameSize = 0, maxFrameSize;
+        std::chrono::steady_clock::time_point lastWrite;
+
+        uint64_t bytesIn = 0;
+
+        /* The end of the log, for error messages. */
+        std::string tail_;
+
+        bool done = false;
+
+        /* Called once the log is finished. */
+        std::function<void()> onDone;
+
+        /* Read whatever is available from the pipe. Returns false at
+           end of file. */
+        bool drain(bool discard = false);
+
+        void write(std::string_view data);
+
+        void endFrame();
+
+    public:
+
+        const nix::Path & getPath() const { return path; }
+
+        /* Discard everything logged so far. */
+        void truncate();
+
+        /* Return the last few kilobytes of the log. */
+        std::string tail();
+    };
+
+    LogCompressor(size_t maxFrameSize = 4 << 20,
+        std::chrono::seconds maxFrameIdle = std::chrono::seconds(30));
+
+    /* Start ‘nrThreads’ threads that read the logs. */
+    void start(size_t nrThreads);
+
+    /* Create a log that is written to ‘path’. ‘writeSide’ is set to
+       the write side of its pipe, which is close-on-exec, so it must
+       be dup'ed to the stderr of child processes. */
+    std::shared_ptr<Log> create(const nix::Path & path, nix::AutoCloseFD & writeSide);
+
+    /* Call ‘callback’ once ‘log’ has been completely written, or
+       right away if it already has. It's called from a compressor
+       thread, so it must not block. */
+    void whenDone(Log & log, std::function<void()> callback);
+
+    /* The number of bytes read and written for finished logs. */
+    std::atomic<uint64_t> bytesIn{0}, bytesOut{0};
+
+private:
+
+    const size_t maxFrameSize;
+    const std::chrono::seconds maxFrameIdle;
+
+    struct Thread
+    {
+        nix::Sync<std::set<std::shared_ptr<Log>>> logs_;
+
+        /* Written to when a log is added, to interrupt poll(). */
+        nix::Pipe wakeupPipe;
+    };
+
+    std::vector<std::unique_ptr<Thread>> threads;
+
+    std::atomic<size_t> nextThread{0};
+
+    void run(Thread & thread);
+};
@@ -0,0 +1,82 @@
+#include "state.hh"
+
+using namespace nix;
+
+
+bool parseMachines(const std::string & contents,
+    const std::map<std::string, Machine::ptr> & oldMachines,
+    std::map<std::string, Machine::ptr> & newMachines)
+{
+    std::map<std::string, Machine::ptr> parsedMachines;
+    bool changed = false;
+
+    /* If a machine is defined more than once (e.g. in a machines
+       file and by a notification), the last definition wins. */
+    for (auto line : tokenizeString<Strings>(contents, "\n")) {
+        line = trim(std::string(line, 0, line.find('#')));
+        auto tokens = tokenizeString<std::vector<std::string>>(line);
+        if (tokens.size() < 3) continue;
+        tokens.resize(8);
+
+        auto machine = std::make_shared<Machine>();
+        machine->sshName = tokens[0];
+        machine->systemTypes = tokenizeString<StringSet>(tokens[1], ",");
+        machine->sshKey = tokens[2] == "-" ? std::string("") : tokens[2];
+        if (tokens[3] != "")
+            machine->maxJobs = string2Int<decltype(machine->maxJobs)>(tokens[3]).value();
+        else
+            machine->maxJobs = 1;
+        machine->speedFactor = atof(tokens[4].c_str());
+        if (tokens[5] == "-") tokens[5] = "";
+        machine->supportedFeatures = tokenizeString<StringSet>(tokens[5], ",");
+        if (tokens[6] == "-") tokens[6] = "";
+        machine->mandatoryFeatures = tokenizeString<StringSet>(tokens[6], ",");
+        for (auto & f : machine->mandatoryFeatures)
+            machine->supportedFeatures.insert(f);
+        if (tokens[7] != "" && tokens[7] != "-")
+            machine->sshPublicHostKey = base64Decode(tokens[7]);
+
+        parsedMachines.insert_or_assign(machine->sshName, machine);
+    }
+
+    for (auto & [name, parsed] : parsedMachines) {
+        auto machine = parsed;
+
+        /* Keep the previous Machine object if the machine didn't
+           change. Otherwise, re-use the State object of the previous
+           machine with the same name. */
+        auto i = oldMachines.find(machine->sshName);
+        if (i == oldMachines.end()) {
+            printMsg(lvlChatty, "adding new machine ‘%1%’", machine->sshName);
+            machine->state = std::make_shared<Machine::State>();
+            changed = true;
+        } else if (i->second->sameConfig(*machine))
+            machine = i->second;
+        else {
+            printMsg(lvlChatty, "updating machine ‘%1%’", machine->sshName);
+            machine->state = i->second->state;
+            /* The SSH master was started with the old settings
+               (e.g. the key). Builds using it keep their reference. */
+            *machine->state->sshMaster.lock() = nullptr;
+            changed = true;
+        }
+        newMachines[machine->sshName] = machine;
+    }
+
+    for (auto & m : oldMachines)
+        if (newMachines.find(m.first) == newMachines.end()) {
+            if (!m.second->enabled) {
+                newMachines[m.first] = m.second;
+                continue;
+            }
+            printInfo("removing machine ‘%1%’", m.first);
+            /* Add a disabled Machine object to make sure stats are
+               maintained. */
+            auto machine = std::make_shared<Machine>(*(m.second));
+            machine->enabled = false;
+            newMachines[m.first] = machine;
+            changed = true;
+        }
+
+    return changed;
+}
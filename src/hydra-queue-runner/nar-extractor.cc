@@ -1,11 +1,15 @@
 #include "nar-extractor.hh"
+#include "hydra-build-result.hh"
 
 #include "archive.hh"
 
+#include <chrono>
 #include <unordered_set>
 
 using namespace nix;
 
+NarExtractorStats narExtractorStats;
+
 struct Extractor : ParseSink
 {
     std::unordered_set<Path> filesToKeep {
@@ -18,18 +22,45 @@ struct Extractor : ParseSink
     NarMemberData * curMember = nullptr;
     Path prefix;
 
-    Extractor(NarMemberDatas & members, const Path & prefix)
+    /* If not set, hash every regular file. Otherwise, only hash the
+       files in ‘toHash’. If ‘learnProducts’ is set, hash every
+       regular file until we know the build products, and then add
+       them to ‘toHash’. We know them once we've read their
+       declaration, or have gone past ‘nix-support’ without seeing
+       one. */
+    bool hashAll;
+    bool learnProducts;
+    bool productsKnown = false;
+    std::set<Path> toHash;
+
+    Extractor(NarMemberDatas & members, const Path & prefix,
+        bool hashAll, bool learnProducts, std::set<Path> toHash = {})
         : members(members), prefix(prefix)
+        , hashAll(hashAll), learnProducts(learnProducts), toHash(std::move(toHash))
     { }
 
+    /* NAR entries come in sorted order, so once we see a path after
+       ‘nix-support’ and its contents, there is no declaration of
+       build products to come. */
+    void checkPastNixSupport(const Path & path)
+    {
+        if (!productsKnown && path > "/nix-support" && !hasPrefix(path, "/nix-support/"))
+            productsKnown = true;
+    }
+
     void createDirectory(const Path & path) override
     {
+        checkPastNixSupport(path);
         members.insert_or_assign(prefix + path, NarMemberData { .type = FSAccessor::Type::tDirectory });
     }
 
+    Path curPath;
+
     void createRegularFile(const Path & path) override
     {
-        curMember = &members.insert_or_assign(prefix + path, NarMemberData {
+        checkPastNixSupport(path);
+        curPath = prefix + path;
+        curMember = &members.insert_or_assign(curPath, NarMemberData {
             .type = FSAccessor::Type::tRegular,
             .fileSize = 0,
             .contents = filesToKeep.count(path) ? std::optional("") : std::nullopt,
@@ -42,41 +73,97 @@ struct Extractor : ParseSink
     void preallocateContents(uint64_t size) override
     {
         expectedSize = size;
-        hashSink = std::make_unique<HashSink>(htSHA256);
+        hashSink.reset();
+        if (hashAll || (learnProducts && !productsKnown) || toHash.count(curPath)) {
+            /* Empty files don't get any receiveContents() calls. */
+            if (size == 0)
+                curMember->sha256 = hashString(htSHA256, "");
+            else
+                hashSink = std::make_unique<HashSink>(htSHA256);
+        }
     }
 
     void receiveContents(std::string_view data) override
     {
         assert(expectedSize);
         assert(curMember);
-        assert(hashSink);
         *curMember->fileSize += data.size();
-        (*hashSink)(data);
+        narExtractorStats.bytesRead += data.size();
+        if (hashSink) {
+            auto before = std::chrono::steady_clock::now();
+            (*hashSink)(data);
+            narExtractorStats.hashTimeUs += std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - before).count();
+            narExtractorStats.bytesHashed += data.size();
+        }
         if (curMember->contents) {
             curMember->contents->append(data);
         }
         assert(curMember->fileSize <= expectedSize);
         if (curMember->fileSize == expectedSize) {
-            auto [hash, len] = hashSink->finish();
-            assert(curMember->fileSize == len);
-            curMember->sha256 = hash;
-            hashSink.reset();
+            if (hashSink) {
+                auto [hash, len] = hashSink->finish();
+                assert(curMember->fileSize == len);
+                curMember->sha256 = hash;
+                hashSink.reset();
+            }
+            if (learnProducts && curPath == prefix + "/nix-support/hydra-build-products") {
+                addProducts(*curMember->contents);
+                productsKnown = true;
+            }
         }
     }
 
     void createSymlink(const Path & path, const std::string & target) override
     {
+        checkPastNixSupport(path);
         members.insert_or_assign(prefix + path, NarMemberData { .type = FSAccessor::Type::tSymlink });
     }
+
+    /* Add the paths of the build products declared in ‘contents’ to
+       ‘toHash’. */
+    void addProducts(const std::string & contents)
+    {
+        for (auto & line : tokenizeString<Strings>(contents, "\n"))
+            if (auto product = parseBuildProduct(line))
+                toHash.insert(product->path);
+    }
 };
 
 
 void extractNarData(
     Source & source,
     const Path & prefix,
-    NarMemberDatas & members)
+    NarMemberDatas & members,
+    bool lazyHashing)
 {
-    Extractor extractor(members, prefix);
+    Extractor extractor(members, prefix, !lazyHashing, lazyHashing);
     parseDump(extractor, source);
     // Note: this point may not be reached if we're in a coroutine.
 }
+
+
+void hashNarMembers(
+    Store & store,
+    const StorePath & storePath,
+    const std::set<Path> & paths,
+    NarMemberDatas & members)
+{
+    auto prefix = store.printStorePath(storePath);
+
+    NarMemberDatas members2;
+    Extractor extractor(members2, prefix, false, false, paths);
+
+    auto source = sinkToSource([&](Sink & sink) {
+        store.narFromPath(storePath, sink);
+    });
+    parseDump(extractor, *source);
+
+    for (auto & path : paths) {
+        auto i = members2.find(path);
+        if (i == members2.end() || !i->second.sha256)
+            throw Error("cannot hash ‘%s’", path);
+        members.insert_or_assign(path, i->second);
+        narExtractorStats.nrRehashedPaths++;
+    }
+}
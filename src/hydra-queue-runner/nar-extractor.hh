@@ -1,9 +1,13 @@
 #pragma once
 
+#include <atomic>
+#include <set>
+
 #include "fs-accessor.hh"
 #include "types.hh"
 #include "serialise.hh"
 #include "hash.hh"
+#include "store-api.hh"
 
 struct NarMemberData
 {
@@ -16,8 +20,32 @@ struct NarMemberData
 typedef std::map<nix::Path, NarMemberData> NarMemberDatas;
 
 /* Read a NAR from a source and get to some info about every file
-   inside the NAR. */
+   inside the NAR. If ‘lazyHashing’ is set, files that come after
+   ‘nix-support’ in the NAR only get a hash if they are declared as
+   build products in ‘nix-support/hydra-build-products’. Files before
+   it are always hashed, since we can't know yet whether they are
+   products. Use hashNarMembers() for any products missed. */
 void extractNarData(
     nix::Source & source,
     const nix::Path & prefix,
+    NarMemberDatas & members,
+    bool lazyHashing = false);
+
+/* Compute the hashes of the regular files ‘paths’ inside the store
+   path ‘storePath’ by reading its NAR from ‘store’. */
+void hashNarMembers(
+    nix::Store & store,
+    const nix::StorePath & storePath,
+    const std::set<nix::Path> & paths,
     NarMemberDatas & members);
+
+/* Statistics on the NARs processed by the above, for the metrics. */
+struct NarExtractorStats
+{
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> bytesHashed{0};
+    std::atomic<uint64_t> hashTimeUs{0};
+    std::atomic<uint64_t> nrRehashedPaths{0};
+};
+
+extern NarExtractorStats narExtractorStats;
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <functional>
+#include <string_view>
+#include <vector>
+
+
+/* A Bloom filter of store paths that forgets old entries: it keeps
+   two generations, and once the current one holds ‘capacity’ paths,
+   it becomes the previous one and the oldest generation is dropped.
+   Lookups can return false positives but no false negatives for
+   paths inserted in the last ‘capacity’ insertions, so a filter that
+   isn't full() has no false negatives at all. */
+class PathFilter
+{
+public:
+
+    PathFilter(size_t capacity = 1 << 16, size_t bitsPerPath = 8)
+        : capacity(capacity)
+        , nrWords(std::max(capacity * bitsPerPath / 64, (size_t) 1))
+    { }
+
+    /* The hash of a path. Callers that look up the same paths often
+       can compute this once. */
+    static uint64_t hash(std::string_view path)
+    {
+        return std::hash<std::string_view>()(path);
+    }
+
+    void insert(std::string_view path)
+    {
+        insert(hash(path));
+    }
+
+    void insert(uint64_t h)
+    {
+        if (current.empty()) current.resize(nrWords, 0);
+        if (inserted >= capacity) {
+            std::swap(current, previous);
+            current.assign(nrWords, 0);
+            inserted = 0;
+        }
+        forEachBit(h, [&](size_t bit) {
+            current[bit / 64] |= (uint64_t) 1 << (bit % 64);
+        });
+        inserted++;
+    }
+
+    bool contains(std::string_view path) const
+    {
+        return contains(hash(path));
+    }
+
+    bool contains(uint64_t h) const
+    {
+        auto test = [&](const std::vector<uint64_t> & words) {
+            if (words.empty()) return false;
+            bool found = true;
+            forEachBit(h, [&](size_t bit) {
+                if (!(words[bit / 64] & ((uint64_t) 1 << (bit % 64)))) found = false;
+            });
+            return found;
+        };
+        return test(current) || test(previous);
+    }
+
+    /* Whether the next insertion will drop older paths. */
+    bool full() const
+    {
+        return inserted >= capacity;
+    }
+
+private:
+
+    static const size_t nrHashes = 4;
+
+    const size_t capacity, nrWords;
+    size_t inserted = 0;
+    std::vector<uint64_t> current, previous;
+
+    /* Derive the bit positions of a path from its hash by double
+       hashing. */
+    template<typename F>
+    void forEachBit(uint64_t h, F f) const
+    {
+        uint64_t h1 = h & 0xffffffff, h2 = (h >> 32) | 1;
+        for (size_t i = 0; i < nrHashes; ++i)
+            f((h1 + i * h2) % (nrWords * 64));
+    }
+};
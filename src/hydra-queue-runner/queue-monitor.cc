@@ -1,9 +1,13 @@
 #include "state.hh"
 #include "hydra-build-result.hh"
 #include "globals.hh"
+#include "names.hh"
 
+#include <algorithm>
 #include <cstring>
 
+#include <nlohmann/json.hpp>
+
 using namespace nix;
 
 
@@ -30,11 +34,28 @@ void State::queueMonitorLoop()
     receiver buildsDeleted(*conn, "builds_deleted");
     receiver buildsBumped(*conn, "builds_bumped");
     receiver jobsetSharesChanged(*conn, "jobset_shares_changed");
+    receiver failedPathsDeleted(*conn, "failed_paths_deleted");
 
     auto destStore = getDestStore();
 
+    if (durationAwareScheduling) {
+        try {
+            loadStepDurations(*conn);
+        } catch (std::exception & e) {
+            printError("loading step durations: %s", e.what());
+        }
+    }
+
+    /* Load the failed paths after we started listening, so that we
+       don't miss deletions. */
+    loadFailedPaths(*conn);
+
     unsigned int lastBuildId = 0;
 
+    /* Do a full check for cancellations and bumps first, since we may
+       have missed notifications while we weren't listening. */
+    time_t lastResync = 0;
+
     bool quit = false;
     while (!quit) {
         localStore->clearPathInfoCache();
@@ -46,29 +67,63 @@ void State::queueMonitorLoop()
         /* Sleep until we get notification from the database about an
            event. */
         if (done && !quit) {
-            conn->await_notification();
+            conn->await_notification(queueResyncInterval, 0);
             nrQueueWakeups++;
         } else
             conn->get_notifs();
 
-        if (auto lowestId = buildsAdded.get()) {
-            lastBuildId = std::min(lastBuildId, static_cast<unsigned>(std::stoul(*lowestId) - 1));
+        for (auto & lowestId : buildsAdded.getAll()) {
+            lastBuildId = std::min(lastBuildId, static_cast<unsigned>(std::stoul(lowestId) - 1));
             printMsg(lvlTalkative, "got notification: new builds added to the queue");
         }
         if (buildsRestarted.get()) {
             printMsg(lvlTalkative, "got notification: builds restarted");
             lastBuildId = 0; // check all builds
         }
-        if (buildsCancelled.get() || buildsDeleted.get() || buildsBumped.get()) {
-            printMsg(lvlTalkative, "got notification: builds cancelled or bumped");
+        if (rescanQueue.exchange(false)) {
+            printMsg(lvlTalkative, "reloading builds that could not be marked as finished");
+            lastBuildId = 0;
+        }
+
+        /* Notifications about cancelled, deleted or bumped builds
+           list the IDs of those builds, so we only need to look at
+           them. An empty payload means that there were too many. */
+        std::set<BuildID> changedIds;
+        bool fullResync = time(0) >= lastResync + queueResyncInterval;
+        for (auto r : {&buildsCancelled, &buildsDeleted, &buildsBumped})
+            for (auto & payload : r->getAll()) {
+                if (payload.empty()) fullResync = true;
+                for (auto & s : tokenizeString<Strings>(payload, ",")) {
+                    if (auto id = string2Int<BuildID>(s))
+                        changedIds.insert(*id);
+                    else
+                        fullResync = true;
+                }
+            }
+
+        if (fullResync) {
+            printMsg(lvlTalkative, "checking all builds for cancellations or bumps");
             processQueueChange(*conn);
+            prom.queue_changes_full.Increment();
+            lastResync = time(0);
+        } else if (!changedIds.empty()) {
+            printMsg(lvlTalkative, "got notification: %d builds cancelled or bumped", changedIds.size());
+            processQueueChange(*conn, changedIds);
+            prom.queue_changes_incremental.Increment();
         }
         if (jobsetSharesChanged.get()) {
             printMsg(lvlTalkative, "got notification: jobset shares changed");
             processJobsetSharesChange(*conn);
         }
+        if (failedPathsDeleted.get() || failedPaths.lock()->reload) {
+            printMsg(lvlTalkative, "got notification: failed paths deleted");
+            loadFailedPaths(*conn);
+        }
+
+        refreshCriticalPaths();
     }
 
+    flushDbUpdates();
     exit(0);
 }
 
@@ -138,7 +193,57 @@ bool State::getQueuedBuilds(Connection & conn,
     std::set<Step::ptr> newRunnable;
     unsigned int nrAdded;
     std::function<void(Build::ptr)> createBuild;
-    std::set<StorePath> finishedDrvs;
+    Sync<std::set<StorePath>> finishedDrvs;
+
+    /* Builds that are finished right away (e.g. because all their
+       outputs are already valid) are marked as such in the database
+       in batches, to save round trips when an evaluation adds lots
+       of cached builds. Such builds are not referenced by any step,
+       so it doesn't matter that they're finished in the database a
+       bit later. */
+    std::vector<std::function<void(pqxx::work &)>> pendingUpdates;
+
+    auto flushUpdates = [&]() {
+        if (pendingUpdates.empty()) return;
+        auto mc = startDbUpdate();
+        pqxx::work txn(conn);
+        for (auto & update : pendingUpdates)
+            update(txn);
+        txn.commit();
+        pendingUpdates.clear();
+    };
+
+    auto queueUpdate = [&](std::function<void(pqxx::work &)> && update) {
+        pendingUpdates.push_back(std::move(update));
+        if (pendingUpdates.size() >= 256) flushUpdates();
+    };
+
+    /* Builds whose outputs are all valid. The builds that previously
+       produced those outputs are looked up with one query per batch,
+       and only then are they marked as succeeded. */
+    std::vector<std::pair<Build::ptr, std::shared_ptr<Derivation>>> cachedBuilds;
+
+    auto finishCachedBuilds = [&]() {
+        if (cachedBuilds.empty()) return;
+
+        std::vector<std::shared_ptr<Derivation>> drvs;
+        for (auto & [build, drv] : cachedBuilds)
+            drvs.push_back(drv);
+        auto results = getBuildOutputsCached(conn, destStore, drvs);
+
+        time_t now = time(0);
+        for (size_t n = 0; n < cachedBuilds.size(); ++n) {
+            auto build = cachedBuilds[n].first;
+            printMsg(lvlInfo, "marking build %1% as succeeded (cached)", build->id);
+            queueUpdate([this, build, res(std::move(results[n])), now](pqxx::work & txn) {
+                markSucceededBuild(txn, build, res, true, now, now);
+                notifyBuildFinished(txn, build->id, {});
+                build->finishedInDB = true;
+            });
+        }
+
+        cachedBuilds.clear();
+    };
 
     createBuild = [&](Build::ptr build) {
         prom.queue_build_loads.Increment();
@@ -150,16 +255,16 @@ bool State::getQueuedBuilds(Connection & conn,
             /* Derivation has been GC'ed prematurely. */
             printError("aborting GC'ed build %1%", build->id);
             if (!build->finishedInDB) {
-                auto mc = startDbUpdate();
-                pqxx::work txn(conn);
-                txn.exec_params0
-                    ("update Builds set finished = 1, buildStatus = $2, startTime = $3, stopTime = $3 where id = $1 and finished = 0",
-                     build->id,
-                     (int) bsAborted,
-                     time(0));
-                txn.commit();
-                build->finishedInDB = true;
-                nrBuildsDone++;
+                time_t now = time(0);
+                queueUpdate([this, build, now](pqxx::work & txn) {
+                    txn.exec_params0
+                        ("update Builds set finished = 1, buildStatus = $2, startTime = $3, stopTime = $3 where id = $1 and finished = 0",
+                         build->id,
+                         (int) bsAborted,
+                         now);
+                    build->finishedInDB = true;
+                    nrBuildsDone++;
+                });
             }
             return;
         }
@@ -169,8 +274,7 @@ bool State::getQueuedBuilds(Connection & conn,
 
         /* Create steps for this derivation and its dependencies. */
         try {
-            step = createStep(destStore, conn, build, build->drvPath,
-                build, 0, finishedDrvs, newSteps, newRunnable);
+            step = createSteps(destStore, build, finishedDrvs, newSteps, newRunnable);
         } catch (PreviousFailure & ex) {
 
             /* Some step previously failed, so mark the build as
@@ -192,7 +296,7 @@ bool State::getQueuedBuilds(Connection & conn,
                 if (!res[0].is_null()) propagatedFrom = res[0].as<BuildID>();
 
                 if (!propagatedFrom) {
-                    for (auto & i : ex.step->drv->outputsAndOptPaths(*localStore)) {
+                    for (auto & i : getStepDerivation(*ex.step)->outputsAndOptPaths(*localStore)) {
                         if (i.second.second) {
                             auto res = txn.exec_params
                                 ("select max(s.build) from BuildSteps s join BuildStepOutputs o on s.build = o.build where path = $1 and startTime != 0 and stopTime != 0 and status = 1",
@@ -236,40 +340,23 @@ bool State::getQueuedBuilds(Connection & conn,
         /* If we didn't get a step, it means the step's outputs are
            all valid. So we mark this as a finished, cached build. */
         if (!step) {
-            auto drv = localStore->readDerivation(build->drvPath);
-            BuildOutput res = getBuildOutputCached(conn, destStore, drv);
+            auto drv = getDerivation(build->drvPath);
 
-            for (auto & i : drv.outputsAndOptPaths(*localStore))
+            for (auto & i : drv->outputsAndOptPaths(*localStore))
                 if (i.second.second)
                     addRoot(*i.second.second);
 
-            {
-            auto mc = startDbUpdate();
-            pqxx::work txn(conn);
-            time_t now = time(0);
             if (!buildOneDone && build->id == buildOne) buildOneDone = true;
-            printMsg(lvlInfo, "marking build %1% as succeeded (cached)", build->id);
-            markSucceededBuild(txn, build, res, true, now, now);
-            notifyBuildFinished(txn, build->id, {});
-            txn.commit();
-            }
 
-            build->finishedInDB = true;
+            cachedBuilds.emplace_back(build, drv);
+            if (cachedBuilds.size() >= 256) finishCachedBuilds();
 
             return;
         }
 
         /* Note: if we exit this scope prior to this, the build and
            all newly created steps are destroyed. */
-
-        {
-            auto builds_(builds.lock());
-            if (!build->finishedInDB) // FIXME: can this happen?
-                (*builds_)[build->id] = build;
-            build->toplevel = step;
-        }
-
-        build->propagatePriorities();
+        addBuild(build, step);
 
         printMsg(lvlChatty, "added build %1% (top-level step %2%, %3% new steps)",
             build->id, localStore->printStorePath(step->drvPath), newSteps.size());
@@ -318,6 +405,9 @@ bool State::getQueuedBuilds(Connection & conn,
         } 
     }
 
+    finishCachedBuilds();
+    flushUpdates();
+
     prom.queue_checks_finished.Increment();
 
     lastBuildId = newBuildsByID.empty() ? newLastBuildId : newBuildsByID.begin()->first - 1;
@@ -325,56 +415,152 @@ bool State::getQueuedBuilds(Connection & conn,
 }
 
 
-void Build::propagatePriorities()
+std::vector<Step::ptr> Build::propagatePriorities()
 {
     /* Update the highest global priority and lowest build ID fields
        of each dependency. This is used by the dispatcher to start
        steps in order of descending global priority and ascending
        build ID. */
+    std::vector<Step::ptr> changed;
+
     visitDependencies([&](const Step::ptr & step) {
         auto step_(step->state.lock());
+        if (step_->highestGlobalPriority >= globalPriority
+            && step_->highestLocalPriority >= localPriority
+            && step_->lowestBuildID <= id
+            && std::find(step_->jobsets.begin(), step_->jobsets.end(), jobset) != step_->jobsets.end())
+            return;
         step_->highestGlobalPriority = std::max(step_->highestGlobalPriority, globalPriority);
         step_->highestLocalPriority = std::max(step_->highestLocalPriority, localPriority);
         step_->lowestBuildID = std::min(step_->lowestBuildID, id);
-        step_->jobsets.insert(jobset);
+        if (std::find(step_->jobsets.begin(), step_->jobsets.end(), jobset) == step_->jobsets.end())
+            step_->jobsets.push_back(jobset);
+        changed.push_back(step);
     }, toplevel);
+
+    return changed;
 }
 
 
-void State::processQueueChange(Connection & conn)
+void State::refreshCriticalPaths()
 {
+    if (!durationAwareScheduling || !criticalPathsStale.exchange(false)) return;
+
+    /* Weights only depend on the dependents of a step, so they
+       can go down when dependents go away. */
+    std::vector<Step::ptr> roots;
+    {
+        auto steps_(steps.lock());
+        for (auto & i : *steps_)
+            if (auto step = i.second.lock())
+                roots.push_back(step);
+    }
+
+    auto changed = updateCriticalPaths(roots);
+
+    printMsg(lvlChatty, "updated the critical path weights of %d steps", changed.size());
+
+    auto runnable_(runnable.lock());
+    for (auto & s : changed)
+        runnable_->update(s);
+}
+
+
+void State::processQueueChange(Connection & conn,
+    const std::optional<std::set<BuildID>> & buildIds)
+{
+    /* Restrict ourselves to the given builds that we know about. */
+    std::vector<BuildID> ids;
+    if (buildIds) {
+        auto builds_(builds.lock());
+        for (auto id : *buildIds)
+            if (builds_->count(id)) ids.push_back(id);
+        if (ids.empty()) return;
+    }
+
     /* Get the current set of queued builds. */
     std::map<BuildID, int> currentIds;
-    {
+    if (!buildIds) {
+        /* The full scan can use the replica. We must not discard
+           builds just because it doesn't know about them yet (e.g. if
+           they were just added or restarted), so we ask the primary
+           about the ones that it doesn't list. */
+        readFromReplica([&](Connection & conn) {
+            currentIds.clear();
+            pqxx::work txn(conn);
+            for (auto const & row : txn.exec("select id, globalPriority from Builds where finished = 0"))
+                currentIds[row["id"].as<BuildID>()] = row["globalPriority"].as<BuildID>();
+        }, &conn);
+        for (auto & [id, build] : *builds.lock())
+            if (!currentIds.count(id)) ids.push_back(id);
+    }
+    if (!ids.empty()) {
         pqxx::work txn(conn);
-        auto res = txn.exec("select id, globalPriority from Builds where finished = 0");
-        for (auto const & row : res)
+        for (auto const & row : txn.exec_prepared("unfinished-builds", ids))
             currentIds[row["id"].as<BuildID>()] = row["globalPriority"].as<BuildID>();
     }
 
+    /* The steps that may no longer be needed by any build. Only
+       active steps among these need to be checked. */
+    std::set<Step::ptr> orphanCandidates;
+
     {
         auto builds_(builds.lock());
 
-        for (auto i = builds_->begin(); i != builds_->end(); ) {
-            auto b = currentIds.find(i->first);
+        /* Return false if the build should be discarded. */
+        auto update = [&](const Build::ptr & build) {
+            auto b = currentIds.find(build->id);
             if (b == currentIds.end()) {
-                printInfo("discarding cancelled build %1%", i->first);
-                i = builds_->erase(i);
+                printInfo("discarding cancelled build %1%", build->id);
                 // FIXME: ideally we would interrupt active build steps here.
-                continue;
+                if (buildIds && build->toplevel)
+                    visitDependencies([&](Step::ptr step) {
+                        orphanCandidates.insert(step);
+                    }, build->toplevel);
+                criticalPathsStale = true;
+                return false;
+            }
+            if (build->globalPriority < b->second) {
+                printInfo("priority of build %1% increased", build->id);
+                build->globalPriority = b->second;
+                auto changed = build->propagatePriorities();
+                auto runnable_(runnable.lock());
+                for (auto & s : changed)
+                    runnable_->update(s);
             }
-            if (i->second->globalPriority < b->second) {
-                printInfo("priority of build %1% increased", i->first);
-                i->second->globalPriority = b->second;
-                i->second->propagatePriorities();
+            return true;
+        };
+
+        if (buildIds) {
+            for (auto id : ids) {
+                auto i = builds_->find(id);
+                if (i != builds_->end() && !update(i->second))
+                    builds_->erase(i);
+            }
+        } else {
+            for (auto i = builds_->begin(); i != builds_->end(); ) {
+                if (update(i->second))
+                    ++i;
+                else
+                    i = builds_->erase(i);
             }
-            ++i;
         }
     }
 
+    if (buildIds && orphanCandidates.empty()) return;
+
     {
         auto activeSteps(activeSteps_.lock());
         for (auto & activeStep : *activeSteps) {
+            if (buildIds && !orphanCandidates.count(activeStep->step)) continue;
+            {
+                auto builds_(builds.lock());
+                auto representative = activeStep->step->state.lock()->representativeBuild.lock();
+                if (representative) {
+                    auto i = builds_->find(representative->id);
+                    if (i != builds_->end() && i->second == representative) continue;
+                }
+            }
             std::set<Build::ptr> dependents;
             std::set<Step::ptr> steps;
             getDependents(activeStep->step, dependents, steps);
@@ -399,83 +585,364 @@ void State::processQueueChange(Connection & conn)
 }
 
 
-Step::ptr State::createStep(ref<Store> destStore,
-    Connection & conn, Build::ptr build, const StorePath & drvPath,
-    Build::ptr referringBuild, Step::ptr referringStep, std::set<StorePath> & finishedDrvs,
+void State::addBuild(Build::ptr build, Step::ptr toplevel)
+{
+    {
+        auto builds_(builds.lock());
+        if (!build->finishedInDB) // FIXME: can this happen?
+            (*builds_)[build->id] = build;
+        build->toplevel = toplevel;
+    }
+
+    auto changed = build->propagatePriorities();
+    if (durationAwareScheduling) {
+        auto changed2 = updateCriticalPaths({toplevel});
+        changed.insert(changed.end(), changed2.begin(), changed2.end());
+    }
+    auto runnable_(runnable.lock());
+    for (auto & s : changed)
+        runnable_->update(s);
+}
+
+
+Step::ptr State::createSteps(ref<Store> destStore, Build::ptr build,
+    Sync<std::set<StorePath>> & finishedDrvs,
     std::set<Step::ptr> & newSteps, std::set<Step::ptr> & newRunnable)
 {
-    if (finishedDrvs.find(drvPath) != finishedDrvs.end()) return 0;
-
-    /* Check if the requested step already exists. If not, create a
-       new step. In any case, make the step reachable from
-       referringBuild or referringStep. This is done atomically (with
-       ‘steps’ locked), to ensure that this step can never become
-       reachable from a new build after doBuildStep has removed it
-       from ‘steps’. */
-    Step::ptr step;
-    bool isNew = false;
+    return expandSteps(build, finishedDrvs, newSteps, newRunnable,
+        [&](const GetConnection & conn, Step::ptr step) {
+            return initStep(destStore, conn(), build, step);
+        });
+}
+
+
+Step::ptr State::expandSteps(Build::ptr build,
+    Sync<std::set<StorePath>> & finishedDrvs,
+    std::set<Step::ptr> & newSteps, std::set<Step::ptr> & newRunnable,
+    const InitStep & initStep)
+{
+    /* Called when a derivation has been expanded, with its step, or 0
+       if its outputs are all valid. */
+    typedef std::function<void(Step::ptr)> Done;
+
+    /* The derivations that are being expanded by this call. A
+       derivation can be reached by several paths at the same
+       time. The first thread creates the step; the others wait for
+       it to be finished or found to be unnecessary. */
+    struct Node
     {
-        auto steps_(steps.lock());
+        bool finished = false;
+        Step::ptr step;
+        std::vector<Done> waiters;
+    };
+
+    /* Work items for the threads of ‘queuePool’. Each thread that
+       works on this build takes one database connection, the first
+       time it needs one, for as long as there is work, rather than
+       one per derivation. */
+    typedef std::function<void(const GetConnection &)> Work;
+
+    struct Traversal
+    {
+        std::map<StorePath, Node> nodes;
+        std::set<Step::ptr> newSteps, newRunnable;
+
+        std::queue<Work> queue;
+        /* Work items that are queued or running. */
+        size_t pending = 0;
+        size_t workers = 0, idle = 0;
+        std::exception_ptr exception;
+    };
+
+    Sync<Traversal> traversal_;
+    std::condition_variable wakeup;
+
+    auto worker = [&]() {
+        try {
+            std::optional<nix::Pool<Connection>::Handle> conn;
+
+            GetConnection getConnection = [&]() -> Connection & {
+                if (!conn) conn.emplace(dbPool.get());
+                return **conn;
+            };
+
+            while (true) {
+                Work work;
+
+                {
+                    auto traversal(traversal_.lock());
+                    traversal->idle++;
+                    while (traversal->queue.empty() && traversal->pending)
+                        traversal.wait(wakeup);
+                    traversal->idle--;
+                    if (!traversal->pending) break;
+                    work = std::move(traversal->queue.front());
+                    traversal->queue.pop();
+                    /* After a failure, just drain the queue. */
+                    if (traversal->exception) work = nullptr;
+                }
+
+                try {
+                    if (work) work(getConnection);
+                } catch (...) {
+                    auto traversal(traversal_.lock());
+                    if (!traversal->exception)
+                        traversal->exception = std::current_exception();
+                }
 
-        /* See if the step already exists in ‘steps’ and is not
-           stale. */
-        auto prev = steps_->find(drvPath);
-        if (prev != steps_->end()) {
-            step = prev->second.lock();
-            /* Since ‘step’ is a strong pointer, the referred Step
-               object won't be deleted after this. */
-            if (!step) steps_->erase(drvPath); // remove stale entry
+                work = nullptr;
+
+                if (--traversal_.lock()->pending == 0)
+                    wakeup.notify_all();
+            }
+        } catch (...) {
+            auto traversal(traversal_.lock());
+            if (!traversal->exception)
+                traversal->exception = std::current_exception();
         }
 
-        /* If it doesn't exist, create it. */
-        if (!step) {
-            step = std::make_shared<Step>(drvPath);
-            isNew = true;
+        traversal_.lock()->workers--;
+        wakeup.notify_all();
+    };
+
+    auto enqueue = [&](Work && work) {
+        {
+            auto traversal(traversal_.lock());
+            traversal->queue.push(std::move(work));
+            traversal->pending++;
+            if (traversal->idle || traversal->workers >= nrQueueThreads) {
+                wakeup.notify_one();
+                return;
+            }
+            traversal->workers++;
         }
+        queuePool.enqueue(worker);
+    };
 
-        auto step_(step->state.lock());
+    auto resolve = [&](const StorePath & drvPath, Step::ptr step, bool runnable) {
+        std::vector<Done> waiters;
+        {
+            auto traversal(traversal_.lock());
+            auto & node(traversal->nodes.at(drvPath));
+            node.finished = true;
+            node.step = step;
+            std::swap(waiters, node.waiters);
+            if (step) traversal->newSteps.insert(step);
+            if (runnable) traversal->newRunnable.insert(step);
+        }
+        for (auto & done : waiters) done(step);
+    };
 
-        assert(step_->created != isNew);
+    std::function<void(const GetConnection &, const StorePath &, Step::ptr, Done)> expand;
 
-        if (referringBuild)
-            step_->builds.push_back(referringBuild);
+    expand = [&](const GetConnection & conn, const StorePath & drvPath, Step::ptr referringStep, Done done)
+    {
+        if (finishedDrvs.lock()->count(drvPath)) {
+            done(0);
+            return;
+        }
 
-        if (referringStep)
-            step_->rdeps.push_back(referringStep);
+        /* Check if the requested step already exists. If not, create
+           a new step. In any case, make the step reachable from
+           ‘build’ or referringStep. This is done atomically (with
+           ‘steps’ locked), to ensure that this step can never become
+           reachable from a new build after doBuildStep has removed it
+           from ‘steps’. */
+        Step::ptr step;
+        bool isNew = false;
+        {
+            auto steps_(steps.lock());
+
+            /* See if the step already exists in ‘steps’ and is not
+               stale. */
+            auto prev = steps_->find(drvPath);
+            if (prev != steps_->end()) {
+                step = prev->second.lock();
+                /* Since ‘step’ is a strong pointer, the referred Step
+                   object won't be deleted after this. */
+                if (!step) steps_->erase(drvPath); // remove stale entry
+            }
 
-        steps_->insert_or_assign(drvPath, step);
-    }
+            /* If it doesn't exist, create it. */
+            if (!step) {
+                step = std::make_shared<Step>(drvPath);
+                isNew = true;
+            }
+
+            auto step_(step->state.lock());
+
+            assert(!isNew || !step_->created);
+
+            if (!referringStep)
+                step_->builds.push_back(build);
+            else
+                step_->rdeps.push_back(referringStep);
+
+            /* Prefer the build with the lowest ID as the
+               representative, like the dispatcher does. Steps below
+               an existing step keep theirs. */
+            auto representative = step_->representativeBuild.lock();
+            if (!representative || representative->finishedInDB || build->id < representative->id)
+                step_->representativeBuild = build;
+
+            steps_->insert_or_assign(drvPath, step);
+
+            /* A step that isn't created yet is being expanded by
+               another thread. Note that we register as a waiter
+               while holding ‘steps’, so we can't miss the step being
+               finished. */
+            auto traversal(traversal_.lock());
+            if (isNew)
+                traversal->nodes.emplace(drvPath, Node());
+            else if (!step_->created) {
+                auto & node(traversal->nodes.at(drvPath));
+                if (!node.finished) {
+                    node.waiters.push_back(done);
+                    return;
+                }
+                step = node.step;
+            }
+        }
+
+        if (!isNew) {
+            done(step);
+            return;
+        }
+
+        prom.queue_steps_created.Increment();
+
+        printMsg(lvlDebug, "considering derivation ‘%1%’", localStore->printStorePath(drvPath));
+
+        bool needsBuild = initStep(conn, step);
+
+        // FIXME: check whether all outputs are in the binary cache.
+        if (!needsBuild) {
+            finishedDrvs.lock()->insert(drvPath);
+            resolve(drvPath, 0, false);
+            done(0);
+            return;
+        }
+
+        /* No, we need to build. */
+        printMsg(lvlDebug, "creating build step ‘%1%’", localStore->printStorePath(drvPath));
+
+        /* Called once all dependencies have been expanded. If the
+           step has no (remaining) dependencies, make it runnable. */
+        auto finish = [this, &resolve, drvPath, step, done]() {
+            bool runnable;
+            {
+                auto step_(step->state.lock());
+                assert(!step_->created);
+                /* Nobody else looks at the derivation until the step
+                   has been created. */
+                if (compactSteps) step->drv = nullptr;
+                step_->deps.shrink_to_fit();
+                step_->created = true;
+                runnable = step_->deps.empty();
+            }
+            resolve(drvPath, step, runnable);
+            done(step);
+        };
+
+        /* Create steps for the dependencies. Keep a reference to
+           the derivation, since finish() may drop it before we're
+           done iterating over its inputs. */
+        auto drv = step->drv;
+        auto & inputs(drv->inputDrvs);
+        if (inputs.empty()) {
+            finish();
+            return;
+        }
+
+        auto left = std::make_shared<std::atomic<size_t>>(inputs.size());
+        for (auto & i : inputs)
+            enqueue([&expand, depPath(i.first), step, left, finish](const GetConnection & conn) {
+                expand(conn, depPath, step, [step, left, finish](Step::ptr dep) {
+                    if (dep) {
+                        auto step_(step->state.lock());
+                        step_->deps.push_back(dep);
+                    }
+                    if (--*left == 0) finish();
+                });
+            });
+    };
+
+    Step::ptr toplevel;
+
+    enqueue([&](const GetConnection & conn) {
+        expand(conn, build->drvPath, 0, [&](Step::ptr step) { toplevel = step; });
+    });
+
+    auto traversal(traversal_.lock());
+    while (traversal->workers)
+        traversal.wait(wakeup);
 
-    if (!isNew) return step;
+    /* Rethrow the first exception (e.g. PreviousFailure) thrown by
+       any of the workers. */
+    if (traversal->exception)
+        std::rethrow_exception(traversal->exception);
 
-    prom.queue_steps_created.Increment();
+    newSteps.insert(traversal->newSteps.begin(), traversal->newSteps.end());
+    newRunnable.insert(traversal->newRunnable.begin(), traversal->newRunnable.end());
+
+    return toplevel;
+}
 
-    printMsg(lvlDebug, "considering derivation ‘%1%’", localStore->printStorePath(drvPath));
 
-    /* Initialize the step. Note that the step may be visible in
-       ‘steps’ before this point, but that doesn't matter because
-       it's not runnable yet, and other threads won't make it
-       runnable while step->created == false. */
-    step->drv = std::make_unique<Derivation>(localStore->readDerivation(drvPath));
-    step->parsedDrv = std::make_unique<ParsedDerivation>(drvPath, *step->drv);
+const StepType * StepType::intern(StepType && type)
+{
+    static Sync<std::set<StepType>> types_;
+    auto types(types_.lock());
+    return &*types->insert(std::move(type)).first;
+}
+
+
+void State::initStepType(Step::ptr step)
+{
+    ParsedDerivation parsedDrv(step->drvPath, *step->drv);
 
-    step->preferLocalBuild = step->parsedDrv->willBuildLocally(*localStore);
     step->isDeterministic = getOr(step->drv->env, "isDetermistic", "0") == "1";
 
-    step->systemType = step->drv->platform;
     {
+        StepType type;
+        type.platform = step->drv->platform;
+        type.preferLocalBuild = parsedDrv.willBuildLocally(*localStore);
+        type.systemType = type.platform;
         auto i = step->drv->env.find("requiredSystemFeatures");
         StringSet features;
         if (i != step->drv->env.end())
-            features = step->requiredSystemFeatures = tokenizeString<std::set<std::string>>(i->second);
-        if (step->preferLocalBuild)
+            features = type.requiredSystemFeatures = tokenizeString<std::set<std::string>>(i->second);
+        if (type.preferLocalBuild)
             features.insert("local");
         if (!features.empty()) {
-            step->systemType += ":";
-            step->systemType += concatStringsSep(",", features);
+            type.systemType += ":";
+            type.systemType += concatStringsSep(",", features);
         }
+        step->type = StepType::intern(std::move(type));
     }
 
+    if (durationAwareScheduling)
+        step->estimatedDuration = estimateStepDuration(step->drvPath);
+
+    if (localityAwareDispatch)
+        for (auto & i : step->drv->inputDrvs)
+            step->inputHashes.push_back(PathFilter::hash(i.first.to_string()));
+}
+
+
+bool State::initStep(ref<Store> destStore, Connection & conn,
+    Build::ptr build, Step::ptr step)
+{
+    auto & drvPath(step->drvPath);
+
+    /* Note that the step may be visible in ‘steps’ before this
+       point, but that doesn't matter because it's not runnable yet,
+       and other threads won't make it runnable while step->created
+       == false. */
+    step->drv = getDerivation(drvPath);
+
+    initStepType(step);
+
     /* If this derivation failed previously, give up. */
     if (checkCachedFailure(step, conn))
         throw PreviousFailure{step};
@@ -551,37 +1018,7 @@ Step::ptr State::createStep(ref<Store> destStore,
         }
     }
 
-    // FIXME: check whether all outputs are in the binary cache.
-    if (valid) {
-        finishedDrvs.insert(drvPath);
-        return 0;
-    }
-
-    /* No, we need to build. */
-    printMsg(lvlDebug, "creating build step ‘%1%’", localStore->printStorePath(drvPath));
-
-    /* Create steps for the dependencies. */
-    for (auto & i : step->drv->inputDrvs) {
-        auto dep = createStep(destStore, conn, build, i.first, 0, step, finishedDrvs, newSteps, newRunnable);
-        if (dep) {
-            auto step_(step->state.lock());
-            step_->deps.insert(dep);
-        }
-    }
-
-    /* If the step has no (remaining) dependencies, make it
-       runnable. */
-    {
-        auto step_(step->state.lock());
-        assert(!step_->created);
-        step_->created = true;
-        if (step_->deps.empty())
-            newRunnable.insert(step);
-    }
-
-    newSteps.insert(step);
-
-    return step;
+    return !valid;
 }
 
 
@@ -640,69 +1077,199 @@ void State::processJobsetSharesChange(Connection & conn)
 }
 
 
-BuildOutput State::getBuildOutputCached(Connection & conn, nix::ref<nix::Store> destStore, const nix::Derivation & drv)
+std::vector<BuildOutput> State::getBuildOutputsCached(Connection & conn, nix::ref<nix::Store> destStore,
+    const std::vector<std::shared_ptr<nix::Derivation>> & drvs)
 {
-    {
-    pqxx::work txn(conn);
+    std::vector<std::string> paths;
+    for (auto & drv : drvs)
+        for (auto & [name, output] : drv->outputsAndOptPaths(*localStore))
+            if (output.second)
+                paths.push_back(localStore->printStorePath(*output.second));
+
+    /* The most recent successful build that produced each path. If
+       that build finished very recently, the replica may not have it
+       yet, in which case we get the outputs from the store. */
+    std::map<std::string, std::pair<BuildID, BuildOutput>> cached;
+
+    if (!paths.empty())
+        readFromReplica([&](Connection & conn) {
+            cached.clear();
+
+            pqxx::work txn(conn);
+
+            for (auto const & row : txn.exec_prepared("cached-build-outputs", paths)) {
+                BuildOutput res;
+                res.failed = row[2].as<int>() == bsFailedWithOutput;
+                res.releaseName = row[3].is_null() ? "" : row[3].as<std::string>();
+                res.closureSize = row[4].is_null() ? 0 : row[4].as<uint64_t>();
+                res.size = row[5].is_null() ? 0 : row[5].as<uint64_t>();
+
+                if (!row[6].is_null())
+                    for (auto & p : nlohmann::json::parse(row[6].as<std::string>())) {
+                        BuildProduct product;
+                        product.type = p[0].get<std::string>();
+                        product.subtype = p[1].get<std::string>();
+                        if (p[2].is_null())
+                            product.isRegular = false;
+                        else {
+                            product.isRegular = true;
+                            product.fileSize = p[2].get<off_t>();
+                        }
+                        if (!p[3].is_null())
+                            product.sha256hash = Hash::parseAny(p[3].get<std::string>(), htSHA256);
+                        if (!p[4].is_null())
+                            product.path = p[4].get<std::string>();
+                        product.name = p[5].get<std::string>();
+                        if (!p[6].is_null())
+                            product.defaultPath = p[6].get<std::string>();
+                        res.products.emplace_back(product);
+                    }
+
+                if (!row[7].is_null())
+                    for (auto & m : nlohmann::json::parse(row[7].as<std::string>())) {
+                        BuildMetric metric;
+                        metric.name = m[0].get<std::string>();
+                        metric.unit = m[1].is_null() ? "" : m[1].get<std::string>();
+                        metric.value = m[2].get<double>();
+                        res.metrics.emplace(metric.name, metric);
+                    }
 
-    for (auto & [name, output] : drv.outputsAndOptPaths(*localStore)) {
-        auto r = txn.exec_params
-            ("select id, buildStatus, releaseName, closureSize, size from Builds b "
-             "join BuildOutputs o on b.id = o.build "
-             "where finished = 1 and (buildStatus = 0 or buildStatus = 6) and path = $1",
-             localStore->printStorePath(*output.second));
-        if (r.empty()) continue;
-        BuildID id = r[0][0].as<BuildID>();
-
-        printInfo("reusing build %d", id);
-
-        BuildOutput res;
-        res.failed = r[0][1].as<int>() == bsFailedWithOutput;
-        res.releaseName = r[0][2].is_null() ? "" : r[0][2].as<std::string>();
-        res.closureSize = r[0][3].is_null() ? 0 : r[0][3].as<uint64_t>();
-        res.size = r[0][4].is_null() ? 0 : r[0][4].as<uint64_t>();
-
-        auto products = txn.exec_params
-            ("select type, subtype, fileSize, sha256hash, path, name, defaultPath from BuildProducts where build = $1 order by productnr",
-             id);
-
-        for (auto row : products) {
-            BuildProduct product;
-            product.type = row[0].as<std::string>();
-            product.subtype = row[1].as<std::string>();
-            if (row[2].is_null())
-                product.isRegular = false;
-            else {
-                product.isRegular = true;
-                product.fileSize = row[2].as<off_t>();
+                cached.insert_or_assign(row[0].as<std::string>(),
+                    std::make_pair(row[1].as<BuildID>(), std::move(res)));
             }
-            if (!row[3].is_null())
-                product.sha256hash = Hash::parseAny(row[3].as<std::string>(), htSHA256);
-            if (!row[4].is_null())
-                product.path = row[4].as<std::string>();
-            product.name = row[5].as<std::string>();
-            if (!row[6].is_null())
-                product.defaultPath = row[6].as<std::string>();
-            res.products.emplace_back(product);
-        }
+        }, &conn);
 
-        auto metrics = txn.exec_params
-            ("select name, unit, value from BuildMetrics where build = $1",
-             id);
+    std::vector<BuildOutput> results;
 
-        for (auto row : metrics) {
-            BuildMetric metric;
-            metric.name = row[0].as<std::string>();
-            metric.unit = row[1].is_null() ? "" : row[1].as<std::string>();
-            metric.value = row[2].as<double>();
-            res.metrics.emplace(metric.name, metric);
+    for (auto & drv : drvs) {
+        const std::pair<BuildID, BuildOutput> * best = nullptr;
+        for (auto & [name, output] : drv->outputsAndOptPaths(*localStore)) {
+            if (!output.second) continue;
+            auto i = cached.find(localStore->printStorePath(*output.second));
+            if (i != cached.end() && (!best || i->second.first > best->first))
+                best = &i->second;
         }
 
-        return res;
+        if (best) {
+            printInfo("reusing build %d", best->first);
+            results.push_back(best->second);
+        } else {
+            NarMemberDatas narMembers;
+            results.push_back(getBuildOutput(destStore, narMembers, *drv, lazyNarHashing, &closureSizes));
+        }
+    }
+
+    return results;
+}
+
+
+/* The key under which the duration of a step is recorded: the name
+   of the derivation without the version, so that the history of
+   e.g. ‘chromium-120.0.drv’ applies to ‘chromium-121.0.drv’. */
+static std::string durationKey(std::string_view drvName)
+{
+    if (hasSuffix(drvName, drvExtension))
+        drvName.remove_suffix(drvExtension.size());
+    return DrvName(drvName).name;
+}
+
+
+void State::loadStepDurations(Connection & conn)
+{
+    /* How far back to look in the build step history. */
+    const time_t maxAge = 30 * 24 * 60 * 60;
+
+    pqxx::work txn(conn);
+
+    /* Strip the store directory and hash part from the derivation
+       paths to group by name. */
+    auto res = txn.exec_params
+        ("select substring(drvPath from $1), avg(stopTime - startTime), count(*) from BuildSteps "
+         "where stopTime > $2 and startTime is not null and stopTime is not null "
+         "and type = 0 and status = 0 group by 1",
+         localStore->storeDir.size() + 2 + StorePath::HashLen + 1,
+         time(0) - maxAge);
+
+    /* Merge the averages of different versions. */
+    std::unordered_map<std::string, std::pair<double, uint64_t>> totals;
+    for (auto const & row : res) {
+        auto & total(totals[durationKey(row[0].as<std::string>())]);
+        auto count = row[2].as<uint64_t>();
+        total.first += row[1].as<double>() * count;
+        total.second += count;
     }
 
+    auto stepDurations_(stepDurations.lock());
+    for (auto & [name, total] : totals)
+        (*stepDurations_)[name] = total.first / total.second;
+
+    printInfo("loaded the build times of %d derivations", stepDurations_->size());
+}
+
+
+void State::loadFailedPaths(Connection & conn)
+{
+    /* Remember the paths that failStep() adds while we're reading
+       the table, since our snapshot may not have them. */
+    failedPaths.lock()->added = std::vector<std::string>();
+
+    try {
+        size_t count;
+        {
+            pqxx::work txn(conn);
+            count = txn.exec("select count(*) from FailedPaths")[0][0].as<size_t>();
+        }
+
+        /* Leave room for the failures of the next while, at 16 bits
+           per path for a false positive rate of about 0.2%. */
+        PathFilter filter(2 * count + 65536, 16);
+
+        /* Read the table in batches to avoid a big result set and a
+           long-running transaction. */
+        const size_t batchSize = 100000;
+        std::string last;
+        while (true) {
+            pqxx::work txn(conn);
+            auto res = txn.exec_params
+                ("select path from FailedPaths where path > $1 order by path limit $2",
+                 last, batchSize);
+            for (auto const & row : res) {
+                last = row[0].as<std::string>();
+                filter.insert(last);
+            }
+            if (res.size() < batchSize) break;
+        }
+
+        auto failedPaths_(failedPaths.lock());
+        for (auto & path : *failedPaths_->added)
+            filter.insert(path);
+        failedPaths_->added.reset();
+        failedPaths_->filter.emplace(std::move(filter));
+        failedPaths_->reload = false;
+
+        printInfo("loaded %d failed paths", count);
+    } catch (...) {
+        failedPaths.lock()->added.reset();
+        throw;
     }
+}
 
-    NarMemberDatas narMembers;
-    return getBuildOutput(destStore, narMembers, drv);
+
+void State::recordStepDuration(const StorePath & drvPath, float duration)
+{
+    /* Weight of the most recent build in the moving average. */
+    const float alpha = 0.3;
+
+    auto stepDurations_(stepDurations.lock());
+    auto [i, isNew] = stepDurations_->try_emplace(durationKey(drvPath.name()), duration);
+    if (!isNew)
+        i->second = alpha * duration + (1 - alpha) * i->second;
+}
+
+
+float State::estimateStepDuration(const StorePath & drvPath)
+{
+    auto stepDurations_(stepDurations.lock());
+    auto i = stepDurations_->find(durationKey(drvPath.name()));
+    return i == stepDurations_->end() ? 0 : i->second;
 }
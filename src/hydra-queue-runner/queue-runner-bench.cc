@@ -0,0 +1,481 @@
+#include <algorithm>
+#include <iostream>
+#include <random>
+
+#include <sys/resource.h>
+
+#include <nlohmann/json.hpp>
+
+#include "state.hh"
+#include "globals.hh"
+#include "hydra-config.hh"
+#include "shared.hh"
+
+using namespace nix;
+
+using json = nlohmann::json;
+
+
+/* Measures the scheduler of the queue runner on synthetic build
+   graphs and machines, without a database, a Nix daemon or build
+   machines. Builds are loaded into the queue by the same code as in
+   getQueuedBuilds(), with the derivations coming from memory, and
+   the dispatcher hands out steps that are "built" instantly by the
+   same code as in finishStep(), until the queue is empty. */
+class QueueRunnerBench
+{
+public:
+
+    struct Params
+    {
+        size_t builds = 2000;
+        size_t width = 500; // steps per level and system type
+        size_t depth = 8;
+        size_t fanIn = 4; // dependencies on the previous level
+        size_t systems = 2;
+        size_t jobsets = 20;
+        size_t maxShares = 100;
+        size_t machines = 100;
+        size_t maxJobs = 8;
+        unsigned int seed = 1;
+    };
+
+    QueueRunnerBench(State & state, const Params & params)
+        : state(state), params(params), rng(params.seed)
+    {
+        /* Only used for printing store paths. */
+        state.localStore = openStore("dummy://");
+    }
+
+    json run();
+
+private:
+
+    typedef std::chrono::steady_clock clock;
+
+    /* Durations of one operation, in microseconds. */
+    struct Samples
+    {
+        std::vector<double> us;
+
+        void add(clock::duration d)
+        {
+            us.push_back(std::chrono::duration<double, std::micro>(d).count());
+        }
+
+        double total() const
+        {
+            double t = 0;
+            for (auto u : us) t += u;
+            return t;
+        }
+
+        json summary()
+        {
+            std::sort(us.begin(), us.end());
+            auto pct = [&](double p) {
+                return us.empty() ? 0.0 : us[std::min(us.size() - 1, (size_t) (p * us.size()))];
+            };
+            return {
+                {"count", us.size()},
+                {"total_us", total()},
+                {"p50_us", pct(0.50)},
+                {"p90_us", pct(0.90)},
+                {"p99_us", pct(0.99)},
+                {"max_us", us.empty() ? 0.0 : us.back()},
+            };
+        }
+    };
+
+    State & state;
+    Params params;
+    std::mt19937 rng;
+
+    std::vector<std::string> systems;
+    std::vector<Jobset::ptr> jobsets;
+
+    /* The generated derivations, and their paths by level and
+       system type. */
+    std::map<StorePath, std::shared_ptr<Derivation>> derivations;
+    std::vector<std::vector<std::vector<StorePath>>> levels;
+
+    std::vector<Build::ptr> builds;
+
+    Sync<std::set<StorePath>> finishedDrvs;
+
+    /* The reservations made by the last doDispatch() call. */
+    std::vector<State::MachineReservation::ptr> dispatched;
+
+    std::string machinesFile(size_t variant);
+
+    void createGraph();
+
+    void loadBuild(Build::ptr build, Samples & propagate);
+
+    void finishStep(Step::ptr step);
+
+    size_t peakMemory();
+};
+
+
+std::string QueueRunnerBench::machinesFile(size_t variant)
+{
+    /* Each machine supports one system type. The variants differ in
+       the speed factors, so that parseMachines() has to replace all
+       machines when switching between them. */
+    std::string s;
+    for (size_t n = 0; n < params.machines; ++n)
+        s += fmt("ssh://bench-%d %s - %d %d - - -\n",
+            n, systems[n % systems.size()], params.maxJobs, 1 + (n + variant) % 4);
+    return s;
+}
+
+
+void QueueRunnerBench::createGraph()
+{
+    size_t nr = 0;
+
+    auto newDrv = [&](const std::string & system) {
+        auto name = fmt("bench-%d", nr++);
+        StorePath drvPath(hashString(htSHA256, name), name + ".drv");
+        auto drv = std::make_shared<Derivation>();
+        drv->name = name;
+        drv->platform = system;
+        derivations.insert_or_assign(drvPath, drv);
+        return drvPath;
+    };
+
+    auto addDep = [&](const StorePath & drvPath, const StorePath & dep) {
+        derivations.at(drvPath)->inputDrvs[dep] = {"out"};
+    };
+
+    /* Every step depends on the first step of its system type (like
+       stdenv) and on ‘fanIn’ random steps of the level below. */
+    levels.resize(params.depth);
+    for (size_t level = 0; level < params.depth; ++level) {
+        levels[level].resize(systems.size());
+        for (size_t s = 0; s < systems.size(); ++s) {
+            auto & drvPaths(levels[level][s]);
+            for (size_t n = 0; n < params.width; ++n) {
+                auto drvPath = newDrv(systems[s]);
+                if (level > 0 || n > 0)
+                    addDep(drvPath, levels[0][s][0]);
+                if (level > 0) {
+                    auto & below(levels[level - 1][s]);
+                    std::uniform_int_distribution<size_t> pick(0, below.size() - 1);
+                    for (size_t i = 0; i < params.fanIn; ++i)
+                        addDep(drvPath, below[pick(rng)]);
+                }
+                drvPaths.push_back(drvPath);
+            }
+        }
+    }
+
+    /* The top-level steps of the builds are on the highest level. */
+    auto & top(levels.back());
+    std::uniform_int_distribution<size_t> pickSystem(0, systems.size() - 1);
+    std::uniform_int_distribution<size_t> pickStep(0, params.width - 1);
+    std::uniform_int_distribution<size_t> pickJobset(0, jobsets.size() - 1);
+    std::uniform_int_distribution<int> pickPriority(0, 10);
+    for (size_t n = 0; n < params.builds; ++n) {
+        auto build = std::make_shared<Build>(StorePath(top[pickSystem(rng)][pickStep(rng)]));
+        build->id = n + 1;
+        auto j = pickJobset(rng);
+        build->jobset = jobsets[j];
+        build->jobsetId = j + 1;
+        build->projectName = "bench";
+        build->jobsetName = fmt("jobset-%d", j);
+        build->jobName = fmt("job-%d", n);
+        build->timestamp = time(0);
+        build->maxSilentTime = build->buildTimeout = 3600;
+        build->localPriority = pickPriority(rng);
+        build->globalPriority = 0;
+        builds.push_back(build);
+    }
+}
+
+
+void QueueRunnerBench::loadBuild(Build::ptr build, Samples & propagate)
+{
+    /* Create the steps of the build as createSteps() does, but with
+       every derivation needing to be built. */
+    std::set<Step::ptr> newSteps, newRunnable;
+
+    auto toplevel = state.expandSteps(build, finishedDrvs, newSteps, newRunnable,
+        [&](const State::GetConnection & conn, Step::ptr step) {
+            step->drv = derivations.at(step->drvPath);
+            state.initStepType(step);
+            return true;
+        });
+    assert(toplevel);
+
+    {
+        auto start = clock::now();
+        state.addBuild(build, toplevel);
+        propagate.add(clock::now() - start);
+    }
+
+    for (auto & step : newRunnable)
+        state.makeRunnable(step);
+}
+
+
+void QueueRunnerBench::finishStep(Step::ptr step)
+{
+    /* Do what State::finishStep() does for a successful step, with
+       the database updates committing right away. */
+    auto now = time(0);
+    state.chargeStep(step, now, now + 60);
+    state.finishSucceededStep(step, [&](Build::ptr b) {
+        state.removeFinishedBuild(b, true);
+    });
+}
+
+
+size_t QueueRunnerBench::peakMemory()
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == -1)
+        throw SysError("getting resource usage");
+    return usage.ru_maxrss; // KiB on Linux
+}
+
+
+json QueueRunnerBench::run()
+{
+    static const char * knownSystems[] = {"x86_64-linux", "aarch64-linux", "x86_64-darwin", "aarch64-darwin"};
+    for (size_t n = 0; n < std::max(params.systems, (size_t) 1); ++n)
+        systems.push_back(n < 4 ? knownSystems[n] : fmt("system-%d", n));
+
+    {
+        std::uniform_int_distribution<size_t> pickShares(1, std::max(params.maxShares, (size_t) 1));
+        auto jobsets_(state.jobsets.lock());
+        for (size_t n = 0; n < std::max(params.jobsets, (size_t) 1); ++n) {
+            auto jobset = std::make_shared<Jobset>();
+            jobset->setShares(pickShares(rng));
+            jobsets_->insert_or_assign({"bench", fmt("jobset-%d", n)}, jobset);
+            jobsets.push_back(jobset);
+        }
+    }
+
+    params.width = std::max(params.width, (size_t) 1);
+    params.depth = std::max(params.depth, (size_t) 1);
+
+    state.queuePool.start(state.nrQueueThreads);
+
+    Samples parse, load, propagate, dependents, visit, dispatch;
+
+    /* Machines. The first parse adds all machines, the others replace
+       them. */
+    for (size_t n = 0; n < 20; ++n) {
+        auto contents = machinesFile(n % 2);
+        auto start = clock::now();
+        state.parseMachines(contents);
+        parse.add(clock::now() - start);
+    }
+
+    createGraph();
+
+    for (auto & build : builds) {
+        auto start = clock::now();
+        loadBuild(build, propagate);
+        load.add(clock::now() - start);
+    }
+
+    size_t nrSteps = state.steps.lock()->size();
+    size_t memoryLoaded = peakMemory();
+
+    std::vector<Step::ptr> queued;
+    for (auto & [drvPath, step] : *state.steps.lock())
+        if (auto s = step.lock()) queued.push_back(s);
+    std::shuffle(queued.begin(), queued.end(), rng);
+    queued.resize(std::min(queued.size(), (size_t) 1000));
+
+    for (auto & step : queued) {
+        std::set<Build::ptr> builds2;
+        std::set<Step::ptr> steps2;
+        auto start = clock::now();
+        getDependents(step, builds2, steps2);
+        dependents.add(clock::now() - start);
+    }
+    queued.clear();
+
+    for (auto & build : builds) {
+        size_t n = 0;
+        auto start = clock::now();
+        visitDependencies([&](Step::ptr step) { n++; }, build->toplevel);
+        visit.add(clock::now() - start);
+    }
+
+    /* Dispatch until everything has been built. */
+    state.onDispatch = [&](State::MachineReservation::ptr reservation) {
+        dispatched.push_back(reservation);
+    };
+
+    size_t nrDispatched = 0;
+    while (true) {
+        auto start = clock::now();
+        state.doDispatch();
+        dispatch.add(clock::now() - start);
+
+        if (dispatched.empty()) break;
+        nrDispatched += dispatched.size();
+
+        auto reservations = std::move(dispatched);
+        dispatched.clear();
+        for (auto & reservation : reservations)
+            finishStep(reservation->step);
+    }
+
+    state.onDispatch = nullptr;
+
+    auto left = state.runnable.lock()->size();
+    if (left)
+        printError("warning: %d runnable steps could not be dispatched", left);
+
+    double dispatchTime = dispatch.total() / 1e6;
+
+    builds.clear();
+    levels.clear();
+    derivations.clear();
+
+    return {
+        {"params", {
+            {"builds", params.builds},
+            {"width", params.width},
+            {"depth", params.depth},
+            {"fan_in", params.fanIn},
+            {"systems", systems.size()},
+            {"jobsets", jobsets.size()},
+            {"max_shares", params.maxShares},
+            {"machines", params.machines},
+            {"max_jobs", params.maxJobs},
+            {"seed", params.seed},
+        }},
+        {"steps", nrSteps},
+        {"steps_dispatched", nrDispatched},
+        {"steps_dispatched_per_sec", dispatchTime > 0 ? nrDispatched / dispatchTime : 0.0},
+        {"peak_rss_kib_loaded", memoryLoaded},
+        {"peak_rss_kib", peakMemory()},
+        {"ops", {
+            {"parse_machines", parse.summary()},
+            {"load_build", load.summary()},
+            {"propagate_priorities", propagate.summary()},
+            {"get_dependents", dependents.summary()},
+            {"visit_dependencies", visit.summary()},
+            {"dispatch", dispatch.summary()},
+        }},
+    };
+}
+
+
+/* Compare ‘result’ with an earlier result. Returns false if
+   throughput or memory got worse by more than ‘tolerance’. */
+static bool compare(const json & baseline, const json & result, double tolerance)
+{
+    bool ok = true;
+
+    if (baseline["params"] != result["params"])
+        printError("warning: the baseline was measured with different parameters");
+
+    auto report = [&](const std::string & name, double before, double after, bool higherIsBetter) {
+        double change = before ? (after - before) / before : 0;
+        bool worse = higherIsBetter ? change < -tolerance : change > tolerance;
+        std::cout << fmt("%-40s %14.1f %14.1f %+8.1f%%%s\n",
+            name, before, after, change * 100, worse ? "  REGRESSION" : "");
+        return !worse;
+    };
+
+    std::cout << fmt("%-40s %14s %14s %9s\n", "", "baseline", "current", "change");
+
+    ok &= report("steps_dispatched_per_sec",
+        baseline["steps_dispatched_per_sec"], result["steps_dispatched_per_sec"], true);
+    ok &= report("peak_rss_kib", baseline["peak_rss_kib"], result["peak_rss_kib"], false);
+
+    /* Latencies are too noisy to fail on, so they're informational. */
+    for (auto & [op, summary] : result["ops"].items())
+        if (baseline["ops"].contains(op))
+            for (auto key : {"p50_us", "p99_us"})
+                report(op + "." + key, baseline["ops"][op][key], summary[key], false);
+
+    return ok;
+}
+
+
+int main(int argc, char * * argv)
+{
+    return handleExceptions(argv[0], [&]() {
+        initNix();
+
+        QueueRunnerBench::Params params;
+        std::optional<Path> outputFile, baselineFile;
+        double tolerance = 0.1;
+
+        auto getSize = [&](Strings::iterator & arg, const Strings::iterator & end) {
+            auto name = *arg;
+            if (auto n = string2Int<size_t>(getArg(name, arg, end)))
+                return *n;
+            throw UsageError("‘%s’ requires a number", name);
+        };
+
+        parseCmdLine(argc, argv, [&](Strings::iterator & arg, const Strings::iterator & end) {
+            if (*arg == "--builds")
+                params.builds = getSize(arg, end);
+            else if (*arg == "--width")
+                params.width = getSize(arg, end);
+            else if (*arg == "--depth")
+                params.depth = getSize(arg, end);
+            else if (*arg == "--fan-in")
+                params.fanIn = getSize(arg, end);
+            else if (*arg == "--systems")
+                params.systems = getSize(arg, end);
+            else if (*arg == "--jobsets")
+                params.jobsets = getSize(arg, end);
+            else if (*arg == "--max-shares")
+                params.maxShares = getSize(arg, end);
+            else if (*arg == "--machines")
+                params.machines = getSize(arg, end);
+            else if (*arg == "--max-jobs")
+                params.maxJobs = getSize(arg, end);
+            else if (*arg == "--seed")
+                params.seed = getSize(arg, end);
+            else if (*arg == "--output")
+                outputFile = getArg(*arg, arg, end);
+            else if (*arg == "--baseline")
+                baselineFile = getArg(*arg, arg, end);
+            else if (*arg == "--tolerance")
+                tolerance = getSize(arg, end) / 100.0;
+            else
+                return false;
+            return true;
+        });
+
+        /* The State constructor wants a Hydra data directory, and
+           reads the scheduler settings from hydra.conf, so those in
+           $HYDRA_CONFIG apply. Unsupported steps must never be
+           aborted, since that needs the database. */
+        Path tmpDir = createTempDir("", "hydra-bench");
+        AutoDelete cleanup(tmpDir, true);
+        Path configFile = tmpDir + "/hydra.conf";
+        std::string config = fmt("gc_roots_dir = %s/gcroots\nmax_unsupported_time = 1000000000\n", tmpDir);
+        if (auto existing = getEnv("HYDRA_CONFIG"); existing && pathExists(*existing))
+            config = readFile(*existing) + "\n" + config;
+        writeFile(configFile, config);
+        setenv("HYDRA_CONFIG", configFile.c_str(), 1);
+        if (!getEnv("HYDRA_DATA")) setenv("HYDRA_DATA", tmpDir.c_str(), 1);
+        if (!getEnv("LOGNAME")) setenv("LOGNAME", "hydra", 1);
+
+        State state{std::nullopt};
+        QueueRunnerBench bench(state, params);
+        auto result = bench.run();
+
+        if (outputFile)
+            writeFile(*outputFile, result.dump(2) + "\n");
+
+        if (baselineFile) {
+            if (!compare(json::parse(readFile(*baselineFile)), result, tolerance))
+                throw Exit(1);
+        } else
+            std::cout << result.dump(2) << "\n";
+    });
+}
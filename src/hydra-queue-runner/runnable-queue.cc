@@ -0,0 +1,331 @@
+#include <algorithm>
+
+#include "state.hh"
+
+using namespace nix;
+
+
+/* Return the partition of a step. Steps in the same partition can be
+   built by exactly the same machines (see Machine::supports()). This
+   is the system type, except that steps that only have the "local"
+   feature because of preferLocalBuild are kept apart from steps that
+   explicitly require it. */
+static std::string partitionOf(const Step & step)
+{
+    auto & type(*step.type);
+    return type.preferLocalBuild && !type.requiredSystemFeatures.count("local")
+        ? type.systemType + " (preferLocalBuild)"
+        : type.systemType;
+}
+
+
+void RunnableQueue::matchMachines(Partition & partition)
+{
+    partition.machines.clear();
+    for (auto & machine : machines)
+        if (machine->supports(partition.platform, partition.requiredSystemFeatures, partition.preferLocalBuild))
+            partition.machines.insert(machine.get());
+}
+
+
+void RunnableQueue::readKey(Entry & entry, Step::ptr step)
+{
+    auto step_(step->state.lock());
+    entry.globalPriority = step_->highestGlobalPriority;
+    entry.key = Key {
+        .localPriority = step_->highestLocalPriority,
+        .criticalPath = step_->criticalPath,
+        .lowestBuildID = step_->lowestBuildID,
+        .step = step.get(),
+    };
+    entry.jobsets.assign(step_->jobsets.begin(), step_->jobsets.end());
+}
+
+
+void RunnableQueue::file(Entry & entry)
+{
+    auto & buckets(entry.partition->second.ready[entry.globalPriority]);
+    if (entry.jobsets.empty())
+        buckets[nullptr].insert(entry.key);
+    else
+        for (auto & jobset : entry.jobsets)
+            buckets[jobset].insert(entry.key);
+}
+
+
+void RunnableQueue::unfile(Entry & entry)
+{
+    auto & ready(entry.partition->second.ready);
+    auto i = ready.find(entry.globalPriority);
+    assert(i != ready.end());
+
+    auto unfileFrom = [&](const Jobset::ptr & jobset) {
+        auto j = i->second.find(jobset);
+        assert(j != i->second.end());
+        j->second.erase(entry.key);
+        if (j->second.empty()) i->second.erase(j);
+    };
+
+    if (entry.jobsets.empty())
+        unfileFrom(nullptr);
+    else
+        for (auto & jobset : entry.jobsets)
+            unfileFrom(jobset);
+
+    if (i->second.empty()) ready.erase(i);
+}
+
+
+void RunnableQueue::erase(Step * step)
+{
+    auto i = entries.find(step);
+    if (i == entries.end()) return;
+    auto & entry(i->second);
+
+    if (entry.waiting)
+        waiting.erase({entry.after, step});
+    else
+        unfile(entry);
+
+    entry.partition->second.steps.erase(step);
+    if (entry.partition->second.steps.empty())
+        partitions.erase(entry.partition);
+
+    auto j = perType.find(entry.systemType);
+    assert(j != perType.end() && j->second.count);
+    j->second.runnableSinceSum -= std::chrono::system_clock::to_time_t(entry.runnableSince);
+    if (--j->second.count == 0) perType.erase(j);
+
+    entries.erase(i);
+}
+
+
+void RunnableQueue::push(Step::ptr step)
+{
+    auto i = entries.find(step.get());
+    if (i != entries.end()) {
+        if (i->second.step.lock() == step) return;
+        /* A stale entry of a destroyed step at the same address. */
+        erase(step.get());
+    }
+
+    Entry entry;
+    entry.step = step;
+    entry.systemType = step->type->systemType;
+
+    auto [partition, isNew] = partitions.try_emplace(partitionOf(*step));
+    if (isNew) {
+        partition->second.platform = step->type->platform;
+        partition->second.requiredSystemFeatures = step->type->requiredSystemFeatures;
+        partition->second.preferLocalBuild = step->type->preferLocalBuild;
+        matchMachines(partition->second);
+    }
+    partition->second.steps.insert(step.get());
+    entry.partition = partition;
+
+    {
+        auto now = std::chrono::system_clock::now();
+        auto step_(step->state.lock());
+        entry.runnableSince = step_->runnableSince;
+        if (step_->tries > 0 && step_->after > now) {
+            entry.waiting = true;
+            entry.after = step_->after;
+        }
+        if (!partition->second.machines.empty())
+            step_->lastSupported = now;
+    }
+
+    if (entry.waiting)
+        waiting.emplace(entry.after, step.get());
+    else {
+        readKey(entry, step);
+        file(entry);
+    }
+
+    auto & stats(perType[entry.systemType]);
+    stats.count++;
+    stats.runnableSinceSum += std::chrono::system_clock::to_time_t(entry.runnableSince);
+
+    entries.emplace(step.get(), std::move(entry));
+}
+
+
+void RunnableQueue::update(Step::ptr step)
+{
+    auto i = entries.find(step.get());
+    if (i == entries.end() || i->second.step.lock() != step) return;
+    auto & entry(i->second);
+
+    /* Waiting steps get their key when they're promoted. */
+    if (entry.waiting) return;
+
+    unfile(entry);
+    readKey(entry, step);
+    file(entry);
+}
+
+
+bool RunnableQueue::remove(Step::ptr step)
+{
+    auto i = entries.find(step.get());
+    if (i == entries.end()) return false;
+    bool present = i->second.step.lock() == step;
+    erase(step.get());
+    return present;
+}
+
+
+system_time RunnableQueue::promote(system_time now)
+{
+    while (!waiting.empty()) {
+        auto i = waiting.begin();
+        if (i->first > now) return i->first;
+
+        auto & entry(entries.at(i->second));
+
+        auto step = entry.step.lock();
+        if (!step) {
+            erase(i->second);
+            continue;
+        }
+
+        waiting.erase(i);
+        entry.waiting = false;
+        readKey(entry, step);
+        file(entry);
+    }
+
+    return system_time::max();
+}
+
+
+Step::ptr RunnableQueue::pop(Machine::ptr machine)
+{
+    std::vector<Partition *> supported;
+    std::set<int, std::greater<int>> priorities;
+
+    for (auto & [name, partition] : partitions)
+        if (!partition.ready.empty() && partition.machines.count(machine.get())) {
+            supported.push_back(&partition);
+            for (auto & [globalPriority, buckets] : partition.ready)
+                priorities.insert(globalPriority);
+        }
+
+    Step::ptr found;
+    std::vector<Step *> dead;
+
+    for (auto globalPriority : priorities) {
+
+        /* Merge the per-jobset buckets of all supported partitions in
+           order of ascending share used, then by the per-step
+           key. Take a snapshot of the shares so that the ordering is
+           consistent while we're merging. */
+        struct Cursor
+        {
+            double shareUsed;
+            std::set<Key>::const_iterator cur, end;
+        };
+
+        auto worse = [](const Cursor & a, const Cursor & b) {
+            return
+                a.shareUsed != b.shareUsed ? a.shareUsed > b.shareUsed :
+                *b.cur < *a.cur;
+        };
+
+        std::vector<Cursor> heap;
+        for (auto partition : supported) {
+            auto i = partition->ready.find(globalPriority);
+            if (i == partition->ready.end()) continue;
+            for (auto & [jobset, keys] : i->second)
+                heap.push_back({jobset ? jobset->shareUsed() : 1e9, keys.begin(), keys.end()});
+        }
+        std::make_heap(heap.begin(), heap.end(), worse);
+
+        /* Steps that belong to multiple jobsets are visited once for
+           every jobset. */
+        std::unordered_set<Step *> seen;
+
+        while (!heap.empty()) {
+            std::pop_heap(heap.begin(), heap.end(), worse);
+            auto & cursor(heap.back());
+            auto key = *cursor.cur;
+            if (++cursor.cur == cursor.end)
+                heap.pop_back();
+            else
+                std::push_heap(heap.begin(), heap.end(), worse);
+
+            if (!seen.insert(key.step).second) continue;
+
+            found = entries.at(key.step).step.lock();
+            if (found) break;
+            dead.push_back(key.step);
+        }
+
+        if (found) break;
+    }
+
+    for (auto step : dead)
+        erase(step);
+
+    if (found) erase(found.get());
+
+    return found;
+}
+
+
+void RunnableQueue::setMachines(const std::vector<Machine::ptr> & machines)
+{
+    this->machines = machines;
+    for (auto & [name, partition] : partitions)
+        matchMachines(partition);
+}
+
+
+std::vector<std::pair<Step::ptr, system_time>> RunnableQueue::unsupported(system_time now)
+{
+    std::vector<std::pair<Step::ptr, system_time>> res;
+
+    for (auto & [name, partition] : partitions) {
+        if (!partition.machines.empty()) {
+            partition.lastSupported = now;
+            continue;
+        }
+        for (auto & ptr : partition.steps)
+            if (auto step = entries.at(ptr).step.lock())
+                res.emplace_back(step, partition.lastSupported);
+    }
+
+    return res;
+}
+
+
+std::vector<Step::ptr> RunnableQueue::steps()
+{
+    std::vector<Step::ptr> res;
+    std::vector<Step *> dead;
+    res.reserve(entries.size());
+
+    for (auto & [ptr, entry] : entries) {
+        if (auto step = entry.step.lock())
+            res.push_back(step);
+        else
+            dead.push_back(ptr);
+    }
+
+    for (auto step : dead)
+        erase(step);
+
+    return res;
+}
+
+
+void RunnableQueue::prune()
+{
+    std::vector<Step *> dead;
+
+    for (auto & [ptr, entry] : entries)
+        if (entry.step.expired()) dead.push_back(ptr);
+
+    for (auto step : dead)
+        erase(step);
+}
@@ -3,13 +3,22 @@
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
 #include <map>
 #include <memory>
 #include <queue>
 #include <regex>
+#include <set>
+#include <tuple>
+#include <unordered_map>
+#include <unordered_set>
 
+#include <prometheus/collectable.h>
 #include <prometheus/counter.h>
 #include <prometheus/gauge.h>
+#include <prometheus/histogram.h>
 #include <prometheus/registry.h>
 
 #include "db.hh"
@@ -21,6 +30,12 @@
 #include "store-api.hh"
 #include "sync.hh"
 #include "nar-extractor.hh"
+#include "derivation-cache.hh"
+#include "closure-size-cache.hh"
+#include "log-compressor.hh"
+#include "tracing.hh"
+#include "path-filter.hh"
+#include "worker-pool.hh"
 
 
 typedef unsigned int BuildID;
@@ -74,6 +89,9 @@ struct RemoteResult
     unsigned int overhead = 0;
     nix::Path logFile;
 
+    /* The writer of ‘logFile’, if it's compressed on the fly. */
+    std::shared_ptr<LogCompressor::Log> log;
+
     BuildStatus buildStatus() const
     {
         return stepStatus == bsCachedFailure ? bsFailed : stepStatus;
@@ -102,6 +120,10 @@ private:
     /* The start time and duration of the most recent build steps. */
     nix::Sync<std::map<time_t, time_t>> steps;
 
+    /* The sum of the durations in ‘steps’. Only updated while
+       holding its lock. */
+    std::atomic<time_t> stepSeconds{0};
+
 public:
 
     double shareUsed()
@@ -117,6 +139,10 @@ public:
 
     time_t getSeconds() { return seconds; }
 
+    /* The average duration of the build steps in the scheduling
+       window, if any. */
+    std::optional<double> averageStepTime();
+
     void addStep(time_t startTime, time_t duration);
 
     void pruneSteps();
@@ -143,6 +169,11 @@ struct Build
 
     std::atomic_bool finishedInDB{false};
 
+    /* Whether an update marking this build as finished has been
+       queued (see State::queueDbUpdate()). ‘finishedInDB’ is only
+       set once it has been committed. */
+    std::atomic_bool finishQueued{false};
+
     Build(nix::StorePath && drvPath) : drvPath(std::move(drvPath))
     { }
 
@@ -151,7 +182,32 @@ struct Build
         return projectName + ":" + jobsetName + ":" + jobName;
     }
 
-    void propagatePriorities();
+    /* Propagate the priorities of this build to all its steps.
+       Return the steps whose scheduling key changed. */
+    std::vector<std::shared_ptr<Step>> propagatePriorities();
+};
+
+
+/* The properties of a step that determine which machines can build
+   it. There are only a few distinct combinations of these, so steps
+   refer to a shared, interned instance rather than having their own
+   copies. */
+struct StepType
+{
+    std::string platform;
+    std::set<std::string> requiredSystemFeatures;
+    bool preferLocalBuild;
+    std::string systemType; // concatenation of platform and requiredSystemFeatures
+
+    bool operator < (const StepType & other) const
+    {
+        return std::tie(platform, requiredSystemFeatures, preferLocalBuild)
+            < std::tie(other.platform, other.requiredSystemFeatures, other.preferLocalBuild);
+    }
+
+    /* Return the interned instance equal to ‘type’. Interned
+       instances are never freed. */
+    static const StepType * intern(StepType && type);
 };
 
 
@@ -161,20 +217,35 @@ struct Step
     typedef std::weak_ptr<Step> wptr;
 
     nix::StorePath drvPath;
-    std::unique_ptr<nix::Derivation> drv;
-    std::unique_ptr<nix::ParsedDerivation> parsedDrv;
-    std::set<std::string> requiredSystemFeatures;
-    bool preferLocalBuild;
+
+    /* The derivation, shared with ‘State::drvCache’. If
+       ‘State::compactSteps’ is set, this is dropped once the step
+       has been created; use State::getStepDerivation() to get it. */
+    std::shared_ptr<nix::Derivation> drv;
+
+    const StepType * type = nullptr;
     bool isDeterministic;
-    std::string systemType; // concatenation of drv.platform and requiredSystemFeatures
+
+    /* The expected build time in seconds, if duration-aware
+       scheduling is enabled and the derivation has been built
+       before. */
+    float estimatedDuration = 0;
+
+    /* The PathFilter hashes of the input derivations, to find
+       machines that have recently built them without looking at the
+       derivation. Only set if ‘State::localityAwareDispatch’ is. */
+    std::vector<uint64_t> inputHashes;
 
     struct State
     {
         /* Whether the step has finished initialisation. */
         bool created = false;
 
-        /* The build steps on which this step depends. */
-        std::set<Step::ptr> deps;
+        /* The build steps on which this step depends. A vector
+           rather than a set, since there are usually few (and no
+           duplicate) dependencies and a set node costs several times
+           as much memory. */
+        std::vector<Step::ptr> deps;
 
         /* The build steps that depend on this step. */
         std::vector<Step::wptr> rdeps;
@@ -184,7 +255,7 @@ struct Step
 
         /* Jobsets to which this step belongs. Used for determining
            scheduling priority. */
-        std::set<Jobset::ptr> jobsets;
+        std::vector<Jobset::ptr> jobsets;
 
         /* Number of times we've tried this step. */
         unsigned int tries = 0;
@@ -203,6 +274,19 @@ struct Step
         /* The lowest ID of any build depending on this step. */
         BuildID lowestBuildID{std::numeric_limits<BuildID>::max()};
 
+        /* One of the builds that depend on this step, so that
+           starting a step doesn't require a getDependents() walk.
+           Set by createSteps() to the build with the lowest ID that
+           reached this step, and by doBuildStep() after a walk. It
+           is not cleared when the build finishes or is cancelled,
+           so users must check that it is still in State::builds. */
+        Build::wptr representativeBuild;
+
+        /* The estimated duration of the longest chain of steps
+           starting with this step and ending in a top-level step
+           (see updateCriticalPaths()). */
+        float criticalPath = 0;
+
         /* The time at which this step became runnable. */
         system_time runnableSince;
 
@@ -230,6 +314,11 @@ void getDependents(Step::ptr step, std::set<Build::ptr> & builds, std::set<Step:
 /* Call ‘visitor’ for a step and all its dependencies. */
 void visitDependencies(std::function<void(Step::ptr)> visitor, Step::ptr step);
 
+/* Recompute the critical path weight of ‘roots’ and all their
+   dependencies from the weights of their dependents. Return the
+   steps whose weight changed. */
+std::vector<Step::ptr> updateCriticalPaths(const std::vector<Step::ptr> & roots);
+
 
 struct Machine
 {
@@ -261,15 +350,73 @@ struct Machine
         /* Mutex to prevent multiple threads from sending data to the
            same machine (which would be inefficient). */
         std::timed_mutex sendLock;
+
+        /* The SSH master connection through which all sessions to
+           this machine are multiplexed. Sessions hold a reference to
+           it, so a master that gets replaced (e.g. after a connection
+           failure) stays alive until its sessions are done. A master
+           is stored here as soon as it is being started, so that
+           other threads wait for it rather than start their own. */
+        struct SshMaster
+        {
+            std::weak_ptr<State> machineState;
+            nix::Path tmpDir;
+            nix::AutoDelete tmpDirDel;
+            nix::Path socketPath, logFile;
+            nix::Pid pid;
+            time_t startedAt;
+            bool compress = false;
+
+            /* Becomes ready when the master has started (or failed
+               to). ‘pid’ may only be used after that. */
+            std::promise<void> startedPromise;
+            std::shared_future<void> started = startedPromise.get_future().share();
+
+            SshMaster(std::weak_ptr<State> machineState)
+                : machineState(machineState)
+                , tmpDir(nix::createTempDir()), tmpDirDel(tmpDir, true)
+                , socketPath(tmpDir + "/ssh.sock"), logFile(tmpDir + "/ssh.log")
+                , startedAt(time(0)) { }
+
+            /* Stops the master and records the number of bytes it
+               transferred. */
+            ~SshMaster();
+        };
+        nix::Sync<std::shared_ptr<SshMaster>> sshMaster;
+
+        counter nrConnections{0}; // sessions opened to this machine
+        counter nrConnectionsReused{0}; // sessions that reused the SSH master
+        counter totalConnectTimeMs{0}; // connection setup, including the handshake
+        counter bytesSent{0};
+        counter bytesReceived{0};
+        counter totalCopyToTimeMs{0}; // time spent sending input closures
+        counter totalCopyFromTimeMs{0}; // time spent receiving outputs
+
+        /* The bytes that went over the wire for machines that use
+           compression, as reported by SSH when a master exits. */
+        counter bytesSentCompressed{0};
+        counter bytesReceivedCompressed{0};
+
+        /* Derivations whose outputs were recently built on or sent
+           to this machine, used to dispatch steps to machines that
+           already have their inputs. */
+        nix::Sync<PathFilter> recentOutputs;
     };
 
     State::ptr state;
 
     bool supportsStep(Step::ptr step)
+    {
+        return supports(step->type->platform, step->type->requiredSystemFeatures, step->type->preferLocalBuild);
+    }
+
+    bool supports(const std::string & platform,
+        const std::set<std::string> & requiredSystemFeatures,
+        bool preferLocalBuild)
     {
         /* Check that this machine is of the type required by the
            step. */
-        if (!systemTypes.count(step->drv->platform == "builtin" ? nix::settings.thisSystem : step->drv->platform))
+        if (!systemTypes.count(platform == "builtin" ? nix::settings.thisSystem : platform))
             return false;
 
         /* Check that the step requires all mandatory features of this
@@ -280,13 +427,13 @@ struct Machine
            "local" as a mandatory feature will only do
            preferLocalBuild steps. */
         for (auto & f : mandatoryFeatures)
-            if (!step->requiredSystemFeatures.count(f)
-                && !(f == "local" && step->preferLocalBuild))
+            if (!requiredSystemFeatures.count(f)
+                && !(f == "local" && preferLocalBuild))
                 return false;
 
         /* Check that the machine supports all features required by
            the step. */
-        for (auto & f : step->requiredSystemFeatures)
+        for (auto & f : requiredSystemFeatures)
             if (!supportedFeatures.count(f)) return false;
 
         return true;
@@ -297,6 +444,223 @@ struct Machine
         std::regex r("^(ssh://|ssh-ng://)?localhost$");
         return std::regex_search(sshName, r);
     }
+
+    /* Whether this machine has the same configuration (i.e. machines
+       file entry) as ‘other’. */
+    bool sameConfig(const Machine & other) const
+    {
+        return
+            enabled == other.enabled &&
+            sshName == other.sshName &&
+            sshKey == other.sshKey &&
+            systemTypes == other.systemTypes &&
+            supportedFeatures == other.supportedFeatures &&
+            mandatoryFeatures == other.mandatoryFeatures &&
+            maxJobs == other.maxJobs &&
+            speedFactor == other.speedFactor &&
+            sshPublicHostKey == other.sshPublicHostKey;
+    }
+};
+
+
+/* Parse the machines file ‘contents’ into ‘newMachines’. Machines
+   whose configuration didn't change keep their Machine object from
+   ‘oldMachines’; changed machines get its state. Machines that are
+   no longer listed are kept in disabled form, so that their stats are
+   maintained. Return whether anything changed. */
+bool parseMachines(const std::string & contents,
+    const std::map<std::string, Machine::ptr> & oldMachines,
+    std::map<std::string, Machine::ptr> & newMachines);
+
+
+/* The runnable steps (i.e. steps that have no unbuilt
+   dependencies), ordered by scheduling priority. Priority is
+   established as follows (in order of precedence):
+
+   - The global priority of the builds that depend on the step. This
+     allows admins to bump a build to the front of the queue.
+
+   - The lowest used scheduling share of the jobsets depending on the
+     step.
+
+   - The local priority of the build, as set via the build's
+     meta.schedulingPriority field. Note that this is not quite
+     correct: the local priority should only be used to establish
+     priority between builds in the same jobset, but here it's used
+     between steps in different jobsets if they happen to have the
+     same lowest used scheduling share. But that's not very likely.
+
+   - The lowest ID of the builds depending on the step; i.e. older
+     builds take priority over new ones.
+
+   Steps are partitioned by system type. For every partition we
+   keep track of the machines that can build it (recomputed when the
+   machines file is reloaded), so the dispatcher only looks at the
+   partitions that a machine supports. Within a partition, steps are
+   bucketed by global priority and then by jobset, and each bucket is
+   kept sorted by local priority and build ID. Since all steps of a
+   jobset have the same share used, the share is not part of the
+   per-step key: the per-jobset buckets are merged on the fly when
+   looking for a step. So inserting, removing or re-keying a step is
+   O(lg n), and changes to jobset shares cost nothing. */
+class RunnableQueue
+{
+public:
+
+    /* Statistics per step type for the auto-scaler. */
+    struct TypeStats
+    {
+        unsigned int count{0};
+
+        /* Sum of the runnableSince times (in seconds since the
+           epoch) of the steps of this type, so that the total wait
+           time can be computed without visiting every step. */
+        int64_t runnableSinceSum{0};
+    };
+
+    /* Add a step. If the step is waiting to be retried, it only
+       becomes eligible for dispatching after it has been promoted
+       by promote(). */
+    void push(Step::ptr step);
+
+    /* Re-read the scheduling key of a step (e.g. after
+       Build::propagatePriorities()). This is a no-op if the step is
+       not queued. */
+    void update(Step::ptr step);
+
+    /* Remove a step. Return false if it wasn't queued. */
+    bool remove(Step::ptr step);
+
+    /* Make all steps whose retry time has passed eligible for
+       dispatching. Return the earliest retry time of the remaining
+       waiting steps. */
+    system_time promote(system_time now);
+
+    /* Remove and return the highest priority eligible step that
+       ‘machine’ can build, or nullptr if there is none. */
+    Step::ptr pop(Machine::ptr machine);
+
+    /* Set the machines against which partitions are matched. */
+    void setMachines(const std::vector<Machine::ptr> & machines);
+
+    /* Return the steps that no machine can build, together with the
+       last time at which some machine could build steps of that
+       type. */
+    std::vector<std::pair<Step::ptr, system_time>> unsupported(system_time now);
+
+    /* Return all (live) queued steps. */
+    std::vector<Step::ptr> steps();
+
+    /* Forget about steps that have been destroyed (i.e. steps that
+       were cancelled). */
+    void prune();
+
+    size_t size() const { return entries.size(); }
+
+    const std::map<std::string, TypeStats> & typeStats() const { return perType; }
+
+private:
+
+    struct Key
+    {
+        int localPriority;
+        float criticalPath;
+        BuildID lowestBuildID;
+        Step * step;
+
+        bool operator < (const Key & other) const
+        {
+            return
+                localPriority != other.localPriority ? localPriority > other.localPriority :
+                criticalPath != other.criticalPath ? criticalPath > other.criticalPath :
+                lowestBuildID != other.lowestBuildID ? lowestBuildID < other.lowestBuildID :
+                step < other.step;
+        }
+    };
+
+    /* Eligible steps, by descending global priority, then jobset. A
+       step that belongs to multiple jobsets is filed under each of
+       them. Steps without a jobset are filed under nullptr. */
+    typedef std::map<Jobset::ptr, std::set<Key>> JobsetBuckets;
+    typedef std::map<int, JobsetBuckets, std::greater<int>> Ready;
+
+    struct Partition
+    {
+        /* The properties that determine which machines can build the
+           steps in this partition. */
+        std::string platform;
+        std::set<std::string> requiredSystemFeatures;
+        bool preferLocalBuild;
+
+        /* The machines that can build the steps in this partition. */
+        std::set<Machine *> machines;
+
+        /* The last time we saw a machine that can build the steps in
+           this partition. */
+        system_time lastSupported;
+
+        std::unordered_set<Step *> steps;
+
+        Ready ready;
+    };
+
+    typedef std::map<std::string, Partition> Partitions;
+    Partitions partitions;
+
+    std::vector<Machine::ptr> machines;
+
+    struct Entry
+    {
+        Step::wptr step;
+        std::string systemType;
+        Partitions::iterator partition;
+        system_time runnableSince;
+
+        /* Whether the step is waiting to be retried after ‘after’. */
+        bool waiting = false;
+        system_time after;
+
+        /* The key under which the step is filed in its partition. */
+        int globalPriority = 0;
+        Key key;
+        std::vector<Jobset::ptr> jobsets;
+    };
+
+    /* Note: steps are indexed by address, but the address of a
+       destroyed step can be reused, so entries must always be
+       checked against their weak pointer. */
+    std::unordered_map<Step *, Entry> entries;
+
+    /* Steps waiting to be retried, by retry time. */
+    std::set<std::pair<system_time, Step *>> waiting;
+
+    std::map<std::string, TypeStats> perType;
+
+    void readKey(Entry & entry, Step::ptr step);
+
+    void file(Entry & entry);
+
+    void unfile(Entry & entry);
+
+    void erase(Step * step);
+
+    void matchMachines(Partition & partition);
+};
+
+
+/* A connection to ‘nix-store --serve’ on a build machine. */
+struct RemoteConnection
+{
+    std::shared_ptr<Machine::State::SshMaster> master;
+    nix::Path tmpDir;
+    nix::AutoDelete tmpDirDel;
+    nix::Pid pid;
+    nix::AutoCloseFD toFD, fromFD;
+    nix::FdSink to;
+    nix::FdSource from;
+    unsigned int remoteVersion = 0;
+
+    RemoteConnection() : tmpDir(nix::createTempDir()), tmpDirDel(tmpDir, true) { }
 };
 
 
@@ -313,8 +677,16 @@ private:
     const unsigned int maxTries = 5;
     const unsigned int retryInterval = 60; // seconds
     const float retryBackoff = 3.0;
+    /* The number of sessions used to send or receive independent
+       paths of a closure concurrently. */
     const unsigned int maxParallelCopyClosure = 4;
 
+    /* Threads that drive the extra sessions of closure copies. Steps
+       share them, so the number of extra sessions across all
+       machines is bounded. */
+    WorkerPool copyPool{"copy"};
+    size_t nrCopyThreads;
+
     /* Time in seconds before unsupported build steps are aborted. */
     const unsigned int maxUnsupportedTime = 0;
 
@@ -338,8 +710,7 @@ private:
     nix::Sync<Steps> steps;
 
     /* Build steps that have no unbuilt dependencies. */
-    typedef std::list<Step::wptr> Runnable;
-    nix::Sync<Runnable> runnable;
+    nix::Sync<RunnableQueue> runnable;
 
     /* CV for waking up the dispatcher. */
     nix::Sync<bool> dispatcherWakeup;
@@ -348,11 +719,35 @@ private:
     /* PostgreSQL connection pool. */
     nix::Pool<Connection> dbPool;
 
+    /* Connections to an optional read-only replica of the database
+       ($HYDRA_DBI_REPLICA), for readFromReplica(). */
+    std::unique_ptr<nix::Pool<Connection>> replicaPool;
+
+    /* Reads go to the primary while the replica lags behind it by
+       more than this many seconds. */
+    unsigned int maxReplicaLag;
+
+    /* The lag of the replica as last measured by replicaMonitor(),
+       in seconds. */
+    std::atomic<double> replicaLag{0};
+
     /* The build machines. */
     std::mutex machinesReadyLock;
     typedef std::map<std::string, Machine::ptr> Machines;
     nix::Sync<Machines> machines; // FIXME: use atomic_shared_ptr
 
+    /* The sources of the machines list: the contents of the machines
+       files, and machines added through ‘machines_update’
+       notifications (as machines file lines, indexed by machine
+       name), which take precedence. The lock also serialises calls
+       to parseMachines(). */
+    struct MachinesSources
+    {
+        std::string files;
+        std::map<std::string, std::string> extra;
+    };
+    nix::Sync<MachinesSources> machinesSources;
+
     /* Various stats. */
     time_t startedAt;
     counter nrBuildsRead{0};
@@ -375,6 +770,14 @@ private:
     counter bytesSent{0};
     counter bytesReceived{0};
     counter nrActiveDbUpdates{0};
+    counter nrConnections{0};
+    counter nrConnectionsReused{0};
+    counter totalConnectTimeMs{0};
+    counter nrLogsUploaded{0};
+    counter nrLogUploadRetries{0};
+    counter nrLogUploadFailures{0};
+    counter nrFailedPathChecks{0};
+    counter nrFailedPathQueries{0};
 
     /* Specific build to do for --build-one (testing only). */
     BuildID buildOne;
@@ -396,6 +799,9 @@ private:
         State & state;
         Step::ptr step;
         Machine::ptr machine;
+        /* When the step became runnable and when it was assigned to
+           this machine, for tracing. */
+        system_time runnableSince, reservedAt = std::chrono::system_clock::now();
         MachineReservation(State & state, Step::ptr step, Machine::ptr machine);
         ~MachineReservation();
     };
@@ -403,6 +809,7 @@ private:
     struct ActiveStep
     {
         Step::ptr step;
+        system_time startTime = std::chrono::system_clock::now();
 
         struct State
         {
@@ -415,6 +822,107 @@ private:
 
     nix::Sync<std::set<std::shared_ptr<ActiveStep>>> activeSteps_;
 
+    /* The state of a build step that is in progress. It's passed
+       between builder threads: the step is parked in the step waiter
+       while the remote machine is building it, so that waiting for
+       the result doesn't tie up a thread. */
+    struct StepRun
+    {
+        typedef std::shared_ptr<StepRun> ptr;
+        State & state;
+        MachineReservation::ptr reservation;
+        std::shared_ptr<ActiveStep> activeStep;
+
+        BuildID buildId = 0;
+        std::optional<nix::StorePath> buildDrvPath;
+        unsigned int maxSilentTime = 0, buildTimeout = 0, repeats = 0;
+
+        unsigned int stepNr = 0;
+        bool stepFinished = false;
+        time_t stepStartTime = 0;
+        RemoteResult result;
+        NarMemberDatas narMembers;
+
+        /* The phase of the step that is currently timed for
+           ‘step_phase_seconds’, and when it started. */
+        std::optional<StepState> phase;
+        std::chrono::steady_clock::time_point phaseStart;
+
+        Tracer::Context trace;
+
+        /* The connection to the build machine, if any. */
+        std::unique_ptr<RemoteConnection> remote;
+
+        StepRun(State & state, MachineReservation::ptr reservation)
+            : state(state), reservation(reservation)
+        {
+            trace.id = state.tracer.newId();
+            trace.machine = Tracer::intern(reservation->machine->sshName);
+        }
+        ~StepRun() { closeConnection(); }
+
+        /* Close the connection to the build machine and account
+           for the data transferred. */
+        void closeConnection();
+
+        /* Record the duration of the current phase (if any) and
+           start timing ‘next’. */
+        void enterPhase(std::optional<StepState> next);
+    };
+
+    /* Threads that run the builder steps. */
+    WorkerPool builderPool{"builder"};
+
+    /* Threads that create the steps of new builds. */
+    WorkerPool queuePool{"queue"};
+
+#ifdef HYDRA_QUEUE_RUNNER_BENCH
+    /* If set, doDispatch() hands reservations to this function
+       rather than to a builder thread. Used by the benchmark. */
+    std::function<void(MachineReservation::ptr)> onDispatch;
+#endif
+
+    /* Steps that are waiting for a remote machine to finish
+       building them, indexed by the file descriptor on which the
+       result will arrive. */
+    nix::AutoCloseFD stepWaiterFD;
+    nix::Sync<std::map<int, StepRun::ptr>> parkedSteps;
+
+    /* Database updates that builder threads don't need to wait for
+       are applied asynchronously by a few writer threads, which
+       group pending updates into batched transactions. All updates
+       concerning a build go to the same writer, so they're applied
+       in the order in which they were queued. */
+    typedef std::function<void(pqxx::work &)> DbUpdate;
+
+    /* Called by the writer with true once an update has been
+       committed, or with false if it failed permanently. */
+    typedef std::function<void(bool)> DbUpdateDone;
+
+    struct DbWriter
+    {
+        struct State
+        {
+            std::deque<std::pair<DbUpdate, DbUpdateDone>> pending;
+            uint64_t queued = 0, done = 0;
+        };
+        nix::Sync<State> state_;
+        std::condition_variable wakeup, flushed;
+    };
+
+    std::vector<std::unique_ptr<DbWriter>> dbWriters;
+
+    size_t maxDbWriteBatch;
+
+    counter nrDbUpdatesQueued{0};
+    counter nrDbUpdatesFailed{0};
+    counter nrDbUpdatesInDoubt{0};
+
+    /* Set if builds were dropped from ‘builds’ because they couldn't
+       be marked as finished, so that the queue monitor loads them
+       again. */
+    std::atomic_bool rescanQueue{false};
+
     std::atomic<time_t> lastDispatcherCheck{0};
 
     std::shared_ptr<nix::Store> localStore;
@@ -423,6 +931,55 @@ private:
     size_t maxOutputSize;
     size_t maxLogSize;
 
+    /* The number of threads that perform build steps. Steps that are
+       waiting for a remote build don't take up a thread, so this
+       only bounds the number of concurrent connection setups, closure
+       copies and result processing. */
+    size_t nrBuilderThreads;
+
+    /* The number of threads used by the queue monitor to create the
+       steps of a new build. */
+    size_t nrQueueThreads;
+
+    /* Recently used derivations, to prevent parsing the same .drv
+       files over and over again. */
+    DerivationCache drvCache;
+
+    /* NAR sizes, references and closure sizes of store paths, for
+       computing the closure size of builds. */
+    ClosureSizeCache closureSizes;
+
+    /* Whether to drop the derivations of steps once they've been
+       created, to save memory when there are lots of queued
+       steps. They're reloaded (from ‘drvCache’ or the store) when
+       needed, i.e. when the step is built. */
+    bool compactSteps;
+
+    /* Spans recording where the time of each step went. */
+    Tracer tracer;
+
+    /* Whether to schedule steps on the critical path first, and on
+       the fastest machines. */
+    bool durationAwareScheduling;
+
+    /* Set when steps may have lost dependents, so the critical path
+       weights of all steps need to be recomputed. */
+    std::atomic_bool criticalPathsStale{false};
+
+    /* Whether to prefer machines that already have the inputs of a
+       step among equally loaded machines. */
+    bool localityAwareDispatch;
+
+    /* A moving average of the build time of successful steps,
+       indexed by derivation name without version. It's loaded from
+       BuildSteps on startup and updated as steps finish. */
+    nix::Sync<std::unordered_map<std::string, float>> stepDurations;
+
+    /* The interval in seconds at which the queue monitor checks all
+       queued builds for cancellations and priority bumps. In between,
+       it only looks at the builds listed in notifications. */
+    unsigned int queueResyncInterval;
+
     /* Steps that were busy while we encounted a PostgreSQL
        error. These need to be cleared at a later time to prevent them
        from showing up as busy until the queue runner is restarted. */
@@ -434,6 +991,52 @@ private:
 
     bool uploadLogsToBinaryCache;
 
+    /* A filter of the paths in the FailedPaths table, so that
+       checkCachedFailure() only has to query the database about
+       paths that have probably failed. The queue monitor loads it,
+       and reloads it when paths are deleted from the table (which
+       sends a ‘failed_paths_deleted’ notification) or when it has
+       become full. While it is unset, every check queries the
+       database. */
+    struct FailedPaths
+    {
+        std::optional<PathFilter> filter;
+
+        /* Paths added while the filter is being loaded, if a load
+           is in progress. */
+        std::optional<std::vector<std::string>> added;
+
+        /* Paths whose insertion into FailedPaths hasn't committed
+           yet. They count as failed, since their steps are already
+           gone from ‘steps’. */
+        std::multiset<std::string> pending;
+
+        bool reload = false;
+    };
+    nix::Sync<FailedPaths> failedPaths;
+
+    /* Threads that upload build logs to the binary cache, so that
+       slow uploads don't hold up the steps or their machines. */
+    WorkerPool logUploadPool{"log upload"};
+    size_t nrLogUploadThreads;
+    unsigned int maxLogUploadTries;
+
+    /* Whether build logs are compressed while they're written,
+       rather than afterwards by the CompressLog plugin. */
+    bool compressBuildLogs;
+    size_t nrLogCompressorThreads;
+    LogCompressor logCompressor;
+
+    /* If set, remote machines copy the outputs of their steps to
+       this binary cache themselves, and we only fetch the metadata
+       that we need. The machines must have write access to it (and
+       the signing key, if any). */
+    std::string builderUploadUri;
+
+    /* Whether to hash only the files of incoming NARs that are
+       declared as build products, rather than every file. */
+    bool lazyNarHashing;
+
     /* Where to store GC roots. Defaults to
        /nix/var/nix/gcroots/per-user/$USER/hydra-roots, overridable
        via gc_roots_dir. */
@@ -451,17 +1054,112 @@ private:
         prometheus::Counter& queue_checks_early_exits;
         prometheus::Counter& queue_checks_finished;
         prometheus::Gauge& queue_max_id;
+        prometheus::Counter& queue_changes_incremental;
+        prometheus::Counter& queue_changes_full;
+        prometheus::Gauge& db_write_queue_length;
+        prometheus::Counter& db_write_updates;
+        prometheus::Histogram& db_write_commit_seconds;
+        prometheus::Counter& drv_cache_hits;
+        prometheus::Counter& drv_cache_misses;
+        prometheus::Counter& drv_cache_evictions;
+        prometheus::Gauge& drv_cache_size;
+        prometheus::Histogram& dispatch_seconds;
+        prometheus::Family<prometheus::Histogram>& step_wait_seconds;
+        prometheus::Family<prometheus::Histogram>& step_phase_seconds;
+        prometheus::Histogram& db_transaction_seconds;
+        prometheus::Counter& dispatch_locality_picks;
+        prometheus::Family<prometheus::Histogram>& db_query_seconds;
+        prometheus::Gauge& db_replica_lag_seconds;
+        prometheus::Counter& db_replica_fallbacks;
 
         PromMetrics();
     };
     PromMetrics prom;
 
+    /* Exports the runtime state shown by ‘hydra-queue-runner
+       --status’ (queue sizes, per-machine and per-system type
+       statistics) to Prometheus. It's evaluated at scrape time, so
+       it costs nothing between scrapes. */
+    struct StateCollector : prometheus::Collectable
+    {
+        State & state;
+        StateCollector(State & state) : state(state) { }
+        std::vector<prometheus::MetricFamily> Collect() const override;
+    };
+    std::shared_ptr<StateCollector> stateCollector;
+
+    /* Reports the outstanding work per system type and feature set
+       on the exposer's ‘/demand’ endpoint, so that auto-scalers can
+       provision machines before the queue backs up. */
+    struct DemandCollector : prometheus::Collectable
+    {
+        State & state;
+        DemandCollector(State & state) : state(state) { }
+        std::vector<prometheus::MetricFamily> Collect() const override;
+
+    private:
+
+        /* The average duration of recent successful build steps per
+           platform, read from the BuildSteps table. */
+        struct StepTimes
+        {
+            time_t fetched = 0;
+            std::map<std::string, double> perPlatform;
+        };
+        mutable nix::Sync<StepTimes> stepTimes;
+
+        std::map<std::string, double> platformStepTimes() const;
+    };
+    std::shared_ptr<DemandCollector> demandCollector;
+
+    /* A database transaction in progress. Counts towards
+       ‘nrActiveDbUpdates’ and records its duration in
+       ‘db_transaction_seconds’. */
+    struct ActiveDbUpdate
+    {
+        nix::MaintainCount<counter> mc;
+        prometheus::Histogram & histogram;
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        ActiveDbUpdate(counter & count, prometheus::Histogram & histogram)
+            : mc(count), histogram(histogram) { }
+        ActiveDbUpdate(const ActiveDbUpdate &) = delete;
+        ~ActiveDbUpdate()
+        {
+            histogram.Observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+        }
+    };
+
 public:
     State(std::optional<std::string> metricsAddrOpt);
 
+#ifdef HYDRA_QUEUE_RUNNER_BENCH
+    /* The benchmark drives the scheduler without a database. */
+    friend class QueueRunnerBench;
+#endif
+
 private:
 
-    nix::MaintainCount<counter> startDbUpdate();
+    ActiveDbUpdate startDbUpdate();
+
+    /* Run the queries in ‘f’ on the replica if there is one that
+       isn't lagging too far behind, and on the primary (‘primary’,
+       or a connection from ‘dbPool’) otherwise. The queries must be
+       read-only and tolerate slightly stale data. They must also be
+       safe to repeat, since ‘f’ is run again on the primary if the
+       replica fails. */
+    void readFromReplica(std::function<void(Connection &)> f, Connection * primary = nullptr);
+
+    /* Periodically measure the lag of the replica. */
+    void replicaMonitor();
+
+    /* Apply ‘update’ asynchronously, after any previously queued
+       updates for the same build, and then call ‘done’. */
+    void queueDbUpdate(BuildID buildId, DbUpdate && update, DbUpdateDone && done = {});
+
+    /* Wait until all updates queued so far have been applied. */
+    void flushDbUpdates();
+
+    void dbWriter(DbWriter & writer);
 
     /* Return a store object to store build results. */
     nix::ref<nix::Store> getDestStore();
@@ -470,7 +1168,14 @@ private:
 
     void parseMachines(const std::string & contents);
 
-    /* Thread to reload /etc/nix/machines periodically. */
+    /* Rebuild the machines list from ‘machinesSources’. */
+    void reloadMachines();
+
+    /* Process ‘machines_update’ notifications. Each payload is
+       either ‘add <machines file line>’ or ‘remove <machine name>’. */
+    void updateMachines(const std::vector<std::string> & payloads);
+
+    /* Thread to reload /etc/nix/machines when it changes. */
     void monitorMachinesFile();
 
     unsigned int allocBuildStep(pqxx::work & txn, BuildID buildId);
@@ -489,6 +1194,12 @@ private:
 
     void updateBuild(pqxx::work & txn, Build::ptr build, BuildStatus status);
 
+    void loadStepDurations(Connection & conn);
+
+    void recordStepDuration(const nix::StorePath & drvPath, float duration);
+
+    float estimateStepDuration(const nix::StorePath & drvPath);
+
     void queueMonitor();
 
     void queueMonitorLoop();
@@ -497,19 +1208,78 @@ private:
     bool getQueuedBuilds(Connection & conn,
         nix::ref<nix::Store> destStore, unsigned int & lastBuildId);
 
-    /* Handle cancellation, deletion and priority bumps. */
-    void processQueueChange(Connection & conn);
-
-    BuildOutput getBuildOutputCached(Connection & conn, nix::ref<nix::Store> destStore,
-        const nix::Derivation & drv);
-
-    Step::ptr createStep(nix::ref<nix::Store> store,
-        Connection & conn, Build::ptr build, const nix::StorePath & drvPath,
-        Build::ptr referringBuild, Step::ptr referringStep, std::set<nix::StorePath> & finishedDrvs,
+    /* Handle cancellation, deletion and priority bumps of the builds
+       in ‘buildIds’, or of all builds. */
+    void processQueueChange(Connection & conn,
+        const std::optional<std::set<BuildID>> & buildIds = std::nullopt);
+
+    /* Return the outputs of each of ‘drvs’, taken from the most
+       recent successful build that produced them if there is one. */
+    std::vector<BuildOutput> getBuildOutputsCached(Connection & conn, nix::ref<nix::Store> destStore,
+        const std::vector<std::shared_ptr<nix::Derivation>> & drvs);
+
+    /* Return the parsed derivation ‘drvPath’, from ‘drvCache’ if
+       possible. */
+    std::shared_ptr<nix::Derivation> getDerivation(const nix::StorePath & drvPath);
+
+    /* Return the derivation of ‘step’, reloading it if it has been
+       dropped. */
+    std::shared_ptr<nix::Derivation> getStepDerivation(const Step & step);
+
+    /* Create the steps for ‘build’, i.e. for its derivation and all
+       dependencies that need to be built. The inputs of each new
+       derivation are expanded concurrently by up to ‘nrQueueThreads’
+       threads. Returns the top-level step, or 0 if the outputs of
+       the build are already valid. */
+    Step::ptr createSteps(nix::ref<nix::Store> destStore, Build::ptr build,
+        nix::Sync<std::set<nix::StorePath>> & finishedDrvs,
         std::set<Step::ptr> & newSteps, std::set<Step::ptr> & newRunnable);
 
+    /* Returns a database connection for the calling thread, which
+       it gets the first time it's called. */
+    typedef std::function<Connection &()> GetConnection;
+
+    /* Initialise a new step and return whether it needs to be
+       built. */
+    typedef std::function<bool(const GetConnection & conn, Step::ptr step)> InitStep;
+
+    /* The part of createSteps() that doesn't touch the database or
+       the stores: the traversal of the dependency graph and the
+       bookkeeping of ‘steps’. ‘initStep’ does the rest. */
+    Step::ptr expandSteps(Build::ptr build,
+        nix::Sync<std::set<nix::StorePath>> & finishedDrvs,
+        std::set<Step::ptr> & newSteps, std::set<Step::ptr> & newRunnable,
+        const InitStep & initStep);
+
+    /* Read the derivation of a new step and determine whether its
+       outputs are valid in ‘destStore’ (possibly after copying them
+       from the local store or a substituter). Returns true if the
+       step needs to be built. */
+    bool initStep(nix::ref<nix::Store> destStore, Connection & conn,
+        Build::ptr build, Step::ptr step);
+
+    /* Set the type and the scheduling hints of a step from its
+       derivation. */
+    void initStepType(Step::ptr step);
+
+    /* Add a build whose steps have been created to the queue, with
+       ‘toplevel’ as its top-level step. */
+    void addBuild(Build::ptr build, Step::ptr toplevel);
+
+    /* Divide the time spent building ‘step’ among the jobsets that
+       depend on it. */
+    void chargeStep(Step::ptr step, time_t startTime, time_t stopTime);
+
+    /* Call ‘markBuild’ for every unfinished build that has ‘step’ as
+       its top-level step, remove ‘step’ from ‘steps’, and make the
+       steps that now have no dependencies runnable. */
+    void finishSucceededStep(Step::ptr step, std::function<void(Build::ptr)> markBuild);
+
+    /* Remove a build whose finishing update was ‘committed’ (or
+       failed) from ‘builds’. */
+    void removeFinishedBuild(Build::ptr build, bool committed);
+
     void failStep(
-        Connection & conn,
         Step::ptr step,
         BuildID buildId,
         const RemoteResult & result,
@@ -521,6 +1291,10 @@ private:
 
     void processJobsetSharesChange(Connection & conn);
 
+    /* Recompute the critical path weights of all steps, if
+       ‘criticalPathsStale’ is set. */
+    void refreshCriticalPaths();
+
     void makeRunnable(Step::ptr step);
 
     /* The thread that selects and starts runnable builds. */
@@ -534,26 +1308,64 @@ private:
 
     void builder(MachineReservation::ptr reservation);
 
-    /* Perform the given build step. Return true if the step is to be
-       retried. */
-    enum StepResult { sDone, sRetry, sMaybeCancelled };
-    StepResult doBuildStep(nix::ref<nix::Store> destStore,
-        MachineReservation::ptr reservation,
-        std::shared_ptr<ActiveStep> activeStep);
-
-    void buildRemote(nix::ref<nix::Store> destStore,
-        Machine::ptr machine, Step::ptr step,
-        unsigned int maxSilentTime, unsigned int buildTimeout,
-        unsigned int repeats,
-        RemoteResult & result, std::shared_ptr<ActiveStep> activeStep,
-        std::function<void(StepState)> updateStep,
-        NarMemberDatas & narMembers);
+    /* Run (or resume) a build step on a builder thread. */
+    void runStep(StepRun::ptr run);
+
+    /* Perform the given build step. Return sParked if the step is
+       waiting for the remote machine, in which case the step waiter
+       will call resumeBuildStep() once the result is available. */
+    enum StepResult { sDone, sRetry, sMaybeCancelled, sParked };
+    StepResult doBuildStep(nix::ref<nix::Store> destStore, StepRun::ptr run);
+
+    StepResult resumeBuildStep(nix::ref<nix::Store> destStore, StepRun::ptr run);
+
+    /* Record the result of a build step in the database. */
+    StepResult finishStep(StepRun::ptr run, const BuildOutput & res);
+
+    void handleStepError(StepRun & run, nix::Error & e);
+
+    /* Queue the upload of the log of a finished step and mark it
+       as orphaned if it didn't finish in the database. */
+    void cleanupStep(nix::ref<nix::Store> destStore, StepRun & run);
+
+    /* Upload a complete build log to the binary cache, retrying
+       failed uploads. Runs on a log upload thread. */
+    void uploadLog(nix::ref<nix::Store> destStore, const nix::StorePath & drvPath,
+        const nix::Path & logFile);
+
+    /* Park a step until its remote build result is available. */
+    void parkStep(StepRun::ptr run);
+
+    /* The thread that resumes parked steps. */
+    void stepWaiter();
+
+    /* Connect to the machine, copy the inputs and start the build. */
+    void startRemoteBuild(nix::ref<nix::Store> destStore, StepRun & run,
+        std::function<void(StepState)> updateStep);
+
+    /* Read the build result and copy the outputs back. */
+    void finishRemoteBuild(nix::ref<nix::Store> destStore, StepRun & run,
+        std::function<void(StepState)> updateStep);
+
+    void disableMachine(Machine::ptr machine);
+
+    void accountTransfer(Machine::ptr machine, uint64_t received, uint64_t sent);
 
     void markSucceededBuild(pqxx::work & txn, Build::ptr build,
         const BuildOutput & res, bool isCachedBuild, time_t startTime, time_t stopTime);
 
     bool checkCachedFailure(Step::ptr step, Connection & conn);
 
+    /* Load the contents of the FailedPaths table into ‘failedPaths’. */
+    void loadFailedPaths(Connection & conn);
+
+    /* Record that ‘path’ is being added to FailedPaths. */
+    void addFailedPath(const std::string & path);
+
+    /* Add ‘paths’ to, or remove them from, the paths that are
+       being added to FailedPaths. */
+    void addPendingFailedPaths(const std::vector<std::string> & paths, bool add);
+
     void notifyBuildStarted(pqxx::work & txn, BuildID buildId);
 
     void notifyBuildFinished(pqxx::work & txn, BuildID buildId,
@@ -565,6 +1377,11 @@ private:
 
     void dumpStatus(Connection & conn);
 
+    /* Write the spans recorded by ‘tracer’ to ‘traceFile’. */
+    void dumpTrace(Connection & conn);
+
+    std::string traceFile() const;
+
     void addRoot(const nix::StorePath & storePath);
 
     void runMetricsExporter();
@@ -573,6 +1390,9 @@ public:
 
     void showStatus();
 
+    /* Print a Chrome trace of the recently finished steps. */
+    void showTrace();
+
     void unlock();
 
     void run(BuildID buildOne = 0);
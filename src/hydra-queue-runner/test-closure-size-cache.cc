@@ -0,0 +1,100 @@
+/* Tests for ClosureSizeCache. The store is a dummy store that
+   contains nothing, so any path that isn't cached fails to be
+   queried. */
+
+#include <cassert>
+#include <iostream>
+
+#include "closure-size-cache.hh"
+#include "shared.hh"
+
+using namespace nix;
+
+
+static StorePath path(const std::string & name)
+{
+    return StorePath(std::string(32, '0') + "-" + name);
+}
+
+
+static ValidPathInfo info(const std::string & name, uint64_t narSize, StorePathSet references)
+{
+    ValidPathInfo info(path(name), Hash(htSHA256));
+    info.narSize = narSize;
+    info.references = references;
+    return info;
+}
+
+
+static bool isCached(ClosureSizeCache & cache, Store & store, const StorePath & p)
+{
+    try {
+        cache.narSize(store, p);
+        return true;
+    } catch (InvalidPath &) {
+        return false;
+    }
+}
+
+
+static void testClosureSize(Store & store)
+{
+    ClosureSizeCache cache(100);
+
+    /* a -> b -> d, a -> c -> d, and d refers to itself. */
+    cache.insert(info("a", 1, {path("b"), path("c")}));
+    cache.insert(info("b", 10, {path("d")}));
+    cache.insert(info("c", 100, {path("d")}));
+    cache.insert(info("d", 1000, {path("d")}));
+
+    assert(cache.narSize(store, path("b")) == 10);
+
+    /* Shared dependencies are counted once. */
+    assert(cache.closureSize(store, {path("a")}) == 1111);
+    assert(cache.closureSize(store, {path("b"), path("c")}) == 1110);
+    assert(cache.closureSize(store, {}) == 0);
+    assert(cache.nrMisses == 0);
+
+    /* The closure size of a single path is cached. */
+    auto hits = cache.nrHits.load();
+    assert(cache.closureSize(store, {path("a")}) == 1111);
+    assert(cache.nrHits == hits + 1);
+
+    /* Inserting a path again replaces it. */
+    cache.insert(info("d", 2000, {}));
+    assert(cache.narSize(store, path("d")) == 2000);
+}
+
+
+static void testMisses(Store & store)
+{
+    ClosureSizeCache cache(2);
+
+    /* Paths that aren't cached are queried from the store. */
+    try {
+        cache.closureSize(store, {path("a")});
+        assert(false);
+    } catch (InvalidPath &) {
+    }
+    assert(cache.nrMisses == 1);
+
+    /* The least recently used path is evicted. */
+    cache.insert(info("a", 1, {}));
+    cache.insert(info("b", 2, {}));
+    assert(isCached(cache, store, path("a")));
+    cache.insert(info("c", 3, {}));
+    assert(isCached(cache, store, path("a")));
+    assert(!isCached(cache, store, path("b")));
+    assert(isCached(cache, store, path("c")));
+}
+
+
+int main()
+{
+    initNix();
+    auto store = openStore("dummy://");
+
+    testClosureSize(*store);
+    testMisses(*store);
+    std::cout << "ok\n";
+}
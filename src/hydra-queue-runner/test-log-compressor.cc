@@ -0,0 +1,137 @@
+/* Tests for LogCompressor: the log file is a sequence of complete
+   bzip2 streams that together decompress to the log. */
+
+#include <cassert>
+#include <future>
+#include <iostream>
+#include <thread>
+
+#include "log-compressor.hh"
+#include "compression.hh"
+
+using namespace nix;
+
+
+/* Split a log file into its bzip2 streams. */
+static std::vector<std::string> frames(const std::string & contents)
+{
+    /* The stream header followed by the block header. */
+    const std::string magic = "BZh91AY&SY";
+
+    std::vector<std::string> res;
+    size_t pos = 0;
+    while (pos < contents.size()) {
+        assert(contents.compare(pos, magic.size(), magic) == 0);
+        auto next = contents.find(magic, pos + 1);
+        if (next == std::string::npos) next = contents.size();
+        res.push_back(contents.substr(pos, next - pos));
+        pos = next;
+    }
+    return res;
+}
+
+
+static void waitUntilDone(LogCompressor & compressor, LogCompressor::Log & log)
+{
+    std::promise<void> promise;
+    compressor.whenDone(log, [&]() { promise.set_value(); });
+    promise.get_future().wait();
+}
+
+
+static void testFrames(LogCompressor & compressor, const Path & dir)
+{
+    AutoCloseFD writeSide;
+    auto log = compressor.create(dir + "/frames.log.bz2", writeSide);
+
+    std::string data;
+    for (size_t i = 0; i < 1000; ++i)
+        data += fmt("line %d of the build log\n", i);
+
+    /* Write in small pieces, so that frames end in the middle of
+       writes. */
+    for (size_t pos = 0; pos < data.size(); pos += 700)
+        writeFull(writeSide.get(), data.substr(pos, 700));
+    writeSide = -1;
+
+    waitUntilDone(compressor, *log);
+
+    auto contents = readFile(log->getPath());
+    assert(decompress("bzip2", contents) == data);
+
+    /* Every frame but the last holds at least a frame's worth of
+       log, and all of them are complete streams. */
+    auto parts = frames(contents);
+    assert(parts.size() > 1);
+    size_t total = 0;
+    for (size_t i = 0; i < parts.size(); ++i) {
+        auto part = decompress("bzip2", parts[i]);
+        assert(i + 1 == parts.size() || part.size() >= 4096);
+        total += part.size();
+    }
+    assert(total == data.size());
+
+    assert(log->tail() == data.substr(data.size() - 8192));
+
+    /* Calling whenDone() on a finished log calls back right away. */
+    bool called = false;
+    compressor.whenDone(*log, [&]() { called = true; });
+    assert(called);
+}
+
+
+static void testIdle(LogCompressor & compressor, const Path & dir)
+{
+    AutoCloseFD writeSide;
+    auto log = compressor.create(dir + "/idle.log.bz2", writeSide);
+
+    /* A quiet log is readable up to its last line while the build
+       is still running. */
+    writeFull(writeSide.get(), "still building\n");
+    bool readable = false;
+    for (int i = 0; i < 100 && !readable; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        try {
+            readable = decompress("bzip2", readFile(log->getPath())) == "still building\n";
+        } catch (Error &) {
+        }
+    }
+    assert(readable);
+
+    writeFull(writeSide.get(), "done\n");
+    writeSide = -1;
+    waitUntilDone(compressor, *log);
+    assert(decompress("bzip2", readFile(log->getPath())) == "still building\ndone\n");
+}
+
+
+static void testTruncate(LogCompressor & compressor, const Path & dir)
+{
+    AutoCloseFD writeSide;
+    auto log = compressor.create(dir + "/truncate.log.bz2", writeSide);
+
+    writeFull(writeSide.get(), "first attempt\n");
+    log->truncate();
+    writeFull(writeSide.get(), "second attempt\n");
+    writeSide = -1;
+
+    waitUntilDone(compressor, *log);
+    assert(decompress("bzip2", readFile(log->getPath())) == "second attempt\n");
+    assert(log->tail() == "second attempt\n");
+}
+
+
+int main()
+{
+    auto dir = createTempDir();
+    AutoDelete cleanup(dir, true);
+
+    LogCompressor compressor(4096, std::chrono::seconds(1));
+    compressor.start(2);
+
+    testFrames(compressor, dir);
+    testIdle(compressor, dir);
+    testTruncate(compressor, dir);
+
+    std::cout << "ok\n";
+}
@@ -0,0 +1,124 @@
+/* Tests for parsing the machines file and Machine::sameConfig(). */
+
+#include <cassert>
+#include <iostream>
+
+#include "state.hh"
+
+using namespace nix;
+
+typedef std::map<std::string, Machine::ptr> Machines;
+
+
+static Machines parse(const std::string & contents, const Machines & oldMachines = {}, bool * changed = nullptr)
+{
+    Machines machines;
+    auto changed2 = parseMachines(contents, oldMachines, machines);
+    if (changed) *changed = changed2;
+    return machines;
+}
+
+
+static void testParse()
+{
+    bool changed;
+    auto machines = parse(
+        "# a comment\n"
+        "root@a x86_64-linux,i686-linux /key 4 2 kvm,big-parallel benchmark c3NoLWtleQ==\n"
+        "root@b aarch64-linux - # trailing comment\n"
+        "root@c x86_64-linux\n"
+        "\n", {}, &changed);
+
+    assert(changed);
+    assert(machines.size() == 2);
+
+    auto & a(*machines.at("root@a"));
+    assert(a.enabled);
+    assert((a.systemTypes == StringSet{"x86_64-linux", "i686-linux"}));
+    assert(a.sshKey == "/key");
+    assert(a.maxJobs == 4);
+    assert(a.speedFactor == 2);
+    /* Mandatory features are also supported. */
+    assert((a.supportedFeatures == StringSet{"kvm", "big-parallel", "benchmark"}));
+    assert((a.mandatoryFeatures == StringSet{"benchmark"}));
+    assert(a.sshPublicHostKey == "ssh-key");
+    assert(a.state);
+
+    auto & b(*machines.at("root@b"));
+    assert(b.sshKey == "");
+    assert(b.maxJobs == 1);
+    assert(b.supportedFeatures.empty());
+    assert(b.sshPublicHostKey == "");
+
+    /* The last definition wins. */
+    machines = parse("m x86_64-linux - 1\nm x86_64-linux - 8\n");
+    assert(machines.at("m")->maxJobs == 8);
+}
+
+
+static void testSameConfig()
+{
+    auto a = parse("m x86_64-linux /key 4 1 kvm").at("m");
+    auto b = parse("m x86_64-linux /key 4 1 kvm").at("m");
+    assert(a->sameConfig(*b));
+
+    for (auto & line : {
+            "n x86_64-linux /key 4 1 kvm",
+            "m aarch64-linux /key 4 1 kvm",
+            "m x86_64-linux /key2 4 1 kvm",
+            "m x86_64-linux /key 5 1 kvm",
+            "m x86_64-linux /key 4 2 kvm",
+            "m x86_64-linux /key 4 1 -",
+            "m x86_64-linux /key 4 1 kvm kvm",
+            "m x86_64-linux /key 4 1 kvm - c3NoLWtleQ==",
+        })
+    {
+        auto c = parse(line).begin()->second;
+        assert(!a->sameConfig(*c));
+    }
+
+    auto disabled = std::make_shared<Machine>(*a);
+    disabled->enabled = false;
+    assert(!a->sameConfig(*disabled));
+}
+
+
+static void testReload()
+{
+    bool changed;
+    auto old = parse("a x86_64-linux - 1\nb x86_64-linux - 1\nc x86_64-linux - 1\n");
+
+    /* Unchanged machines keep their object; changed ones get a new
+       object with the same state; removed ones are disabled. */
+    auto machines = parse("a x86_64-linux - 1\nb x86_64-linux - 2\n", old, &changed);
+    assert(changed);
+    assert(machines.size() == 3);
+    assert(machines.at("a") == old.at("a"));
+    assert(machines.at("b") != old.at("b"));
+    assert(machines.at("b")->maxJobs == 2);
+    assert(machines.at("b")->state == old.at("b")->state);
+    assert(!machines.at("c")->enabled);
+    assert(old.at("c")->enabled);
+    assert(machines.at("c")->state == old.at("c")->state);
+
+    /* Nothing changes on an identical reload, and disabled machines
+       stay around. */
+    auto machines2 = parse("a x86_64-linux - 1\nb x86_64-linux - 2\n", machines, &changed);
+    assert(!changed);
+    assert(machines2 == machines);
+
+    /* A machine that comes back is enabled again, with its state. */
+    auto machines3 = parse("a x86_64-linux - 1\nb x86_64-linux - 2\nc x86_64-linux - 1\n", machines2, &changed);
+    assert(changed);
+    assert(machines3.at("c")->enabled);
+    assert(machines3.at("c")->state == old.at("c")->state);
+}
+
+
+int main()
+{
+    testParse();
+    testSameConfig();
+    testReload();
+    std::cout << "ok\n";
+}
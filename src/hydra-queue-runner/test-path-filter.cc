@@ -0,0 +1,76 @@
+/* Tests for PathFilter: no false negatives for recent paths, few
+   false positives, and ageing out of old generations. */
+
+#include <cassert>
+#include <iostream>
+#include <string>
+
+#include "path-filter.hh"
+
+
+static std::string path(size_t n)
+{
+    return "/nix/store/" + std::to_string(n) + "-path";
+}
+
+
+/* The number of paths in [from, to) that the filter claims to
+   contain. */
+static size_t count(const PathFilter & filter, size_t from, size_t to)
+{
+    size_t n = 0;
+    for (size_t i = from; i < to; ++i)
+        if (filter.contains(path(i))) n++;
+    return n;
+}
+
+
+static void testEmpty()
+{
+    PathFilter filter(100);
+    assert(!filter.full());
+    assert(count(filter, 0, 1000) == 0);
+}
+
+
+static void testContains()
+{
+    PathFilter filter(1000);
+
+    for (size_t i = 0; i < 999; ++i)
+        filter.insert(path(i));
+    assert(!filter.full());
+    filter.insert(PathFilter::hash(path(999)));
+    assert(filter.full());
+
+    /* No false negatives, and with 8 bits per path few false
+       positives (about 2.5%). */
+    assert(count(filter, 0, 1000) == 1000);
+    assert(count(filter, 1000, 11000) < 500);
+}
+
+
+static void testAgeing()
+{
+    PathFilter filter(1000);
+
+    /* The previous generation is still there... */
+    for (size_t i = 0; i < 2000; ++i)
+        filter.insert(path(i));
+    assert(count(filter, 0, 2000) == 2000);
+
+    /* ...but the one before is dropped. */
+    filter.insert(path(2000));
+    assert(!filter.full());
+    assert(count(filter, 1000, 2001) == 1001);
+    assert(count(filter, 0, 1000) < 100);
+}
+
+
+int main()
+{
+    testEmpty();
+    testContains();
+    testAgeing();
+    std::cout << "ok\n";
+}
@@ -0,0 +1,218 @@
+/* Tests for RunnableQueue: dispatch order, partitioning by machine,
+   retry times and stale steps. */
+
+#include <cassert>
+#include <iostream>
+
+#include "state.hh"
+
+using namespace nix;
+
+
+static const StepType x86 { "x86_64-linux", {}, false, "x86_64-linux" };
+static const StepType arm { "aarch64-linux", {}, false, "aarch64-linux" };
+static const StepType kvm { "x86_64-linux", {"kvm"}, false, "x86_64-linux:kvm" };
+
+
+static Step::ptr makeStep(const StepType & type,
+    int globalPriority = 0, int localPriority = 0, BuildID lowestBuildID = 1,
+    std::vector<Jobset::ptr> jobsets = {})
+{
+    static unsigned int nr = 0;
+    auto step = std::make_shared<Step>(StorePath(fmt("%032d-step", nr++)));
+    step->type = &type;
+    auto step_(step->state.lock());
+    step_->created = true;
+    step_->highestGlobalPriority = globalPriority;
+    step_->highestLocalPriority = localPriority;
+    step_->lowestBuildID = lowestBuildID;
+    step_->jobsets = jobsets;
+    return step;
+}
+
+
+static Machine::ptr makeMachine(const std::string & name,
+    std::set<std::string> systemTypes, std::set<std::string> supportedFeatures = {})
+{
+    auto machine = std::make_shared<Machine>();
+    machine->sshName = name;
+    machine->systemTypes = systemTypes;
+    machine->supportedFeatures = supportedFeatures;
+    return machine;
+}
+
+
+static void testOrder()
+{
+    auto machine = makeMachine("x86", {"x86_64-linux"});
+    RunnableQueue queue;
+    queue.setMachines({machine});
+
+    auto low = makeStep(x86, 0, 0, 10);
+    auto old = makeStep(x86, 0, 0, 5);
+    auto local = makeStep(x86, 0, 10, 20);
+    auto global = makeStep(x86, 100, 0, 30);
+
+    for (auto & step : {low, old, local, global})
+        queue.push(step);
+    queue.push(low); // no-op
+    assert(queue.size() == 4);
+
+    assert(queue.pop(machine) == global);
+    assert(queue.pop(machine) == local);
+    assert(queue.pop(machine) == old);
+    assert(queue.pop(machine) == low);
+    assert(!queue.pop(machine));
+    assert(queue.size() == 0);
+}
+
+
+static void testUpdate()
+{
+    auto machine = makeMachine("x86", {"x86_64-linux"});
+    RunnableQueue queue;
+    queue.setMachines({machine});
+
+    auto a = makeStep(x86, 0, 0, 1);
+    auto b = makeStep(x86, 0, 0, 2);
+    queue.push(a);
+    queue.push(b);
+
+    b->state.lock()->highestGlobalPriority = 1;
+    queue.update(b);
+
+    assert(queue.pop(machine) == b);
+    assert(queue.pop(machine) == a);
+
+    /* Updating a step that isn't queued does nothing. */
+    queue.update(a);
+    assert(queue.size() == 0);
+}
+
+
+static void testMachines()
+{
+    auto plain = makeMachine("plain", {"x86_64-linux"});
+    auto withKvm = makeMachine("kvm", {"x86_64-linux"}, {"kvm"});
+    RunnableQueue queue;
+    queue.setMachines({plain, withKvm});
+
+    auto a = makeStep(x86, 0, 0, 1);
+    auto b = makeStep(kvm, 0, 0, 2);
+    auto c = makeStep(arm, 0, 0, 3);
+    for (auto & step : {a, b, c})
+        queue.push(step);
+
+    /* Nothing can build ‘c’. */
+    auto now = std::chrono::system_clock::now();
+    auto unsupported = queue.unsupported(now);
+    assert(unsupported.size() == 1 && unsupported[0].first == c);
+
+    auto & stats(queue.typeStats());
+    assert(stats.at("x86_64-linux").count == 1);
+    assert(stats.at("x86_64-linux:kvm").count == 1);
+    assert(stats.at("aarch64-linux").count == 1);
+
+    assert(queue.pop(plain) == a);
+    assert(!queue.pop(plain));
+    assert(queue.pop(withKvm) == b);
+    assert(!queue.pop(withKvm));
+
+    /* Adding a machine makes ‘c’ buildable. */
+    auto aarch64 = makeMachine("arm", {"aarch64-linux"});
+    queue.setMachines({plain, withKvm, aarch64});
+    assert(queue.unsupported(now).empty());
+    assert(queue.pop(aarch64) == c);
+    assert(queue.typeStats().empty());
+}
+
+
+static void testRetry()
+{
+    auto machine = makeMachine("x86", {"x86_64-linux"});
+    RunnableQueue queue;
+    queue.setMachines({machine});
+
+    auto now = std::chrono::system_clock::now();
+    auto after = now + std::chrono::hours(1);
+
+    auto a = makeStep(x86, 100);
+    {
+        auto step_(a->state.lock());
+        step_->tries = 1;
+        step_->after = after;
+    }
+    auto b = makeStep(x86, 0);
+    queue.push(a);
+    queue.push(b);
+
+    /* ‘a’ isn't eligible until its retry time, despite its priority. */
+    assert(queue.promote(now) == after);
+    assert(queue.pop(machine) == b);
+    assert(!queue.pop(machine));
+    assert(queue.size() == 1);
+
+    assert(queue.promote(after) == system_time::max());
+    assert(queue.pop(machine) == a);
+}
+
+
+static void testStale()
+{
+    auto machine = makeMachine("x86", {"x86_64-linux"});
+    RunnableQueue queue;
+    queue.setMachines({machine});
+
+    auto a = makeStep(x86, 0, 0, 1);
+    auto b = makeStep(x86, 0, 0, 2);
+    auto c = makeStep(x86, 0, 0, 3);
+    for (auto & step : {a, b, c})
+        queue.push(step);
+
+    assert(queue.remove(b));
+    assert(!queue.remove(b));
+
+    /* Destroyed steps are skipped and forgotten. */
+    a.reset();
+    assert(queue.size() == 2);
+    assert(queue.steps() == std::vector<Step::ptr>{c});
+    assert(queue.size() == 1);
+
+    c.reset();
+    queue.prune();
+    assert(queue.size() == 0);
+    assert(queue.typeStats().empty());
+}
+
+
+static void testJobsets()
+{
+    auto machine = makeMachine("x86", {"x86_64-linux"});
+    RunnableQueue queue;
+    queue.setMachines({machine});
+
+    auto jobset1 = std::make_shared<Jobset>();
+    auto jobset2 = std::make_shared<Jobset>();
+
+    /* A step in several jobsets is only returned once. */
+    auto shared = makeStep(x86, 0, 0, 1, {jobset1, jobset2});
+    auto other = makeStep(x86, 0, 0, 2, {jobset2});
+    queue.push(shared);
+    queue.push(other);
+
+    assert(queue.pop(machine) == shared);
+    assert(queue.pop(machine) == other);
+    assert(!queue.pop(machine));
+}
+
+
+int main()
+{
+    testOrder();
+    testUpdate();
+    testMachines();
+    testRetry();
+    testStale();
+    testJobsets();
+    std::cout << "ok\n";
+}
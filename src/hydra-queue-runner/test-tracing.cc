@@ -0,0 +1,156 @@
+/* Tests for the Tracer ring buffer. */
+
+#include <cassert>
+#include <iostream>
+#include <map>
+#include <set>
+#include <sstream>
+#include <thread>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+#include "tracing.hh"
+
+using json = nlohmann::json;
+
+
+/* Return the span events and the process names of a trace. */
+static std::pair<std::vector<json>, std::map<uint64_t, std::string>> readTrace(const Tracer & tracer)
+{
+    std::ostringstream str;
+    tracer.writeChromeTrace(str);
+    auto trace = json::parse(str.str());
+
+    std::vector<json> spans;
+    std::map<uint64_t, std::string> processes;
+    for (auto & event : trace["traceEvents"]) {
+        if (event["ph"] == "X")
+            spans.push_back(event);
+        else if (event["ph"] == "M")
+            processes[event["pid"].get<uint64_t>()] = event["args"]["name"].get<std::string>();
+    }
+    return {spans, processes};
+}
+
+
+static void testDisabled()
+{
+    Tracer tracer(0);
+    Tracer::Context context;
+    { Tracer::Span span(tracer, context, "build"); }
+    assert(readTrace(tracer).first.empty());
+}
+
+
+static void testSpans()
+{
+    Tracer tracer(16);
+
+    Tracer::Context context;
+    context.id = tracer.newId();
+    context.machine = Tracer::intern("machine1");
+
+    auto start = Tracer::clock::time_point(std::chrono::seconds(1000));
+    tracer.record("connect", context, start, start + std::chrono::milliseconds(5));
+
+    {
+        /* The context is read when the span ends. */
+        Tracer::Span span(tracer, context, "build");
+        context.buildId = 42;
+        context.stepNr = 3;
+        span.stop();
+        span.stop();
+    }
+
+    auto [spans, processes] = readTrace(tracer);
+    assert(spans.size() == 2);
+
+    std::map<std::string, json> byName;
+    for (auto & span : spans) byName[span["name"].get<std::string>()] = span;
+
+    auto & connect(byName.at("connect"));
+    assert(connect["ts"] == 1000 * 1000000LL);
+    assert(connect["dur"] == 5000);
+    assert(connect["tid"] == context.id);
+    assert(connect["args"]["build"] == 0);
+
+    auto & build(byName.at("build"));
+    assert(build["args"]["build"] == 42);
+    assert(build["args"]["step"] == 3);
+    assert(build["dur"] >= 0);
+
+    assert(processes.size() == 1);
+    assert(processes.at(connect["pid"].get<uint64_t>()) == "machine1");
+
+    assert(Tracer::intern("machine1") == context.machine);
+    assert(tracer.newId() != context.id);
+}
+
+
+static void testOverwrite()
+{
+    Tracer tracer(4);
+    Tracer::Context context;
+    auto start = Tracer::clock::now();
+
+    /* Only the 4 most recent spans are kept. */
+    for (int i = 0; i < 10; ++i) {
+        context.stepNr = i;
+        tracer.record("step", context, start, start);
+    }
+
+    auto spans = readTrace(tracer).first;
+    assert(spans.size() == 4);
+    std::set<unsigned int> steps;
+    for (auto & span : spans) steps.insert(span["args"]["step"].get<unsigned int>());
+    assert((steps == std::set<unsigned int>{6, 7, 8, 9}));
+
+    /* Spans without a machine share a process. */
+    assert(readTrace(tracer).second.at(spans[0]["pid"].get<uint64_t>()) == "(none)");
+}
+
+
+static void testConcurrent()
+{
+    Tracer tracer(64);
+    auto machine = Tracer::intern("machine2");
+
+    /* Concurrent writers and a reader never produce torn spans: each
+       span read must be one that a writer recorded in a single
+       call. */
+    std::vector<std::thread> threads;
+    for (unsigned int t = 0; t < 4; ++t)
+        threads.emplace_back([&, t]() {
+            Tracer::Context context;
+            context.machine = machine;
+            context.id = t;
+            for (unsigned int i = 0; i < 10000; ++i) {
+                context.buildId = t * 100000 + i;
+                context.stepNr = i;
+                tracer.record("step", context, Tracer::clock::now(), Tracer::clock::now());
+            }
+        });
+
+    for (int i = 0; i < 20; ++i)
+        for (auto & span : readTrace(tracer).first) {
+            auto id = span["tid"].get<uint64_t>();
+            auto buildId = span["args"]["build"].get<uint64_t>();
+            auto stepNr = span["args"]["step"].get<uint64_t>();
+            assert(buildId == id * 100000 + stepNr);
+        }
+
+    for (auto & thread : threads) thread.join();
+
+    assert(readTrace(tracer).first.size() == 64);
+}
+
+
+int main()
+{
+    testDisabled();
+    testSpans();
+    testOverwrite();
+    testConcurrent();
+    std::cout << "ok\n";
+}
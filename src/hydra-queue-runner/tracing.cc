@@ -0,0 +1,113 @@
+#include <map>
+#include <set>
+
+#include <unistd.h>
+
+#include <nlohmann/json.hpp>
+
+#include "tracing.hh"
+#include "sync.hh"
+
+using namespace nix;
+
+using json = nlohmann::json;
+
+
+Tracer::Tracer(size_t capacity)
+    : capacity(capacity)
+    , slots(capacity ? std::make_unique<Slot[]>(capacity) : nullptr)
+{
+}
+
+
+void Tracer::record(const char * name, const Context & context,
+    clock::time_point start, clock::time_point stop)
+{
+    if (!capacity) return;
+
+    auto n = next.fetch_add(1, std::memory_order_relaxed);
+    auto & slot(slots[n % capacity]);
+
+    auto micros = [](clock::time_point t) {
+        return std::chrono::duration_cast<std::chrono::microseconds>(t.time_since_epoch()).count();
+    };
+
+    slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    slot.name.store(name, std::memory_order_relaxed);
+    slot.id.store(context.id, std::memory_order_relaxed);
+    slot.buildId.store(context.buildId, std::memory_order_relaxed);
+    slot.stepNr.store(context.stepNr, std::memory_order_relaxed);
+    slot.machine.store(context.machine, std::memory_order_relaxed);
+    slot.start.store(micros(start), std::memory_order_relaxed);
+    slot.stop.store(micros(stop), std::memory_order_relaxed);
+
+    slot.seq.store(2 * n + 2, std::memory_order_release);
+}
+
+
+const std::string * Tracer::intern(const std::string & s)
+{
+    static Sync<std::set<std::string>> strings;
+    return &*strings.lock()->insert(s).first;
+}
+
+
+void Tracer::writeChromeTrace(std::ostream & str) const
+{
+    auto events = json::array();
+    std::map<const std::string *, size_t> machines;
+
+    for (size_t i = 0; i < capacity; ++i) {
+        auto & slot(slots[i]);
+
+        auto seq1 = slot.seq.load(std::memory_order_acquire);
+        if (seq1 == 0 || seq1 % 2) continue;
+
+        auto name = slot.name.load(std::memory_order_relaxed);
+        auto id = slot.id.load(std::memory_order_relaxed);
+        auto buildId = slot.buildId.load(std::memory_order_relaxed);
+        auto stepNr = slot.stepNr.load(std::memory_order_relaxed);
+        auto machine = slot.machine.load(std::memory_order_relaxed);
+        auto start = slot.start.load(std::memory_order_relaxed);
+        auto stop = slot.stop.load(std::memory_order_relaxed);
+
+        /* Skip the slot if it was overwritten while we were reading
+           it. */
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot.seq.load(std::memory_order_relaxed) != seq1) continue;
+
+        auto pid = machines.emplace(machine, machines.size() + 1).first->second;
+
+        events.push_back({
+            {"name", name},
+            {"cat", "step"},
+            {"ph", "X"},
+            {"ts", start},
+            {"dur", stop - start},
+            {"pid", pid},
+            {"tid", id},
+            {"args", {
+                {"build", buildId},
+                {"step", stepNr},
+            }},
+        });
+    }
+
+    for (auto & [machine, pid] : machines)
+        events.push_back({
+            {"name", "process_name"},
+            {"ph", "M"},
+            {"pid", pid},
+            {"args", {{"name", machine ? *machine : "(none)"}}},
+        });
+
+    json trace = {
+        {"traceEvents", events},
+        {"displayTimeUnit", "ms"},
+        {"otherData", {{"pid", getpid()}}},
+    };
+
+    str << trace.dump() << "\n";
+}
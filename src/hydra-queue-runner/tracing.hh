@@ -0,0 +1,101 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <ostream>
+#include <string>
+
+
+/* A fixed-size ring buffer of spans recording how long each phase of
+   a build step took. Recording a span is lock-free (it claims a slot
+   with an atomic increment and fills it in), so tracing is cheap
+   enough to leave enabled. When the buffer is full, the oldest spans
+   are overwritten. */
+class Tracer
+{
+public:
+
+    typedef std::chrono::system_clock clock;
+
+    /* Identifies the step that spans belong to. ‘id’ is unique for
+       each attempt to perform a step. */
+    struct Context
+    {
+        uint64_t id = 0;
+        uint64_t buildId = 0;
+        unsigned int stepNr = 0;
+        const std::string * machine = nullptr;
+    };
+
+    /* A span that lasts from its construction until stop() is called
+       or it's destroyed. The context is read when the span is
+       recorded, so it may be filled in while the span is open. */
+    class Span
+    {
+        Tracer & tracer;
+        const Context & context;
+        const char * name;
+        clock::time_point start;
+        bool stopped = false;
+
+    public:
+
+        Span(Tracer & tracer, const Context & context, const char * name)
+            : tracer(tracer), context(context), name(name), start(clock::now()) { }
+
+        Span(const Span &) = delete;
+
+        ~Span() { stop(); }
+
+        void stop()
+        {
+            if (stopped) return;
+            stopped = true;
+            tracer.record(name, context, start, clock::now());
+        }
+    };
+
+    /* A capacity of 0 disables tracing. */
+    Tracer(size_t capacity);
+
+    /* Record a span. ‘name’ must have static storage duration. */
+    void record(const char * name, const Context & context,
+        clock::time_point start, clock::time_point stop);
+
+    /* Return a new unique context ID. */
+    uint64_t newId()
+    {
+        return ++lastId;
+    }
+
+    /* Return a pointer to a copy of ‘s’ that lives until the end of
+       the program, for use in contexts. */
+    static const std::string * intern(const std::string & s);
+
+    /* Write the recorded spans in the Chrome trace event format
+       (viewable in chrome://tracing or Perfetto). Each machine is
+       shown as a process and each step attempt as a thread. */
+    void writeChromeTrace(std::ostream & str) const;
+
+private:
+
+    struct Slot
+    {
+        /* Odd while the slot is being written; ‘2 * n + 2’ once span
+           number ‘n’ has been written to it. Readers use it to detect
+           torn reads. */
+        std::atomic<uint64_t> seq{0};
+
+        std::atomic<const char *> name{nullptr};
+        std::atomic<uint64_t> id{0}, buildId{0};
+        std::atomic<unsigned int> stepNr{0};
+        std::atomic<const std::string *> machine{nullptr};
+        std::atomic<int64_t> start{0}, stop{0}; // microseconds since the epoch
+    };
+
+    const size_t capacity;
+    std::unique_ptr<Slot[]> slots;
+    std::atomic<uint64_t> next{0};
+    std::atomic<uint64_t> lastId{0};
+};
@@ -0,0 +1,96 @@
+#pragma once
+
+#include <functional>
+#include <queue>
+#include <thread>
+
+#include "sync.hh"
+#include "util.hh"
+
+
+/* A fixed number of threads that execute work items in FIFO
+   order. Unlike nix::ThreadPool, this keeps running forever, so it
+   doesn't need anybody to call process(). */
+class WorkerPool
+{
+public:
+
+    typedef std::function<void()> Work;
+
+    WorkerPool(const std::string & name) : name(name) { }
+
+    /* Start the worker threads. */
+    void start(size_t nrThreads)
+    {
+        for (size_t n = 0; n < nrThreads; ++n)
+            std::thread([this]() { worker(); }).detach();
+        this->nrThreads = nrThreads;
+    }
+
+    void enqueue(Work && work)
+    {
+        {
+            auto state(state_.lock());
+            state->queue.push(std::move(work));
+        }
+        wakeup.notify_one();
+    }
+
+    size_t size() const { return nrThreads; }
+
+    /* The number of work items that haven't started yet. */
+    size_t queued()
+    {
+        return state_.lock()->queue.size();
+    }
+
+    /* The number of work items in progress. */
+    size_t active()
+    {
+        return state_.lock()->active;
+    }
+
+private:
+
+    std::string name;
+
+    std::atomic<size_t> nrThreads{0};
+
+    struct State
+    {
+        std::queue<Work> queue;
+        size_t active = 0;
+    };
+
+    nix::Sync<State> state_;
+
+    std::condition_variable wakeup;
+
+    void worker()
+    {
+        while (true) {
+            Work work;
+
+            {
+                auto state(state_.lock());
+                while (state->queue.empty())
+                    state.wait(wakeup);
+                work = std::move(state->queue.front());
+                state->queue.pop();
+                state->active++;
+            }
+
+            try {
+                work();
+            } catch (std::exception & e) {
+                nix::printError("%s: %s", name, e.what());
+            }
+
+            /* Destroy whatever the work item captured before it's
+               considered finished. */
+            work = nullptr;
+
+            state_.lock()->active--;
+        }
+    }
+};
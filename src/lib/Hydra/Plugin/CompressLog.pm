@@ -11,7 +11,7 @@ sub stepFinished {
 
     my $doCompress = $self->{config}->{'compress_build_logs'} // "1";
 
-    if ($doCompress eq "1" && -e $logPath) {
+    if ($doCompress eq "1" && -e $logPath && $logPath !~ /\.bz2$/) {
         print STDERR "compressing ‘$logPath’...\n";
         system("bzip2", "--force", $logPath);
     }
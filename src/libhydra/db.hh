@@ -7,12 +7,14 @@
 
 struct Connection : pqxx::connection
 {
-    Connection() : pqxx::connection(getFlags()) { };
+    /* Connect to the database denoted by the environment variable
+       ‘var’, a Perl DBI data source. */
+    Connection(const std::string & var = "HYDRA_DBI") : pqxx::connection(getFlags(var)) { };
 
-    std::string getFlags()
+    static std::string getFlags(const std::string & var)
     {
         using namespace nix;
-        auto s = getEnv("HYDRA_DBI").value_or("dbi:Pg:dbname=hydra;");
+        auto s = getEnv(var).value_or("dbi:Pg:dbname=hydra;");
 
         std::string lower_prefix = "dbi:Pg:";
         std::string upper_prefix = "DBI:Pg:";
@@ -21,7 +23,7 @@ struct Connection : pqxx::connection
             return concatStringsSep(" ", tokenizeString<Strings>(std::string(s, lower_prefix.size()), ";"));
         }
 
-        throw Error("$HYDRA_DBI does not denote a PostgreSQL database");
+        throw Error("$%s does not denote a PostgreSQL database", var);
     }
 };
 
@@ -29,6 +31,7 @@ struct Connection : pqxx::connection
 class receiver : public pqxx::notification_receiver
 {
     std::optional<std::string> status;
+    std::vector<std::string> payloads;
 
 public:
 
@@ -38,11 +41,22 @@ public:
     void operator() (const std::string & payload, int pid) override
     {
         status = payload;
+        payloads.push_back(payload);
     };
 
+    /* Return the payload of the last notification received since the
+       previous call to get() or getAll(). */
     std::optional<std::string> get() {
         auto s = status;
         status = std::nullopt;
+        payloads.clear();
         return s;
     }
+
+    /* Return the payloads of all notifications received since the
+       previous call to get() or getAll(). */
+    std::vector<std::string> getAll() {
+        status = std::nullopt;
+        return std::move(payloads);
+    }
 };
@@ -228,18 +228,42 @@ create table Builds (
 );
 
 
-create function notifyBuildsDeleted() returns trigger as 'begin notify builds_deleted; return null; end;' language plpgsql;
-create trigger BuildsDeleted after delete on Builds execute procedure notifyBuildsDeleted();
+-- Send a notification whose payload is a comma-separated list of the
+-- IDs of the affected builds, so that the queue runner only has to
+-- look at those builds. If there are too many to fit in a payload,
+-- the payload is empty, which means "check all builds".
+create function notifyBuildIds(channel text, ids text) returns void as $$
+  begin
+    if ids is not null then
+      perform pg_notify(channel, case when length(ids) <= 7900 then ids else '' end);
+    end if;
+  end;
+$$ language plpgsql;
+
+create function notifyBuildsDeleted() returns trigger as $$
+  begin
+    perform notifyBuildIds('builds_deleted', (select string_agg(id::text, ',') from oldBuilds));
+    return null;
+  end;
+$$ language plpgsql;
+
+create trigger BuildsDeleted after delete on Builds
+  referencing old table as oldBuilds
+  for each statement
+  execute procedure notifyBuildsDeleted();
 
 create function notifyBuildRestarted() returns trigger as 'begin notify builds_restarted; return null; end;' language plpgsql;
 create trigger BuildRestarted after update on Builds for each row
   when (old.finished = 1 and new.finished = 0) execute procedure notifyBuildRestarted();
 
-create function notifyBuildCancelled() returns trigger as 'begin notify builds_cancelled; return null; end;' language plpgsql;
+-- Updates of Builds are frequent and rarely matter to the queue
+-- runner, so these are row-level triggers that only fire for
+-- qualifying rows. Each sends the ID of its build.
+create function notifyBuildCancelled() returns trigger as 'begin perform pg_notify(''builds_cancelled'', new.id::text); return null; end;' language plpgsql;
 create trigger BuildCancelled after update on Builds for each row
   when (old.finished = 0 and new.finished = 1 and new.buildStatus = 4) execute procedure notifyBuildCancelled();
 
-create function notifyBuildBumped() returns trigger as 'begin notify builds_bumped; return null; end;' language plpgsql;
+create function notifyBuildBumped() returns trigger as 'begin perform pg_notify(''builds_bumped'', new.id::text); return null; end;' language plpgsql;
 create trigger BuildBumped after update on Builds for each row
   when (old.globalPriority != new.globalPriority) execute procedure notifyBuildBumped();
 
@@ -625,6 +649,10 @@ create rule IdempotentInsert as on insert to FailedPaths
   where exists (select 1 from FailedPaths where path = new.path)
   do instead nothing;
 
+create function notifyFailedPathsDeleted() returns trigger as 'begin notify failed_paths_deleted; return null; end;' language plpgsql;
+create trigger FailedPathsDeleted after delete or truncate on FailedPaths
+  for each statement execute procedure notifyFailedPathsDeleted();
+
 
 
 create table SystemStatus (
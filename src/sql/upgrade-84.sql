@@ -0,0 +1,41 @@
+-- Include the IDs of the affected builds in builds_deleted,
+-- builds_cancelled and builds_bumped notifications.
+
+create function notifyBuildIds(channel text, ids text) returns void as $$
+  begin
+    if ids is not null then
+      perform pg_notify(channel, case when length(ids) <= 7900 then ids else '' end);
+    end if;
+  end;
+$$ language plpgsql;
+
+drop trigger BuildsDeleted on Builds;
+drop function notifyBuildsDeleted();
+
+create function notifyBuildsDeleted() returns trigger as $$
+  begin
+    perform notifyBuildIds('builds_deleted', (select string_agg(id::text, ',') from oldBuilds));
+    return null;
+  end;
+$$ language plpgsql;
+
+create trigger BuildsDeleted after delete on Builds
+  referencing old table as oldBuilds
+  for each statement
+  execute procedure notifyBuildsDeleted();
+
+drop trigger BuildCancelled on Builds;
+drop function notifyBuildCancelled();
+drop trigger BuildBumped on Builds;
+drop function notifyBuildBumped();
+
+-- Updates of Builds are frequent and rarely matter to the queue
+-- runner, so these are row-level triggers that only fire for
+-- qualifying rows. Each sends the ID of its build.
+create function notifyBuildCancelled() returns trigger as 'begin perform pg_notify(''builds_cancelled'', new.id::text); return null; end;' language plpgsql;
+create trigger BuildCancelled after update on Builds for each row
+  when (old.finished = 0 and new.finished = 1 and new.buildStatus = 4) execute procedure notifyBuildCancelled();
+
+create function notifyBuildBumped() returns trigger as 'begin perform pg_notify(''builds_bumped'', new.id::text); return null; end;' language plpgsql;
+create trigger BuildBumped after update on Builds for each row
+  when (old.globalPriority != new.globalPriority) execute procedure notifyBuildBumped();
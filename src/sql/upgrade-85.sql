@@ -0,0 +1,6 @@
+-- Tell the queue runner to reload its cache of failed paths when
+-- some of them are cleared.
+
+create function notifyFailedPathsDeleted() returns trigger as 'begin notify failed_paths_deleted; return null; end;' language plpgsql;
+create trigger FailedPathsDeleted after delete or truncate on FailedPaths
+  for each statement execute procedure notifyFailedPathsDeleted();